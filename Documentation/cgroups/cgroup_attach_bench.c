@@ -0,0 +1,159 @@
+/*
+ * cgroup_attach_bench.c - time moving a multi-threaded process between
+ * two cgroups
+ *
+ * Starts a process with <threads> threads and moves it back and forth
+ * between two existing cgroups of the same hierarchy, <loops> times each
+ * way, in three ways:
+ *
+ *   procs:  write the tgid to cgroup.procs
+ *   list:   write every tid to tasks, in a single write
+ *   each:   write every tid to tasks, one write per tid
+ *
+ * and prints the average time one move of the whole process took.
+ *
+ * Example:
+ *	mkdir /dev/cpuctl/a /dev/cpuctl/b
+ *	cgroup_attach_bench /dev/cpuctl/a /dev/cpuctl/b 100 1000
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#define USAGE_STR "Usage: cgroup_attach_bench <cgroup-a> <cgroup-b> " \
+		  "[threads] [loops]\n"
+
+static pid_t *tids;
+static int nr_tids;
+static pthread_mutex_t tids_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *thread_fn(void *arg)
+{
+	pthread_mutex_lock(&tids_lock);
+	tids[nr_tids++] = syscall(SYS_gettid);
+	pthread_mutex_unlock(&tids_lock);
+	for (;;)
+		pause();
+	return NULL;
+}
+
+static int write_file(const char *dir, const char *file, const char *buf)
+{
+	char path[PATH_MAX];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (write(fd, buf, strlen(buf)) == -1) {
+		fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+static int move(const char *dir, const char *mode, char *buf, size_t len)
+{
+	char *p;
+	int i;
+
+	if (!strcmp(mode, "procs")) {
+		snprintf(buf, len, "%d", getpid());
+		return write_file(dir, "cgroup.procs", buf);
+	}
+	if (!strcmp(mode, "list")) {
+		p = buf;
+		for (i = 0; i < nr_tids; i++)
+			p += sprintf(p, "%d ", tids[i]);
+		return write_file(dir, "tasks", buf);
+	}
+	for (i = 0; i < nr_tids; i++) {
+		snprintf(buf, len, "%d", tids[i]);
+		if (write_file(dir, "tasks", buf))
+			return -1;
+	}
+	return 0;
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *modes[] = { "procs", "list", "each" };
+	int threads = 100, loops = 1000;
+	pthread_t thread;
+	size_t len;
+	char *buf;
+	double start;
+	int i, m;
+
+	if (argc < 3 || argc > 5) {
+		fputs(USAGE_STR, stderr);
+		return 1;
+	}
+	if (argc > 3)
+		threads = atoi(argv[3]);
+	if (argc > 4)
+		loops = atoi(argv[4]);
+	if (threads < 1 || loops < 1) {
+		fputs(USAGE_STR, stderr);
+		return 1;
+	}
+
+	tids = calloc(threads, sizeof(*tids));
+	len = threads * 12 + 1;
+	buf = malloc(len);
+	if (!tids || !buf) {
+		fputs("Out of memory\n", stderr);
+		return 1;
+	}
+
+	/* the main thread is one of them */
+	tids[nr_tids++] = syscall(SYS_gettid);
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&thread, NULL, thread_fn, NULL)) {
+			fputs("Cannot create threads\n", stderr);
+			return 1;
+		}
+	}
+	while (1) {
+		pthread_mutex_lock(&tids_lock);
+		i = nr_tids;
+		pthread_mutex_unlock(&tids_lock);
+		if (i == threads)
+			break;
+		usleep(1000);
+	}
+
+	for (m = 0; m < 3; m++) {
+		start = now_us();
+		for (i = 0; i < loops; i++) {
+			if (move(argv[2], modes[m], buf, len) ||
+			    move(argv[1], modes[m], buf, len))
+				return 1;
+		}
+		printf("%-6s %d threads: %.1f us per move\n", modes[m],
+		       threads, (now_us() - start) / (2 * loops));
+	}
+
+	return 0;
+}
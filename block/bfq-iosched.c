@@ -354,6 +354,7 @@ static void bfq_add_rq_rb(struct request *rq)
 	struct bfq_data *bfqd = bfqq->bfqd;
 	struct request *__alias, *next_rq;
 	unsigned long old_raising_coeff = bfqq->raising_coeff;
+	int idle_for_long_time, soft_rt;
 
 	bfq_log_bfqq(bfqd, bfqq, "add_rq_rb %d", rq_is_sync(rq));
 	bfqq->queued[rq_is_sync(rq)]++;
@@ -379,19 +380,33 @@ static void bfq_add_rq_rb(struct request *rq)
 
 		if (! bfqd->low_latency)
 			goto add_bfqq_busy;
+
+		idle_for_long_time = bfqq->last_rais_start_finish +
+			bfqd->bfq_raising_min_idle_time < jiffies;
+		soft_rt = bfqd->bfq_raising_max_softrt_rate > 0 &&
+			bfqq->soft_rt_next_start < jiffies;
 		/*
 		 * If the queue is not being boosted and has been idle
-		 * for enough time, start a boosting period
+		 * for enough time (a new queue always has), or it is
+		 * issuing requests at a soft real-time rate, start a
+		 * boosting period. Soft real-time periods are shorter,
+		 * and are renewed for as long as the queue keeps to its
+		 * rate.
 		 */
-		if(old_raising_coeff == 1 &&
- 		    bfqq->last_rais_start_finish +
- 		    bfqd->bfq_raising_min_idle_time < jiffies) {
+		if(old_raising_coeff == 1 && (idle_for_long_time || soft_rt)) {
  			bfqq->raising_coeff = bfqd->bfq_raising_coeff;
+			bfqq->raising_cur_max_time = idle_for_long_time ?
+				bfqd->bfq_raising_max_time :
+				bfqd->bfq_raising_rt_max_time;
  			entity->ioprio_changed = 1;
  			bfq_log_bfqq(bfqd, bfqq,
- 				     "wrais starting at %lu msec",
- 				     bfqq->last_rais_start_finish);
-  		}
+ 				     "wrais starting at %lu msec (%s)",
+ 				     bfqq->last_rais_start_finish,
+				     idle_for_long_time ? "interactive" :
+				     "soft rt");
+  		} else if (old_raising_coeff > 1 && soft_rt)
+			bfqq->raising_cur_max_time =
+				bfqd->bfq_raising_rt_max_time;
 add_bfqq_busy:
 		bfq_add_bfqq_busy(bfqd, bfqq);
 	} else
@@ -1175,10 +1190,10 @@ static int __bfq_dispatch_requests(struct bfq_data *bfqd,
 			struct bfq_entity *entity = &bfqq->entity;
 
 			bfq_log_bfqq(bfqd, bfqq,
-				"raising period dur %llu/%lu msec, "
+				"raising period dur %llu/%u msec, "
 				"old raising coeff %lu, w %lu(%lu)",
 				jiffies - bfqq->last_rais_start_finish,
-				bfqd->bfq_raising_max_time,
+				bfqq->raising_cur_max_time,
 				bfqq->raising_coeff,
 				bfqq->entity.weight, bfqq->entity.orig_weight);
 
@@ -1192,7 +1207,7 @@ static int __bfq_dispatch_requests(struct bfq_data *bfqd,
 			 * of this weight-raising period, stop it
 			 */
 			if (jiffies - bfqq->last_rais_start_finish >
-				bfqd->bfq_raising_max_time) {
+				bfqq->raising_cur_max_time) {
 				bfqq->raising_coeff = 1;
 				bfqq->last_rais_start_finish = jiffies;
 
@@ -1506,6 +1521,7 @@ retry:
 		bfqq->pid = current->pid;
 
 		bfqq->raising_coeff = 1;
+		bfqq->raising_cur_max_time = 0;
 		bfqq->last_rais_start_finish = 0;
 		bfqq->soft_rt_next_start = -1;
 
@@ -2156,6 +2172,7 @@ static void *bfq_init_queue(struct request_queue *q)
 
 	bfqd->bfq_raising_coeff = 20;
 	bfqd->bfq_raising_max_time = msecs_to_jiffies(7500);
+	bfqd->bfq_raising_rt_max_time = msecs_to_jiffies(300);
 	bfqd->bfq_raising_min_idle_time = msecs_to_jiffies(2000);
 	bfqd->bfq_raising_max_softrt_rate = 7000;
 
@@ -2245,6 +2262,7 @@ SHOW_FUNCTION(bfq_timeout_async_show, bfqd->bfq_timeout[BLK_RW_ASYNC], 1);
 SHOW_FUNCTION(bfq_low_latency_show, bfqd->low_latency, 0);
 SHOW_FUNCTION(bfq_raising_coeff_show, bfqd->bfq_raising_coeff, 0);
 SHOW_FUNCTION(bfq_raising_max_time_show, bfqd->bfq_raising_max_time, 1);
+SHOW_FUNCTION(bfq_raising_rt_max_time_show, bfqd->bfq_raising_rt_max_time, 1);
 SHOW_FUNCTION(bfq_raising_min_idle_time_show, bfqd->bfq_raising_min_idle_time,
 	1);
 SHOW_FUNCTION(bfq_raising_max_softrt_rate_show,
@@ -2285,6 +2303,8 @@ STORE_FUNCTION(bfq_raising_coeff_store, &bfqd->bfq_raising_coeff, 1,
  		INT_MAX, 0);
 STORE_FUNCTION(bfq_raising_max_time_store, &bfqd->bfq_raising_max_time, 0,
  		INT_MAX, 1);
+STORE_FUNCTION(bfq_raising_rt_max_time_store, &bfqd->bfq_raising_rt_max_time, 0,
+		INT_MAX, 1);
 STORE_FUNCTION(bfq_raising_min_idle_time_store,
  	       &bfqd->bfq_raising_min_idle_time, 0, INT_MAX, 1);
 STORE_FUNCTION(bfq_raising_max_softrt_rate_store,
@@ -2378,6 +2398,7 @@ static struct elv_fs_entry bfq_attrs[] = {
 	BFQ_ATTR(low_latency),
 	BFQ_ATTR(raising_coeff),
 	BFQ_ATTR(raising_max_time),
+	BFQ_ATTR(raising_rt_max_time),
 	BFQ_ATTR(raising_min_idle_time),
 	BFQ_ATTR(raising_max_softrt_rate),
 	BFQ_ATTR(weights),
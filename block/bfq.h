@@ -210,6 +210,7 @@ struct bfq_group;
  * @bfq_raising_coeff: Maximum factor by which the weight of a boosted
  *                            queue is multiplied
  * @bfq_raising_max_time: maximum duration of a weight-raising period (jiffies)
+ * @bfq_raising_rt_max_time: maximum duration for soft real-time processes
  * @bfq_raising_min_idle_time: minimum idle period after which weight-raising
  *			       may be reactivated for a queue (in jiffies)
  * @bfq_raising_max_softrt_rate: max service-rate for a soft real-time queue,
@@ -269,6 +270,7 @@ struct bfq_data {
 	/* parameters of the low_latency heuristics */
 	unsigned int bfq_raising_coeff;
 	unsigned int bfq_raising_max_time;
+	unsigned int bfq_raising_rt_max_time;
 	unsigned int bfq_raising_min_idle_time;
 	unsigned int bfq_raising_max_softrt_rate;
 };
@@ -298,6 +300,8 @@ struct bfq_data {
  * @pid: pid of the process owning the queue, used for logging purposes.
  * @last_rais_start_time: last (idle -> weight-raised) transition attempt
  * @high_weight_budget: number of sectors left to serve with boosted weight
+ * @raising_cur_max_time: duration of the current weight-raising period,
+ *                        interactive or soft real-time (jiffies)
  *
  * A bfq_queue is a leaf request queue; it can be associated to an io_context
  * or more (if it is an async one).  @cgroup holds a reference to the
@@ -341,6 +345,7 @@ struct bfq_queue {
 	/* weight-raising fileds */
  	u64 last_rais_start_finish, soft_rt_next_start;
  	unsigned int raising_coeff;
+	unsigned int raising_cur_max_time;
 };
 
 enum bfqq_state_flags {
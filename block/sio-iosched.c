@@ -12,6 +12,17 @@
  * Asynchronous and synchronous requests are not treated separately, but
  * we relay on deadlines to ensure fairness.
  *
+ * Optionally a target read latency can be set. SIO then measures how long
+ * the device takes to complete requests and limits how many asynchronous
+ * requests it dispatches per window, so that reads arriving during
+ * writeback find the device idle often enough. The limit is applied at
+ * dispatch rather than on requests in flight, as mmc hosts only ever have
+ * one request in flight.
+ *
+ * The latency histograms only see requests that went through the
+ * elevator: flushes and requests queued around it (e.g. passthrough
+ * commands) are not counted.
+ *
  */
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
@@ -19,6 +30,7 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
 
 enum {
 	ASYNC,
@@ -30,6 +42,21 @@ static const int sync_expire = HZ / 2;	/* max time before a sync is submitted. *
 static const int async_expire = 5 * HZ;	/* ditto for async, these limits are SOFT! */
 static const int fifo_batch = 16;	/* # of sequential requests treated as one
 					   by the above parameters. For throughput. */
+static const int target_latency = 0;	/* target read latency in msecs, 0 = off */
+
+#define SIO_LAT_SAMPLES		64	/* completions remembered per direction */
+#define SIO_LAT_BUCKETS		9	/* <1ms, <2ms, ... <128ms, >=128ms */
+#define SIO_QUOTA_SAMPLES	8	/* reads between async quota changes */
+#define SIO_READ_IDLE		(HZ / 10)	/* no reads for this long: let
+						   async quota recover */
+#define SIO_ASYNC_WINDOW	(HZ / 10)	/* async quota period */
+
+/* Recent completion latencies, in usecs */
+struct sio_latency {
+	unsigned int sample[SIO_LAT_SAMPLES];
+	unsigned int next;
+	unsigned int count;
+};
 
 /* Elevator data */
 struct sio_data {
@@ -42,8 +69,30 @@ struct sio_data {
 	/* Settings */
 	int fifo_expire[2];
 	int fifo_batch;
+	int target_latency;
+
+	/* Latency target mode */
+	struct request_queue *queue;
+	unsigned int async_quota;	/* max async dispatches per window */
+	unsigned int async_dispatched;	/* ... so far in this window */
+	unsigned long window_start;	/* jiffies at the start of the window */
+	unsigned int read_avg;		/* moving average read latency, usecs */
+	unsigned int read_samples;	/* reads since async_quota last changed */
+	unsigned long last_read;	/* jiffies at the last read completion */
+	int throttled;			/* async held back by async_quota */
+	struct timer_list window_timer;	/* kicks the queue for a new window */
+	struct work_struct kick_work;
+
+	/* Per data direction completion latencies */
+	struct sio_latency latency[2];
 };
 
+static inline unsigned long
+sio_now_us(void)
+{
+	return (unsigned long)ktime_to_us(ktime_get());
+}
+
 static void
 sio_merged_requests(struct request_queue *q, struct request *rq,
 		    struct request *next)
@@ -105,6 +154,21 @@ sio_expired_request(struct sio_data *sd, int sync)
 	return NULL;
 }
 
+static int
+sio_async_throttled(struct sio_data *sd)
+{
+	if (!sd->target_latency)
+		return 0;
+
+	/* Start a new window */
+	if (time_after_eq(jiffies, sd->window_start + SIO_ASYNC_WINDOW)) {
+		sd->window_start = jiffies;
+		sd->async_dispatched = 0;
+	}
+
+	return sd->async_dispatched >= sd->async_quota;
+}
+
 static struct request *
 sio_choose_expired_request(struct sio_data *sd)
 {
@@ -113,10 +177,11 @@ sio_choose_expired_request(struct sio_data *sd)
 
 	/*
 	 * Check expired requests. Asynchronous requests have
-	 * priority over synchronous.
+	 * priority over synchronous, unless this window's async
+	 * quota is used up.
 	 */
 	if (sync && async)
-		return async;
+		return sio_async_throttled(sd) ? sync : async;
 	if (sync)
 		return sync;
 
@@ -151,6 +216,8 @@ sio_dispatch_request(struct sio_data *sd, struct request *rq)
 	elv_dispatch_add_tail(rq->q, rq);
 
 	sd->batched++;
+	if (!rq_is_sync(rq))
+		sd->async_dispatched++;
 }
 
 static int
@@ -175,12 +242,105 @@ sio_dispatch_requests(struct request_queue *q, int force)
 			return 0;
 	}
 
+	/*
+	 * Hold asynchronous requests back once this window's quota
+	 * has been dispatched. The window timer kicks the queue again.
+	 */
+	if (!force && !rq_is_sync(rq) && sio_async_throttled(sd)) {
+		if (list_empty(&sd->fifo_list[SYNC])) {
+			sd->throttled = 1;
+			mod_timer(&sd->window_timer,
+				  sd->window_start + SIO_ASYNC_WINDOW);
+			return 0;
+		}
+		rq = rq_entry_fifo(sd->fifo_list[SYNC].next);
+	}
+
 	/* Dispatch request */
 	sio_dispatch_request(sd, rq);
 
 	return 1;
 }
 
+static void
+sio_activate_request(struct request_queue *q, struct request *rq)
+{
+	/* Remember when the driver got the request */
+	rq->elevator_private = (void *)sio_now_us();
+}
+
+static void
+sio_update_async_quota(struct sio_data *sd, unsigned int lat)
+{
+	/* Moving average of the read latency, weight 1/8 */
+	if (sd->read_avg)
+		sd->read_avg += (int)(lat - sd->read_avg) / 8;
+	else
+		sd->read_avg = lat;
+	sd->last_read = jiffies;
+
+	if (++sd->read_samples < SIO_QUOTA_SAMPLES)
+		return;
+	sd->read_samples = 0;
+
+	/*
+	 * Halve the async quota while reads miss the target,
+	 * and let it grow back one request at a time.
+	 */
+	if (sd->read_avg > sd->target_latency * USEC_PER_MSEC)
+		sd->async_quota = max(sd->async_quota / 2, 1U);
+	else if (sd->async_quota < sd->queue->nr_requests)
+		sd->async_quota++;
+}
+
+static void
+sio_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+	struct sio_latency *l = &sd->latency[rq_data_dir(rq)];
+	unsigned int lat = sio_now_us() - (unsigned long)rq->elevator_private;
+
+	l->sample[l->next] = lat;
+	l->next = (l->next + 1) % SIO_LAT_SAMPLES;
+	if (l->count < SIO_LAT_SAMPLES)
+		l->count++;
+
+	if (!sd->target_latency)
+		return;
+
+	if (rq_data_dir(rq) == READ)
+		sio_update_async_quota(sd, lat);
+	else if (time_after(jiffies, sd->last_read + SIO_READ_IDLE) &&
+		 sd->async_quota < q->nr_requests)
+		sd->async_quota++;
+}
+
+static void
+sio_window_timer(unsigned long data)
+{
+	struct sio_data *sd = (struct sio_data *)data;
+	struct request_queue *q = sd->queue;
+	unsigned long flags;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	if (sd->throttled) {
+		sd->throttled = 0;
+		kblockd_schedule_work(q, &sd->kick_work);
+	}
+	spin_unlock_irqrestore(q->queue_lock, flags);
+}
+
+static void
+sio_kick_queue(struct work_struct *work)
+{
+	struct sio_data *sd = container_of(work, struct sio_data, kick_work);
+	struct request_queue *q = sd->queue;
+
+	spin_lock_irq(q->queue_lock);
+	__blk_run_queue(q);
+	spin_unlock_irq(q->queue_lock);
+}
+
 static struct request *
 sio_former_request(struct request_queue *q, struct request *rq)
 {
@@ -226,6 +386,20 @@ sio_init_queue(struct request_queue *q)
 	sd->fifo_expire[SYNC] = sync_expire;
 	sd->fifo_expire[ASYNC] = async_expire;
 	sd->fifo_batch = fifo_batch;
+	sd->target_latency = target_latency;
+
+	/* Initialize latency target mode */
+	sd->queue = q;
+	sd->async_quota = q->nr_requests;
+	sd->async_dispatched = 0;
+	sd->window_start = jiffies;
+	sd->read_avg = 0;
+	sd->read_samples = 0;
+	sd->last_read = jiffies;
+	sd->throttled = 0;
+	setup_timer(&sd->window_timer, sio_window_timer, (unsigned long)sd);
+	INIT_WORK(&sd->kick_work, sio_kick_queue);
+	memset(sd->latency, 0, sizeof(sd->latency));
 
 	return sd;
 }
@@ -235,6 +409,9 @@ sio_exit_queue(struct elevator_queue *e)
 {
 	struct sio_data *sd = e->elevator_data;
 
+	del_timer_sync(&sd->window_timer);
+	cancel_work_sync(&sd->kick_work);
+
 	BUG_ON(!list_empty(&sd->fifo_list[SYNC]));
 	BUG_ON(!list_empty(&sd->fifo_list[ASYNC]));
 
@@ -273,6 +450,8 @@ static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
 SHOW_FUNCTION(sio_sync_expire_show, sd->fifo_expire[SYNC], 1);
 SHOW_FUNCTION(sio_async_expire_show, sd->fifo_expire[ASYNC], 1);
 SHOW_FUNCTION(sio_fifo_batch_show, sd->fifo_batch, 0);
+SHOW_FUNCTION(sio_target_latency_show, sd->target_latency, 0);
+SHOW_FUNCTION(sio_async_quota_show, sd->async_quota, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -296,6 +475,70 @@ STORE_FUNCTION(sio_async_expire_store, &sd->fifo_expire[ASYNC], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
 #undef STORE_FUNCTION
 
+static ssize_t
+sio_target_latency_store(struct elevator_queue *e, const char *page,
+			 size_t count)
+{
+	struct sio_data *sd = e->elevator_data;
+	struct request_queue *q = sd->queue;
+	int data;
+	int ret = sio_var_store(&data, page, count);
+
+	if (data < 0)
+		data = 0;
+
+	/* Start again from an unthrottled queue */
+	spin_lock_irq(q->queue_lock);
+	sd->target_latency = data;
+	sd->async_quota = q->nr_requests;
+	sd->async_dispatched = 0;
+	sd->read_avg = 0;
+	sd->read_samples = 0;
+	if (sd->throttled) {
+		sd->throttled = 0;
+		kblockd_schedule_work(q, &sd->kick_work);
+	}
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
+static ssize_t
+sio_latency_show(struct sio_latency *l, char *page)
+{
+	unsigned int bucket[SIO_LAT_BUCKETS] = { 0 };
+	char *p = page;
+	unsigned int i, ms, b;
+
+	for (i = 0; i < l->count; i++) {
+		ms = l->sample[i] / USEC_PER_MSEC;
+		b = ms ? min(fls(ms), SIO_LAT_BUCKETS - 1) : 0;
+		bucket[b]++;
+	}
+
+	for (b = 0; b < SIO_LAT_BUCKETS - 1; b++)
+		p += sprintf(p, "<%ums %u\n", 1U << b, bucket[b]);
+	p += sprintf(p, ">=%ums %u\n", 1U << (b - 1), bucket[b]);
+
+	return p - page;
+}
+
+static ssize_t
+sio_read_latency_show(struct elevator_queue *e, char *page)
+{
+	struct sio_data *sd = e->elevator_data;
+
+	return sio_latency_show(&sd->latency[READ], page);
+}
+
+static ssize_t
+sio_write_latency_show(struct elevator_queue *e, char *page)
+{
+	struct sio_data *sd = e->elevator_data;
+
+	return sio_latency_show(&sd->latency[WRITE], page);
+}
+
 #define DD_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, sio_##name##_show, \
 				      sio_##name##_store)
@@ -304,6 +547,10 @@ static struct elv_fs_entry sio_attrs[] = {
 	DD_ATTR(sync_expire),
 	DD_ATTR(async_expire),
 	DD_ATTR(fifo_batch),
+	DD_ATTR(target_latency),
+	__ATTR(async_quota, S_IRUGO, sio_async_quota_show, NULL),
+	__ATTR(read_latency, S_IRUGO, sio_read_latency_show, NULL),
+	__ATTR(write_latency, S_IRUGO, sio_write_latency_show, NULL),
 	__ATTR_NULL
 };
 
@@ -312,6 +559,8 @@ static struct elevator_type iosched_sio = {
 		.elevator_merge_req_fn		= sio_merged_requests,
 		.elevator_dispatch_fn		= sio_dispatch_requests,
 		.elevator_add_req_fn		= sio_add_request,
+		.elevator_activate_req_fn	= sio_activate_request,
+		.elevator_completed_req_fn	= sio_completed_request,
 		.elevator_queue_empty_fn	= sio_queue_empty,
 		.elevator_former_req_fn		= sio_former_request,
 		.elevator_latter_req_fn		= sio_latter_request,
@@ -19,8 +19,10 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/input.h>
 #include <linux/mutex.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/tick.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
@@ -31,6 +33,9 @@
 static void (*pm_idle_old)(void);
 static atomic_t active_count = ATOMIC_INIT(0);
 
+/* Number of past load samples kept per CPU for load prediction */
+#define LOAD_HIST_MAX 8
+
 struct cpufreq_interactive_cpuinfo {
 	struct timer_list cpu_timer;
 	int timer_idlecancel;
@@ -44,6 +49,9 @@ struct cpufreq_interactive_cpuinfo {
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
 	int governor_enabled;
+	unsigned int load_hist[LOAD_HIST_MAX];
+	unsigned int load_hist_idx;
+	unsigned int load_hist_count;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
@@ -76,6 +84,32 @@ static unsigned long sustain_load;
 #define DEFAULT_MIN_SAMPLE_TIME 80000;
 static unsigned long min_sample_time;
 
+/*
+ * Number of past samples averaged to predict the next period's load.
+ * A load rising above that average is extrapolated ahead; 0 disables.
+ */
+#define DEFAULT_LOAD_HISTORY 4
+static unsigned long load_history;
+
+/*
+ * Frequency to jump to on input events, and for how long (usecs) the
+ * timer may not go below it.  A frequency of 0 means the policy max;
+ * a duration of 0 disables input boost.
+ */
+#define DEFAULT_INPUT_BOOST_DURATION 100000
+static unsigned long input_boost_freq;
+static unsigned long input_boost_duration;
+static unsigned long input_boost_end;
+
+/*
+ * Latency from a ramp-up request to the new speed being set, as a
+ * histogram of power-of-two buckets starting at 32us.
+ */
+#define RAMP_LAT_BUCKETS 12
+static unsigned int ramp_latency_hist[RAMP_LAT_BUCKETS];
+static unsigned int up_max_latency;
+static u64 up_request_time;
+
 #define DEBUG 0
 #define BUFSZ 128
 
@@ -97,9 +131,6 @@ static int dbgbufe;
 static struct proc_dir_entry	*dbg_proc;
 static spinlock_t dbgpr_lock;
 
-static u64 up_request_time;
-static unsigned int up_max_latency;
-
 static void dbgpr(char *fmt, ...)
 {
 	va_list args;
@@ -176,6 +207,94 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+/*
+ * Returns the input boost frequency for this CPU's frequency table, or 0
+ * if no boost is in effect.
+ */
+static unsigned int cpufreq_interactive_boost_freq(
+	struct cpufreq_interactive_cpuinfo *pcpu)
+{
+	unsigned long end = input_boost_end;
+	unsigned int freq;
+	unsigned int index;
+
+	if (!input_boost_duration || !end || time_after_eq(jiffies, end))
+		return 0;
+
+	freq = input_boost_freq ? input_boost_freq : pcpu->policy->max;
+	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
+					   freq, CPUFREQ_RELATION_H, &index))
+		return 0;
+
+	return pcpu->freq_table[index].frequency;
+}
+
+/*
+ * Record cpu_load in the per-CPU history and return the load expected
+ * for the next period: a load rising above the recent average is
+ * assumed to keep rising by half that difference.
+ */
+static int cpufreq_interactive_predict_load(
+	struct cpufreq_interactive_cpuinfo *pcpu, int cpu_load)
+{
+	unsigned int nr = min_t(unsigned int, load_history, LOAD_HIST_MAX);
+	unsigned int i, idx, sum = 0;
+	int avg, predicted = cpu_load;
+
+	if (!nr)
+		return cpu_load;
+
+	nr = min(nr, pcpu->load_hist_count);
+	idx = pcpu->load_hist_idx;
+	for (i = 0; i < nr; i++) {
+		idx = idx ? idx - 1 : LOAD_HIST_MAX - 1;
+		sum += pcpu->load_hist[idx];
+	}
+
+	if (nr) {
+		avg = sum / nr;
+		if (cpu_load > avg)
+			predicted = min(cpu_load + (cpu_load - avg) / 2, 100);
+	}
+
+	pcpu->load_hist[pcpu->load_hist_idx] = cpu_load;
+	if (++pcpu->load_hist_idx >= LOAD_HIST_MAX)
+		pcpu->load_hist_idx = 0;
+	if (pcpu->load_hist_count < LOAD_HIST_MAX)
+		pcpu->load_hist_count++;
+
+	return predicted;
+}
+
+/* Caller must hold up_cpumask_lock */
+static void cpufreq_interactive_note_up_request(void)
+{
+	if (cpumask_empty(&up_cpumask))
+		up_request_time = ktime_to_us(ktime_get());
+}
+
+static void cpufreq_interactive_note_up_done(void)
+{
+	u64 then, now;
+	unsigned int lat, b;
+	unsigned long flags;
+
+	spin_lock_irqsave(&up_cpumask_lock, flags);
+	then = up_request_time;
+	spin_unlock_irqrestore(&up_cpumask_lock, flags);
+	now = ktime_to_us(ktime_get());
+
+	if (now <= then)
+		return;
+
+	lat = (unsigned int) (now - then);
+	if (lat > up_max_latency)
+		up_max_latency = lat;
+
+	b = min(fls(lat >> 5), RAMP_LAT_BUCKETS - 1);
+	ramp_latency_hist[b]++;
+}
+
 static unsigned int cpufreq_interactive_get_target(
 	int cpu_load, int load_since_change, struct cpufreq_policy *policy)
 {
@@ -218,6 +337,7 @@ static void cpufreq_interactive_timer(unsigned long data)
 		&per_cpu(cpuinfo, data);
 	u64 now_idle;
 	unsigned int new_freq;
+	unsigned int boost_freq;
 	unsigned int index;
 	unsigned long flags;
 
@@ -270,6 +390,8 @@ static void cpufreq_interactive_timer(unsigned long data)
 	else
 		cpu_load = 100 * (delta_time - delta_idle) / delta_time;
 
+	cpu_load = cpufreq_interactive_predict_load(pcpu, cpu_load);
+
 	delta_idle = (unsigned int) cputime64_sub(now_idle,
 						 pcpu->freq_change_time_in_idle);
 	delta_time = (unsigned int) cputime64_sub(pcpu->timer_run_time,
@@ -298,6 +420,11 @@ static void cpufreq_interactive_timer(unsigned long data)
 
 	new_freq = pcpu->freq_table[index].frequency;
 
+	/* Hold at least the boost speed while input boost is in effect. */
+	boost_freq = cpufreq_interactive_boost_freq(pcpu);
+	if (new_freq < boost_freq)
+		new_freq = boost_freq;
+
 	if (pcpu->target_freq == new_freq)
 	{
 		dbgpr("timer %d: load=%d, already at %d\n", (int) data, cpu_load, new_freq);
@@ -326,10 +453,8 @@ static void cpufreq_interactive_timer(unsigned long data)
 		queue_work(down_wq, &freq_scale_down_work);
 	} else {
 		pcpu->target_freq = new_freq;
-#if DEBUG
-		up_request_time = ktime_to_us(ktime_get());
-#endif
 		spin_lock_irqsave(&up_cpumask_lock, flags);
+		cpufreq_interactive_note_up_request();
 		cpumask_set_cpu(data, &up_cpumask);
 		spin_unlock_irqrestore(&up_cpumask_lock, flags);
 		wake_up_process(up_task);
@@ -466,12 +591,7 @@ static int cpufreq_interactive_up_task(void *data)
 	cpumask_t tmp_mask;
 	unsigned long flags;
 	struct cpufreq_interactive_cpuinfo *pcpu;
-
-#if DEBUG
-	u64 now;
-	u64 then;
-	unsigned int lat;
-#endif
+	unsigned int boost_freq;
 
 	while (1) {
 		set_current_state(TASK_INTERRUPTIBLE);
@@ -489,18 +609,6 @@ static int cpufreq_interactive_up_task(void *data)
 
 		set_current_state(TASK_RUNNING);
 
-#if DEBUG
-		then = up_request_time;
-		now = ktime_to_us(ktime_get());
-
-		if (now > then) {
-			lat = ktime_to_us(ktime_get()) - then;
-
-			if (lat > up_max_latency)
-				up_max_latency = lat;
-		}
-#endif
-
 		tmp_mask = up_cpumask;
 		cpumask_clear(&up_cpumask);
 		spin_unlock_irqrestore(&up_cpumask_lock, flags);
@@ -518,6 +626,10 @@ static int cpufreq_interactive_up_task(void *data)
 			if (!pcpu->governor_enabled)
 				continue;
 
+			boost_freq = cpufreq_interactive_boost_freq(pcpu);
+			if (pcpu->target_freq < boost_freq)
+				pcpu->target_freq = boost_freq;
+
 			__cpufreq_driver_target(pcpu->policy,
 						pcpu->target_freq,
 						CPUFREQ_RELATION_H);
@@ -526,6 +638,9 @@ static int cpufreq_interactive_up_task(void *data)
 						     &pcpu->freq_change_time);
 			dbgpr("up %d: set tgt=%d (actual=%d)\n", cpu, pcpu->target_freq, pcpu->policy->cur);
 		}
+
+		if (!cpumask_empty(&tmp_mask))
+			cpufreq_interactive_note_up_done();
 	}
 
 	return 0;
@@ -561,6 +676,133 @@ static void cpufreq_interactive_freq_down(struct work_struct *work)
 	}
 }
 
+/*
+ * Input boost needs the input core; a built-in governor can only use it
+ * when input is built in too.
+ */
+#if defined(CONFIG_INPUT) || (defined(CONFIG_INPUT_MODULE) && defined(MODULE))
+static int input_handler_registered;
+
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+					    unsigned int type,
+					    unsigned int code, int value)
+{
+	unsigned long duration = input_boost_duration;
+	unsigned long end, flags;
+	unsigned int cpu;
+	int boosting;
+
+	if (!duration)
+		return;
+
+	boosting = input_boost_end && time_before(jiffies, input_boost_end);
+	end = jiffies + usecs_to_jiffies(duration);
+	input_boost_end = end ? end : 1;
+
+	/* Only the first event of a burst needs to raise the speed. */
+	if (boosting)
+		return;
+
+	spin_lock_irqsave(&up_cpumask_lock, flags);
+	cpufreq_interactive_note_up_request();
+	for_each_online_cpu(cpu) {
+		if (per_cpu(cpuinfo, cpu).governor_enabled)
+			cpumask_set_cpu(cpu, &up_cpumask);
+	}
+	spin_unlock_irqrestore(&up_cpumask_lock, flags);
+	wake_up_process(up_task);
+}
+
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+					     struct input_dev *dev,
+					     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_register;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_open;
+
+	return 0;
+
+err_open:
+	input_unregister_handle(handle);
+err_register:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+/* Touchscreens, touchpads and keys; not sensors or switches. */
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] = BIT_MASK(ABS_X) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event		= cpufreq_interactive_input_event,
+	.connect	= cpufreq_interactive_input_connect,
+	.disconnect	= cpufreq_interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= cpufreq_interactive_ids,
+};
+
+static void cpufreq_interactive_input_register(void)
+{
+	int rc = input_register_handler(&cpufreq_interactive_input_handler);
+
+	input_handler_registered = !rc;
+	if (rc)
+		pr_warning("%s: failed to register input handler, "
+			   "input boost disabled (%d)\n", __func__, rc);
+}
+
+static void cpufreq_interactive_input_unregister(void)
+{
+	if (input_handler_registered)
+		input_unregister_handler(&cpufreq_interactive_input_handler);
+	input_handler_registered = 0;
+}
+#else
+static inline void cpufreq_interactive_input_register(void) {}
+static inline void cpufreq_interactive_input_unregister(void) {}
+#endif
+
 static ssize_t show_go_maxspeed_load(struct kobject *kobj,
 				     struct attribute *attr, char *buf)
 {
@@ -621,11 +863,105 @@ static ssize_t store_min_sample_time(struct kobject *kobj,
 static struct global_attr min_sample_time_attr = __ATTR(min_sample_time, 0644,
 		show_min_sample_time, store_min_sample_time);
 
+static ssize_t show_load_history(struct kobject *kobj,
+				 struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", load_history);
+}
+
+static ssize_t store_load_history(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (strict_strtoul(buf, 0, &val) || val > LOAD_HIST_MAX)
+		return -EINVAL;
+
+	load_history = val;
+	return count;
+}
+
+static struct global_attr load_history_attr = __ATTR(load_history, 0644,
+		show_load_history, store_load_history);
+
+static ssize_t show_input_boost_freq(struct kobject *kobj,
+				     struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost_freq);
+}
+
+static ssize_t store_input_boost_freq(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (strict_strtoul(buf, 0, &val))
+		return -EINVAL;
+
+	input_boost_freq = val;
+	return count;
+}
+
+static struct global_attr input_boost_freq_attr = __ATTR(input_boost_freq,
+		0644, show_input_boost_freq, store_input_boost_freq);
+
+static ssize_t show_input_boost_duration(struct kobject *kobj,
+					 struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", input_boost_duration);
+}
+
+static ssize_t store_input_boost_duration(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (strict_strtoul(buf, 0, &val))
+		return -EINVAL;
+
+	input_boost_duration = val;
+	return count;
+}
+
+static struct global_attr input_boost_duration_attr =
+	__ATTR(input_boost_duration, 0644,
+	       show_input_boost_duration, store_input_boost_duration);
+
+static ssize_t show_ramp_latency(struct kobject *kobj,
+				 struct attribute *attr, char *buf)
+{
+	char *p = buf;
+	unsigned int b;
+
+	for (b = 0; b < RAMP_LAT_BUCKETS - 1; b++)
+		p += sprintf(p, "<%uus %u\n", 32U << b, ramp_latency_hist[b]);
+	p += sprintf(p, ">=%uus %u\n", 32U << (b - 1), ramp_latency_hist[b]);
+	p += sprintf(p, "max %uus\n", up_max_latency);
+
+	return p - buf;
+}
+
+/* Any write clears the histogram. */
+static ssize_t store_ramp_latency(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	memset(ramp_latency_hist, 0, sizeof(ramp_latency_hist));
+	up_max_latency = 0;
+	return count;
+}
+
+static struct global_attr ramp_latency_attr = __ATTR(ramp_latency, 0644,
+		show_ramp_latency, store_ramp_latency);
+
 static struct attribute *interactive_attributes[] = {
 	&go_maxspeed_load_attr.attr,
 	&boost_factor_attr.attr,
 	&sustain_load_attr.attr,
 	&min_sample_time_attr.attr,
+	&load_history_attr.attr,
+	&input_boost_freq_attr.attr,
+	&input_boost_duration_attr.attr,
+	&ramp_latency_attr.attr,
 	NULL,
 };
 
@@ -649,6 +985,8 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		pcpu->policy = new_policy;
 		pcpu->freq_table = cpufreq_frequency_get_table(new_policy->cpu);
 		pcpu->target_freq = new_policy->cur;
+		pcpu->load_hist_idx = 0;
+		pcpu->load_hist_count = 0;
 		pcpu->freq_change_time_in_idle =
 			get_cpu_idle_time_us(new_policy->cpu,
 					     &pcpu->freq_change_time);
@@ -666,6 +1004,8 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		if (rc)
 			return rc;
 
+		cpufreq_interactive_input_register();
+
 		pm_idle_old = pm_idle;
 		pm_idle = cpufreq_interactive_idle;
 		break;
@@ -686,6 +1026,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *new_policy,
 		if (atomic_dec_return(&active_count) > 0)
 			return 0;
 
+		cpufreq_interactive_input_unregister();
 		sysfs_remove_group(cpufreq_global_kobject,
 				&interactive_attr_group);
 
@@ -712,6 +1053,8 @@ static int __init cpufreq_interactive_init(void)
 
 	go_maxspeed_load = DEFAULT_GO_MAXSPEED_LOAD;
 	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
+	load_history = DEFAULT_LOAD_HISTORY;
+	input_boost_duration = DEFAULT_INPUT_BOOST_DURATION;
 
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
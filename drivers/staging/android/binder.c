@@ -29,25 +29,74 @@
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/security.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/rwsem.h>
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
+/*
+ * Locking:
+ *
+ * binder_lock is taken for read by every ioctl, poll and mmap-time page
+ * operation, and for write only when a thread or a whole process is torn
+ * down, when the debugfs state is dumped, and when a process is added to
+ * binder_procs.  Holding it for read guarantees that no binder_proc or
+ * binder_thread goes away underneath the caller, and that node->proc of
+ * any node stays stable.
+ *
+ * Everything else is protected by per-process locks:
+ *
+ *  proc->outer_lock  (mutex)    refs_by_desc, refs_by_node and the
+ *                               strong/weak/death fields of those refs.
+ *  proc->inner_lock  (spinlock) threads, nodes, every field of the nodes
+ *                               owned by proc (including node->refs and
+ *                               node->async_todo), proc and thread todo
+ *                               lists, delivered_death, thread transaction
+ *                               stacks and return errors, looper state and
+ *                               the thread-pool counters, and the
+ *                               buffer->transaction links of proc's buffers.
+ *  proc->alloc_lock  (mutex)    the buffer allocator: buffers,
+ *                               free_buffers, allocated_buffers, pages,
+ *                               pages_held, free_async_space and the
+ *                               buffer bitfields.
+ *
+ * Pages that no buffer uses any more stay mapped on binder_lru until the
+ * shrinker reclaims them.  binder_lru_lock protects the list, the lru
+ * field of every page on it and proc->pages_lru; it nests inside
+ * alloc_lock, and the shrinker only ever trylocks alloc_lock under it.
+ *
+ * Nodes whose process has died are protected by binder_dead_nodes_lock in
+ * place of an inner_lock.  Locks are always taken in the order
+ * outer_lock -> inner_lock; at most one outer_lock and one inner_lock are
+ * held at any time, and alloc_lock is never held together with either.
+ */
+static DECLARE_RWSEM(binder_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DEFINE_MUTEX(binder_context_mgr_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
+static DEFINE_SPINLOCK(binder_transaction_log_lock);
+static DEFINE_SPINLOCK(binder_lru_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
+static LIST_HEAD(binder_lru);
+static int binder_lru_count;
+static atomic_t binder_lru_reclaimed;
 
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -146,22 +195,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -188,6 +237,7 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
+	spin_lock(&binder_transaction_log_lock);
 	e = &log->entry[log->next];
 	memset(e, 0, sizeof(*e));
 	log->next++;
@@ -195,6 +245,7 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 		log->next = 0;
 		log->full = 1;
 	}
+	spin_unlock(&binder_transaction_log_lock);
 	return e;
 }
 
@@ -210,6 +261,16 @@ struct binder_work {
 	} type;
 };
 
+/*
+ * A scheduling policy and a kernel priority (task->normal_prio scale:
+ * 0..MAX_RT_PRIO-1 for SCHED_FIFO/RR, MAX_RT_PRIO..MAX_PRIO-1 for the
+ * fair policies); a lower prio is more important.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 struct binder_node {
 	int debug_id;
 	struct binder_work work;
@@ -219,6 +280,7 @@ struct binder_node {
 	};
 	struct binder_proc *proc;
 	struct hlist_head refs;
+	int tmp_refs;
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
@@ -256,6 +318,12 @@ struct binder_ref {
 	struct binder_ref_death *death;
 };
 
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
 	struct rb_node rb_node; /* free entry by size or allocated entry */
@@ -270,6 +338,7 @@ struct binder_buffer {
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size;
 	uint8_t data[0];
 };
 
@@ -281,6 +350,9 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex outer_lock;
+	spinlock_t inner_lock;
+	struct mutex alloc_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -299,7 +371,9 @@ struct binder_proc {
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	int pages_held;
+	int pages_lru;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -310,7 +384,7 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
 };
 
@@ -327,6 +401,7 @@ struct binder_thread {
 	struct binder_proc *proc;
 	struct rb_node rb_node;
 	int pid;
+	struct task_struct *task;
 	int looper;
 	struct binder_transaction *transaction_stack;
 	struct list_head todo;
@@ -348,12 +423,13 @@ struct binder_transaction {
 	struct binder_transaction *to_parent;
 	unsigned need_reply:1;
 	/* unsigned is_dead:1; */	/* not used at the moment */
+	unsigned set_priority_called:1;
 
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
 };
 
@@ -498,21 +574,140 @@ out_unlock:
 	return -EBADF;
 }
 
-static void binder_set_nice(long nice)
+static bool binder_is_rt_policy(unsigned int policy)
 {
-	long min_nice;
-	if (can_nice(current, nice)) {
-		set_user_nice(current, nice);
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+/* Kernel prio to nice value or rt_priority, as seen by userspace */
+static int binder_to_user_prio(unsigned int policy, int prio)
+{
+	if (binder_is_rt_policy(policy))
+		return MAX_USER_RT_PRIO - 1 - prio;
+	return prio - MAX_RT_PRIO - 20;
+}
+
+static int binder_to_kernel_prio(unsigned int policy, int user_prio)
+{
+	if (binder_is_rt_policy(policy))
+		return MAX_USER_RT_PRIO - 1 - user_prio;
+	return user_prio + MAX_RT_PRIO + 20;
+}
+
+static struct binder_priority binder_task_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	p.prio = task->normal_prio;
+	return p;
+}
+
+/*
+ * Give task the desired policy and priority, capped by its RLIMIT_RTPRIO
+ * and RLIMIT_NICE unless it has CAP_SYS_NICE.  An rt policy the task may
+ * not use falls back to the highest nice value it may use.
+ */
+static void binder_set_priority(struct task_struct *task,
+				struct binder_priority desired)
+{
+	unsigned int policy = desired.sched_policy;
+	struct sched_param params;
+	bool has_cap_nice;
+	int priority;
+	int new_prio;
+
+	if (task->policy == policy && task->normal_prio == desired.prio)
 		return;
+
+	has_cap_nice = has_capability_noaudit(task, CAP_SYS_NICE);
+	priority = binder_to_user_prio(policy, desired.prio);
+
+	if (binder_is_rt_policy(policy) && !has_cap_nice) {
+		long max_rtprio = task_rlimit(task, RLIMIT_RTPRIO);
+
+		if (max_rtprio == 0) {
+			policy = SCHED_NORMAL;
+			priority = -20;
+		} else if (priority > max_rtprio) {
+			priority = max_rtprio;
+		}
 	}
-	min_nice = 20 - current->signal->rlim[RLIMIT_NICE].rlim_cur;
-	binder_debug(BINDER_DEBUG_PRIORITY_CAP,
-		     "binder: %d: nice value %ld not allowed use "
-		     "%ld instead\n", current->pid, nice, min_nice);
-	set_user_nice(current, min_nice);
-	if (min_nice < 20)
+
+	if (!binder_is_rt_policy(policy) && !has_cap_nice) {
+		long min_nice = 20 - task_rlimit(task, RLIMIT_NICE);
+
+		if (min_nice > 19) {
+			binder_user_error("binder: %d RLIMIT_NICE not set\n",
+					  task->pid);
+			return;
+		}
+		if (priority < min_nice)
+			priority = min_nice;
+	}
+
+	new_prio = binder_to_kernel_prio(policy, priority);
+	if (policy != desired.sched_policy || new_prio != desired.prio)
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "binder: %d: priority %d not allowed, "
+			     "using %d instead\n", task->pid, desired.prio,
+			     new_prio);
+
+	trace_binder_set_priority(task->tgid, task->pid, task->normal_prio,
+				  desired.prio, new_prio);
+
+	if (task->policy != policy || binder_is_rt_policy(policy)) {
+		params.sched_priority = binder_is_rt_policy(policy) ?
+					priority : 0;
+		sched_setscheduler_nocheck(task, policy, &params);
+	}
+	if (!binder_is_rt_policy(policy))
+		set_user_nice(task, priority);
+}
+
+/*
+ * A node's min_priority is a nice value; anything above 19 means the node
+ * sets no minimum.
+ */
+static struct binder_priority binder_node_priority(struct binder_node *node)
+{
+	struct binder_priority p;
+
+	p.sched_policy = SCHED_NORMAL;
+	if (node->min_priority <= 19)
+		p.prio = binder_to_kernel_prio(SCHED_NORMAL, node->min_priority);
+	else
+		p.prio = MAX_PRIO;
+	return p;
+}
+
+/*
+ * Apply the priority a transaction should run at to the task handling it,
+ * saving the task's own so the reply can restore it.  A synchronous
+ * transaction runs at the better of the caller's priority (whatever its
+ * policy) and the node's minimum; a one-way transaction is only raised to
+ * the node's minimum.
+ */
+static void binder_transaction_priority(struct task_struct *task,
+					struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority node_prio = binder_node_priority(node);
+
+	if (t->set_priority_called)
 		return;
-	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
+
+	t->set_priority_called = 1;
+	t->saved_priority = binder_task_priority(task);
+
+	if (!(t->flags & TF_ONE_WAY)) {
+		if (t->priority.prio < node_prio.prio)
+			binder_set_priority(task, t->priority);
+		else
+			binder_set_priority(task, node_prio);
+	} else if (t->saved_priority.prio > node_prio.prio) {
+		binder_set_priority(task, node_prio);
+	}
 }
 
 static size_t binder_buffer_size(struct binder_proc *proc,
@@ -607,6 +802,22 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_lru_add_locked(struct binder_lru_page *lru_page)
+{
+	BUG_ON(!list_empty(&lru_page->lru));
+	list_add_tail(&lru_page->lru, &binder_lru);
+	lru_page->proc->pages_lru++;
+	binder_lru_count++;
+}
+
+static void binder_lru_del_locked(struct binder_lru_page *lru_page)
+{
+	BUG_ON(list_empty(&lru_page->lru));
+	list_del_init(&lru_page->lru);
+	lru_page->proc->pages_lru--;
+	binder_lru_count--;
+}
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -614,7 +825,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *lru_page;
 	struct mm_struct *mm;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
@@ -624,6 +835,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate == 0)
+		goto free_range;
+
 	if (vma)
 		mm = NULL;
 	else
@@ -634,9 +848,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -646,18 +857,24 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		int ret;
 		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		lru_page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (lru_page->page_ptr) {
+			/* still mapped, reclaim has not got to it yet */
+			spin_lock(&binder_lru_lock);
+			binder_lru_del_locked(lru_page);
+			spin_unlock(&binder_lru_lock);
+			continue;
+		}
+		lru_page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (lru_page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &lru_page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -667,7 +884,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, lru_page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -675,6 +892,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		proc->pages_held++;
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -683,20 +901,30 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
+	mm = NULL;
+	/*
+	 * Leave the pages mapped in both the kernel and the user vma so
+	 * that the next allocation over this range is free; binder_shrink
+	 * unmaps them when the system actually needs the memory.
+	 */
+	spin_lock(&binder_lru_lock);
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		lru_page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		binder_lru_add_locked(lru_page);
+		continue;
+
 err_vm_insert_page_failed:
 		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+		__free_page(lru_page->page_ptr);
+		lru_page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
+		spin_lock(&binder_lru_lock);
 	}
+	spin_unlock(&binder_lru_lock);
+	if (allocate == 0)
+		return 0;
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -705,9 +933,76 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+/*
+ * Unmap and free idle buffer pages, oldest first.  Pages whose process
+ * is busy in the allocator, or whose user mapping cannot be locked
+ * without sleeping, are left on the list for a later pass.
+ */
+static int binder_shrink(struct shrinker *shrinker, int nr_to_scan,
+			 gfp_t gfp_mask)
+{
+	struct binder_lru_page *lru_page;
+	struct binder_proc *proc;
+	struct mm_struct *mm;
+	void *page_addr;
+	int count;
+
+	spin_lock(&binder_lru_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&binder_lru)) {
+		lru_page = list_first_entry(&binder_lru,
+					    struct binder_lru_page, lru);
+		proc = lru_page->proc;
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&lru_page->lru, &binder_lru);
+			continue;
+		}
+		binder_lru_del_locked(lru_page);
+		spin_unlock(&binder_lru_lock);
+
+		page_addr = proc->buffer +
+			(lru_page - proc->pages) * PAGE_SIZE;
+		mm = get_task_mm(proc->tsk);
+		if (mm ? !down_write_trylock(&mm->mmap_sem) :
+			 proc->vma != NULL) {
+			if (mm)
+				mmput(mm);
+			spin_lock(&binder_lru_lock);
+			binder_lru_add_locked(lru_page);
+			mutex_unlock(&proc->alloc_lock);
+			continue;
+		}
+		if (mm) {
+			if (proc->vma)
+				zap_page_range(proc->vma, (uintptr_t)page_addr +
+					proc->user_buffer_offset, PAGE_SIZE,
+					NULL);
+			up_write(&mm->mmap_sem);
+			mmput(mm);
+		}
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(lru_page->page_ptr);
+		lru_page->page_ptr = NULL;
+		proc->pages_held--;
+		mutex_unlock(&proc->alloc_lock);
+		atomic_inc(&binder_lru_reclaimed);
+
+		spin_lock(&binder_lru_lock);
+	}
+	count = binder_lru_count;
+	spin_unlock(&binder_lru_lock);
+	return count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						size_t extra_buffers_size,
+						int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -731,6 +1026,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	size += ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < extra_buffers_size) {
+		binder_user_error("binder: %d: got transaction with invalid "
+			"extra_buffers_size %zd\n", proc->pid,
+			extra_buffers_size);
+		return NULL;
+	}
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -799,6 +1101,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		     "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -808,6 +1111,23 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	buffer->allow_user_free = 0;
+
+	return buffer;
+}
+
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size,
+				    extra_buffers_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
 	return buffer;
 }
 
@@ -868,15 +1188,16 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
 	buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
@@ -923,8 +1244,16 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
-static struct binder_node *binder_get_node(struct binder_proc *proc,
-					   void __user *ptr)
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	__binder_free_buf(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+static struct binder_node *binder_get_node_ilocked(struct binder_proc *proc,
+						   void __user *ptr)
 {
 	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
@@ -942,9 +1271,10 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 	return NULL;
 }
 
-static struct binder_node *binder_new_node(struct binder_proc *proc,
-					   void __user *ptr,
-					   void __user *cookie)
+static struct binder_node *binder_init_node_ilocked(struct binder_proc *proc,
+						    struct binder_node *new_node,
+						    void __user *ptr,
+						    void __user *cookie)
 {
 	struct rb_node **p = &proc->nodes.rb_node;
 	struct rb_node *parent = NULL;
@@ -959,16 +1289,14 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
 		else
-			return NULL;
+			return node;
 	}
 
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -982,6 +1310,36 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
+static struct binder_node *binder_new_node(struct binder_proc *proc,
+					   void __user *ptr,
+					   void __user *cookie)
+{
+	struct binder_node *node, *new_node;
+
+	new_node = kzalloc(sizeof(*new_node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
+	spin_lock(&proc->inner_lock);
+	node = binder_init_node_ilocked(proc, new_node, ptr, cookie);
+	spin_unlock(&proc->inner_lock);
+	if (node != new_node) {
+		kfree(new_node);
+		return NULL;
+	}
+	return node;
+}
+
+/*
+ * Nodes are protected by the inner_lock of the process that owns them, or
+ * by binder_dead_nodes_lock once that process is gone.  node->proc only
+ * changes with binder_lock held for write, so the choice is stable for
+ * anyone holding binder_lock for read.
+ */
+static spinlock_t *binder_node_lock_ptr(struct binder_node *node)
+{
+	return node->proc ? &node->proc->inner_lock : &binder_dead_nodes_lock;
+}
+
 static int binder_inc_node(struct binder_node *node, int strong, int internal,
 			   struct list_head *target_list)
 {
@@ -1029,7 +1387,8 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 	} else {
 		if (!internal)
 			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
+		if (node->local_weak_refs || node->tmp_refs ||
+		    !hlist_empty(&node->refs))
 			return 0;
 	}
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
@@ -1039,7 +1398,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
+		    !node->local_weak_refs && !node->tmp_refs) {
 			list_del_init(&node->work.entry);
 			if (node->proc) {
 				rb_erase(&node->rb_node, &node->proc->nodes);
@@ -1060,6 +1419,68 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 	return 0;
 }
 
+/*
+ * A temporary reference keeps a node alive, without making it visible to
+ * user space, while it is used outside the lock it was looked up under.
+ */
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	spinlock_t *lock = binder_node_lock_ptr(node);
+
+	spin_lock(lock);
+	node->tmp_refs++;
+	spin_unlock(lock);
+}
+
+static void binder_dec_node_tmpref(struct binder_node *node)
+{
+	spinlock_t *lock = binder_node_lock_ptr(node);
+
+	spin_lock(lock);
+	node->tmp_refs--;
+	BUG_ON(node->tmp_refs < 0);
+	/* a weak internal dec only rechecks whether the node can go now */
+	binder_dec_node(node, 0, 1);
+	spin_unlock(lock);
+}
+
+static struct binder_node *binder_get_node(struct binder_proc *proc,
+					   void __user *ptr)
+{
+	struct binder_node *node;
+
+	spin_lock(&proc->inner_lock);
+	node = binder_get_node_ilocked(proc, ptr);
+	if (node)
+		node->tmp_refs++;
+	spin_unlock(&proc->inner_lock);
+	return node;
+}
+
+static struct binder_node *binder_get_or_new_node(struct binder_proc *proc,
+					struct flat_binder_object *fp)
+{
+	struct binder_node *node, *new_node;
+
+	node = binder_get_node(proc, fp->binder);
+	if (node)
+		return node;
+
+	new_node = kzalloc(sizeof(*new_node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
+	spin_lock(&proc->inner_lock);
+	node = binder_init_node_ilocked(proc, new_node, fp->binder, fp->cookie);
+	if (node == new_node) {
+		node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+		node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+	}
+	node->tmp_refs++;
+	spin_unlock(&proc->inner_lock);
+	if (node != new_node)
+		kfree(new_node);
+	return node;
+}
 
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
@@ -1087,6 +1508,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	struct rb_node **p = &proc->refs_by_node.rb_node;
 	struct rb_node *parent = NULL;
 	struct binder_ref *ref, *new_ref;
+	spinlock_t *node_lock;
 
 	while (*p) {
 		parent = *p;
@@ -1103,7 +1525,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1132,7 +1554,10 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		node_lock = binder_node_lock_ptr(node);
+		spin_lock(node_lock);
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		spin_unlock(node_lock);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1149,6 +1574,8 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	spinlock_t *node_lock = binder_node_lock_ptr(ref->node);
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
@@ -1156,16 +1583,20 @@ static void binder_delete_ref(struct binder_ref *ref)
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	spin_lock(node_lock);
 	if (ref->strong)
 		binder_dec_node(ref->node, 1, 1);
 	hlist_del(&ref->node_entry);
 	binder_dec_node(ref->node, 0, 1);
+	spin_unlock(node_lock);
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1176,17 +1607,22 @@ static void binder_delete_ref(struct binder_ref *ref)
 static int binder_inc_ref(struct binder_ref *ref, int strong,
 			  struct list_head *target_list)
 {
+	spinlock_t *node_lock = binder_node_lock_ptr(ref->node);
 	int ret;
 	if (strong) {
 		if (ref->strong == 0) {
+			spin_lock(node_lock);
 			ret = binder_inc_node(ref->node, 1, 1, target_list);
+			spin_unlock(node_lock);
 			if (ret)
 				return ret;
 		}
 		ref->strong++;
 	} else {
 		if (ref->weak == 0) {
+			spin_lock(node_lock);
 			ret = binder_inc_node(ref->node, 0, 1, target_list);
+			spin_unlock(node_lock);
 			if (ret)
 				return ret;
 		}
@@ -1208,8 +1644,11 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 		}
 		ref->strong--;
 		if (ref->strong == 0) {
+			spinlock_t *node_lock = binder_node_lock_ptr(ref->node);
 			int ret;
+			spin_lock(node_lock);
 			ret = binder_dec_node(ref->node, strong, 1);
+			spin_unlock(node_lock);
 			if (ret)
 				return ret;
 		}
@@ -1239,7 +1678,23 @@ static void binder_pop_transaction(struct binder_thread *target_thread,
 		t->from = NULL;
 	}
 	t->need_reply = 0;
-	if (t->buffer)
+}
+
+/*
+ * The buffer of a transaction belongs to t->to_proc, whose inner_lock
+ * protects the buffer <-> transaction links.  Must be called without any
+ * inner_lock held.
+ */
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc = t->to_proc;
+
+	if (target_proc) {
+		spin_lock(&target_proc->inner_lock);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		spin_unlock(&target_proc->inner_lock);
+	} else if (t->buffer)
 		t->buffer->transaction = NULL;
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
@@ -1253,6 +1708,9 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	while (1) {
 		target_thread = t->from;
 		if (target_thread) {
+			struct binder_proc *target_proc = target_thread->proc;
+
+			spin_lock(&target_proc->inner_lock);
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1263,16 +1721,19 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 					     "binder: send failed reply for "
 					     "transaction %d to %d:%d\n",
-					      t->debug_id, target_thread->proc->pid,
+					      t->debug_id, target_proc->pid,
 					      target_thread->pid);
 
 				binder_pop_transaction(target_thread, t);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
+				spin_unlock(&target_proc->inner_lock);
+				binder_free_transaction(t);
 			} else {
+				spin_unlock(&target_proc->inner_lock);
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
-					"already\n", target_thread->proc->pid,
+					"already\n", target_proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
 			}
@@ -1286,6 +1747,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     t->debug_id);
 
 			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
@@ -1300,6 +1762,118 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	}
 }
 
+/*
+ * Returns the size of the object at 'offset' in the buffer's data, or 0
+ * if it is misaligned or does not fit in the data.
+ */
+static size_t binder_validate_object(struct binder_buffer *buffer,
+				     size_t offset)
+{
+	struct flat_binder_object *fp;
+	size_t object_size;
+
+	if (buffer->data_size < sizeof(fp->type) ||
+	    offset > buffer->data_size - sizeof(fp->type) ||
+	    !IS_ALIGNED(offset, sizeof(void *)))
+		return 0;
+
+	fp = (struct flat_binder_object *)(buffer->data + offset);
+	if (fp->type == BINDER_TYPE_PTR)
+		object_size = sizeof(struct binder_buffer_object);
+	else
+		object_size = sizeof(struct flat_binder_object);
+
+	if (buffer->data_size < object_size ||
+	    offset > buffer->data_size - object_size)
+		return 0;
+
+	return object_size;
+}
+
+/*
+ * Returns the BINDER_TYPE_PTR object at 'index' in the offsets array, if
+ * index is one of the num_valid objects already translated.
+ */
+static struct binder_buffer_object *binder_validate_ptr(
+	struct binder_buffer *buffer, size_t *off_start,
+	size_t index, size_t num_valid)
+{
+	struct binder_buffer_object *bp;
+
+	if (index >= num_valid)
+		return NULL;
+
+	bp = (struct binder_buffer_object *)(buffer->data + off_start[index]);
+	if (bp->type != BINDER_TYPE_PTR)
+		return NULL;
+
+	return bp;
+}
+
+/*
+ * A fixup may only go into the last buffer copied or into one of its
+ * ancestors, and never below an earlier fixup into the same buffer, so
+ * a pointer that was already patched cannot be overwritten.
+ */
+static bool binder_validate_fixup(struct binder_buffer *buffer,
+				  size_t *off_start,
+				  struct binder_buffer_object *parent,
+				  size_t fixup_offset,
+				  struct binder_buffer_object *last_obj,
+				  size_t last_min_offset)
+{
+	if (!last_obj)
+		return false;
+
+	while (last_obj != parent) {
+		if (!(last_obj->flags & BINDER_BUFFER_FLAG_HAS_PARENT))
+			return false;
+		last_min_offset = last_obj->parent_offset + sizeof(void *);
+		last_obj = (struct binder_buffer_object *)
+			(buffer->data + off_start[last_obj->parent]);
+	}
+
+	return fixup_offset >= last_min_offset;
+}
+
+/*
+ * Rewrite the pointer to bp's buffer that its parent buffer holds, now
+ * that both have been copied into the target process.
+ */
+static int binder_fixup_parent(struct binder_proc *target_proc,
+			       struct binder_buffer *buffer,
+			       struct binder_buffer_object *bp,
+			       size_t *off_start, size_t num_valid,
+			       struct binder_buffer_object *last_fixup_obj,
+			       size_t last_fixup_min_off)
+{
+	struct binder_buffer_object *parent;
+	u8 *parent_buffer;
+
+	if (!(bp->flags & BINDER_BUFFER_FLAG_HAS_PARENT))
+		return 0;
+
+	parent = binder_validate_ptr(buffer, off_start, bp->parent, num_valid);
+	if (!parent)
+		return -EINVAL;
+
+	if (!binder_validate_fixup(buffer, off_start, parent,
+				   bp->parent_offset, last_fixup_obj,
+				   last_fixup_min_off))
+		return -EINVAL;
+
+	if (parent->length < sizeof(void *) ||
+	    bp->parent_offset > parent->length - sizeof(void *) ||
+	    !IS_ALIGNED(bp->parent_offset, sizeof(void *)))
+		return -EINVAL;
+
+	parent_buffer = (u8 *)((uintptr_t)parent->buffer -
+			       target_proc->user_buffer_offset);
+	*(void **)(parent_buffer + bp->parent_offset) = bp->buffer;
+
+	return 0;
+}
+
 static void binder_transaction_buffer_release(struct binder_proc *proc,
 					      struct binder_buffer *buffer,
 					      size_t *failed_at)
@@ -1312,8 +1886,13 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		     proc->pid, buffer->debug_id,
 		     buffer->data_size, buffer->offsets_size, failed_at);
 
-	if (buffer->target_node)
+	if (buffer->target_node) {
+		spinlock_t *node_lock = binder_node_lock_ptr(buffer->target_node);
+
+		spin_lock(node_lock);
 		binder_dec_node(buffer->target_node, 1, 0);
+		spin_unlock(node_lock);
+	}
 
 	offp = (size_t *)(buffer->data + ALIGN(buffer->data_size, sizeof(void *)));
 	if (failed_at)
@@ -1322,9 +1901,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		off_end = (void *)offp + buffer->offsets_size;
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
-		if (*offp > buffer->data_size - sizeof(*fp) ||
-		    buffer->data_size < sizeof(*fp) ||
-		    !IS_ALIGNED(*offp, sizeof(void *))) {
+		if (!binder_validate_object(buffer, *offp)) {
 			printk(KERN_ERR "binder: transaction release %d bad"
 					"offset %zd, size %zd\n", debug_id,
 					*offp, buffer->data_size);
@@ -1334,8 +1911,12 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+
+			spin_lock(&proc->inner_lock);
+			node = binder_get_node_ilocked(proc, fp->binder);
 			if (node == NULL) {
+				spin_unlock(&proc->inner_lock);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad node %p\n", debug_id, fp->binder);
 				break;
@@ -1344,11 +1925,16 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			spin_unlock(&proc->inner_lock);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			mutex_lock(&proc->outer_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad handle %ld\n", debug_id,
 				       fp->handle);
@@ -1358,6 +1944,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        ref %d desc %d (node %d)\n",
 				     ref->debug_id, ref->desc, ref->node->debug_id);
 			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			mutex_unlock(&proc->outer_lock);
 		} break;
 
 		case BINDER_TYPE_FD:
@@ -1367,6 +1954,14 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_PTR:
+			/* The copy lives in the buffer itself. */
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        ptr %p length %zd\n",
+				     ((struct binder_buffer_object *)fp)->buffer,
+				     ((struct binder_buffer_object *)fp)->length);
+			break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad "
 			       "object type %lx\n", debug_id, fp->type);
@@ -1377,11 +1972,16 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       size_t extra_buffers_size)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
-	size_t *offp, *off_end;
+	size_t *offp, *off_end, *off_start;
+	size_t off_min;
+	u8 *sg_bufp, *sg_buf_end;
+	struct binder_buffer_object *last_fixup_obj = NULL;
+	size_t last_fixup_min_off = 0;
 	struct binder_proc *target_proc;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
@@ -1400,16 +2000,22 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		struct binder_priority saved_priority;
+
+		spin_lock(&proc->inner_lock);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			spin_unlock(&proc->inner_lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		saved_priority = in_reply_to->saved_priority;
 		if (in_reply_to->to_thread != thread) {
+			spin_unlock(&proc->inner_lock);
+			binder_set_priority(current, saved_priority);
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
 				" transaction %d has target %d:%d\n",
@@ -1423,11 +2029,15 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
+		spin_unlock(&proc->inner_lock);
+		binder_set_priority(current, saved_priority);
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		target_proc = target_thread->proc;
+		spin_lock(&target_proc->inner_lock);
 		if (target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
@@ -1436,17 +2046,20 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			spin_unlock(&target_proc->inner_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
-		target_proc = target_thread->proc;
+		spin_unlock(&target_proc->inner_lock);
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
+			mutex_lock(&proc->outer_lock);
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1454,12 +2067,15 @@ static void binder_transaction(struct binder_proc *proc,
 				goto err_invalid_target_handle;
 			}
 			target_node = ref->node;
+			binder_inc_node_tmpref(target_node);
+			mutex_unlock(&proc->outer_lock);
 		} else {
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
+			binder_inc_node_tmpref(target_node);
 		}
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
@@ -1467,10 +2083,12 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		spin_lock(&proc->inner_lock);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
 			if (tmp->to_thread != thread) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1481,21 +2099,21 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
+			/*
+			 * The rest of the chain belongs to callers that are
+			 * blocked waiting for a reply, so it cannot change
+			 * while we walk it.
+			 */
 			while (tmp) {
 				if (tmp->from && tmp->from->proc == target_proc)
 					target_thread = tmp->from;
 				tmp = tmp->from_parent;
 			}
 		}
+		spin_unlock(&proc->inner_lock);
 	}
-	if (target_thread) {
+	if (target_thread)
 		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1513,7 +2131,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1542,19 +2160,22 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_task_priority(current);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
+	if (target_node) {
+		spin_lock(&target_proc->inner_lock);
 		binder_inc_node(target_node, 1, 0, NULL);
+		spin_unlock(&target_proc->inner_lock);
+	}
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1577,32 +2198,39 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_bad_offset;
 	}
+	off_start = offp;
 	off_end = (void *)offp + tr->offsets_size;
+	sg_bufp = (u8 *)off_start + ALIGN(tr->offsets_size, sizeof(void *));
+	sg_buf_end = sg_bufp + ALIGN(extra_buffers_size, sizeof(void *));
+	off_min = 0;
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
-		if (*offp > t->buffer->data_size - sizeof(*fp) ||
-		    t->buffer->data_size < sizeof(*fp) ||
-		    !IS_ALIGNED(*offp, sizeof(void *))) {
+		size_t object_size;
+
+		/*
+		 * Objects must not overlap, or translating one could change
+		 * another that was already validated.
+		 */
+		object_size = binder_validate_object(t->buffer, *offp);
+		if (object_size == 0 || *offp < off_min) {
 			binder_user_error("binder: %d:%d got transaction with "
 				"invalid offset, %zd\n",
 				proc->pid, thread->pid, *offp);
 			return_error = BR_FAILED_REPLY;
 			goto err_bad_offset;
 		}
+		off_min = *offp + object_size;
 		fp = (struct flat_binder_object *)(t->buffer->data + *offp);
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
 			struct binder_ref *ref;
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+
+			node = binder_get_or_new_node(proc, fp);
 			if (node == NULL) {
-				node = binder_new_node(proc, fp->binder, fp->cookie);
-				if (node == NULL) {
-					return_error = BR_FAILED_REPLY;
-					goto err_binder_new_node_failed;
-				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
-				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+				return_error = BR_FAILED_REPLY;
+				goto err_binder_new_node_failed;
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1610,10 +2238,14 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_dec_node_tmpref(node);
 				goto err_binder_get_ref_for_node_failed;
 			}
+			mutex_lock(&target_proc->outer_lock);
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				mutex_unlock(&target_proc->outer_lock);
+				binder_dec_node_tmpref(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1629,11 +2261,20 @@ static void binder_transaction(struct binder_proc *proc,
 				     "        node %d u%p -> ref %d desc %d\n",
 				     node->debug_id, node->ptr, ref->debug_id,
 				     ref->desc);
+			mutex_unlock(&target_proc->outer_lock);
+			binder_dec_node_tmpref(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+			struct binder_node *node;
+			int ref_debug_id;
+			uint32_t ref_desc;
+
+			mutex_lock(&proc->outer_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1641,22 +2282,32 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			node = ref->node;
+			ref_debug_id = ref->debug_id;
+			ref_desc = ref->desc;
+			binder_inc_node_tmpref(node);
+			mutex_unlock(&proc->outer_lock);
+			if (node->proc == target_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				spin_lock(&target_proc->inner_lock);
+				binder_inc_node(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				spin_unlock(&target_proc->inner_lock);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
 					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
+					     ref_debug_id, ref_desc, node->debug_id,
+					     node->ptr);
 			} else {
 				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
+				mutex_lock(&target_proc->outer_lock);
+				new_ref = binder_get_ref_for_node(target_proc, node);
 				if (new_ref == NULL) {
+					mutex_unlock(&target_proc->outer_lock);
+					binder_dec_node_tmpref(node);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_get_ref_for_node_failed;
 				}
@@ -1664,9 +2315,11 @@ static void binder_transaction(struct binder_proc *proc,
 				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
 					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+					     ref_debug_id, ref_desc, new_ref->debug_id,
+					     new_ref->desc, node->debug_id);
+				mutex_unlock(&target_proc->outer_lock);
 			}
+			binder_dec_node_tmpref(node);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1707,6 +2360,45 @@ static void binder_transaction(struct binder_proc *proc,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_PTR: {
+			struct binder_buffer_object *bp =
+				(struct binder_buffer_object *)fp;
+			size_t buf_left = sg_buf_end - sg_bufp;
+
+			if (bp->length > buf_left) {
+				binder_user_error("binder: %d:%d got transaction with too large buffer, %zd > %zd\n",
+					proc->pid, thread->pid, bp->length,
+					buf_left);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_offset;
+			}
+			if (copy_from_user(sg_bufp, bp->buffer, bp->length)) {
+				binder_user_error("binder: %d:%d got transaction with invalid buffer ptr\n",
+					proc->pid, thread->pid);
+				return_error = BR_FAILED_REPLY;
+				goto err_copy_data_failed;
+			}
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        ptr %p length %zd\n",
+				     bp->buffer, bp->length);
+			bp->buffer = (void *)((uintptr_t)sg_bufp +
+					      target_proc->user_buffer_offset);
+			sg_bufp += ALIGN(bp->length, sizeof(void *));
+
+			if (binder_fixup_parent(target_proc, t->buffer, bp,
+						off_start, offp - off_start,
+						last_fixup_obj,
+						last_fixup_min_off)) {
+				binder_user_error("binder: %d:%d got transaction with invalid parent, %zd offset %zd\n",
+					proc->pid, thread->pid, bp->parent,
+					bp->parent_offset);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_parent;
+			}
+			last_fixup_obj = bp;
+			last_fixup_min_off = 0;
+		} break;
+
 		default:
 			binder_user_error("binder: %d:%d got transactio"
 				"n with invalid object type, %lx\n",
@@ -1715,29 +2407,70 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->work.type = BINDER_WORK_TRANSACTION;
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+
+	/*
+	 * A synchronous call to a thread already waiting on us is handed our
+	 * priority before it is woken, so it is not scheduled at its own.
+	 */
+	if (!reply && !(t->flags & TF_ONE_WAY) && target_thread)
+		binder_transaction_priority(target_thread->task, t,
+					    target_node);
+	trace_binder_transaction(t->debug_id, reply, target_proc->pid,
+				 target_thread ? target_thread->pid : 0,
+				 t->code, t->flags);
+
+	/*
+	 * Queue the completion on our own thread before the transaction
+	 * becomes visible to the target, so that a fast reply can never
+	 * overtake BR_TRANSACTION_COMPLETE.
+	 */
+	spin_lock(&proc->inner_lock);
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	if (!reply && !(t->flags & TF_ONE_WAY)) {
+		t->need_reply = 1;
+		t->from_parent = thread->transaction_stack;
+		thread->transaction_stack = t;
+	}
+	spin_unlock(&proc->inner_lock);
+
+	spin_lock(&target_proc->inner_lock);
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		binder_pop_transaction(target_thread, in_reply_to);
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
-		t->need_reply = 1;
-		t->from_parent = thread->transaction_stack;
-		thread->transaction_stack = t;
+		if (target_thread) {
+			target_list = &target_thread->todo;
+			target_wait = &target_thread->wait;
+		} else {
+			target_list = &target_proc->todo;
+			target_wait = &target_proc->wait;
+		}
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
 		if (target_node->has_async_transaction) {
 			target_list = &target_node->async_todo;
 			target_wait = NULL;
-		} else
+		} else {
 			target_node->has_async_transaction = 1;
+			target_list = &target_proc->todo;
+			target_wait = &target_proc->wait;
+		}
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	spin_unlock(&target_proc->inner_lock);
+
+	if (reply)
+		binder_free_transaction(in_reply_to);
+	if (target_node)
+		binder_dec_node_tmpref(target_node);
 	return;
 
 err_get_unused_fd_failed:
@@ -1746,6 +2479,7 @@ err_fd_not_allowed:
 err_binder_get_ref_for_node_failed:
 err_binder_get_ref_failed:
 err_binder_new_node_failed:
+err_bad_parent:
 err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
@@ -1764,6 +2498,9 @@ err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_node)
+		binder_dec_node_tmpref(target_node);
+
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1777,10 +2514,15 @@ err_no_context_mgr_node:
 
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
+		spin_lock(&proc->inner_lock);
 		thread->return_error = BR_TRANSACTION_COMPLETE;
+		spin_unlock(&proc->inner_lock);
 		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	} else {
+		spin_lock(&proc->inner_lock);
 		thread->return_error = return_error;
+		spin_unlock(&proc->inner_lock);
+	}
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1795,9 +2537,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1811,11 +2553,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			mutex_lock(&proc->outer_lock);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
 					       binder_context_mgr_node);
-				if (ref->desc != target) {
+				if (ref && ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
 						"reference to desc 0, "
@@ -1826,6 +2569,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1854,6 +2598,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			mutex_unlock(&proc->outer_lock);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1868,8 +2613,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
-			node = binder_get_node(proc, node_ptr);
+			spin_lock(&proc->inner_lock);
+			node = binder_get_node_ilocked(proc, node_ptr);
 			if (node == NULL) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d "
 					"%s u%p no match\n",
 					proc->pid, thread->pid,
@@ -1880,6 +2627,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				break;
 			}
 			if (cookie != node->cookie) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d %s u%p node %d"
 					" cookie mismatch %p != %p\n",
 					proc->pid, thread->pid,
@@ -1891,6 +2639,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
+					spin_unlock(&proc->inner_lock);
 					binder_user_error("binder: %d:%d "
 						"BC_ACQUIRE_DONE node %d has "
 						"no pending acquire request\n",
@@ -1901,6 +2650,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				node->pending_strong_ref = 0;
 			} else {
 				if (node->pending_weak_ref == 0) {
+					spin_unlock(&proc->inner_lock);
 					binder_user_error("binder: %d:%d "
 						"BC_INCREFS_DONE node %d has "
 						"no pending increfs request\n",
@@ -1916,6 +2666,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			spin_unlock(&proc->inner_lock);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1933,20 +2684,28 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* claim the buffer so a racing free of it fails */
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
+
+			spin_lock(&proc->inner_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1963,6 +2722,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				else
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
+			spin_unlock(&proc->inner_lock);
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
 			break;
@@ -1975,7 +2735,19 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.buffers_size);
 			break;
 		}
 
@@ -1983,6 +2755,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2000,11 +2773,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2013,12 +2788,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			spin_unlock(&proc->inner_lock);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2034,8 +2812,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&proc->outer_lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2057,6 +2837,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 
 			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
 				if (ref->death) {
+					mutex_unlock(&proc->outer_lock);
 					binder_user_error("binder: %d:%"
 						"d BC_REQUEST_DEATH_NOTI"
 						"FICATION death notific"
@@ -2066,7 +2847,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
 				if (death == NULL) {
+					mutex_unlock(&proc->outer_lock);
+					spin_lock(&proc->inner_lock);
 					thread->return_error = BR_ERROR;
+					spin_unlock(&proc->inner_lock);
 					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 						     "binder: %d:%d "
 						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
@@ -2079,15 +2863,18 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					spin_lock(&proc->inner_lock);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					spin_unlock(&proc->inner_lock);
 				}
 			} else {
 				if (ref->death == NULL) {
+					mutex_unlock(&proc->outer_lock);
 					binder_user_error("binder: %d:%"
 						"d BC_CLEAR_DEATH_NOTIFI"
 						"CATION death notificat"
@@ -2097,6 +2884,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				}
 				death = ref->death;
 				if (death->cookie != cookie) {
+					mutex_unlock(&proc->outer_lock);
 					binder_user_error("binder: %d:%"
 						"d BC_CLEAR_DEATH_NOTIFI"
 						"CATION death notificat"
@@ -2107,6 +2895,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					break;
 				}
 				ref->death = NULL;
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2119,7 +2908,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				spin_unlock(&proc->inner_lock);
 			}
+			mutex_unlock(&proc->outer_lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2129,6 +2920,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2140,6 +2932,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				spin_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2156,6 +2949,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			spin_unlock(&proc->inner_lock);
 		} break;
 
 		default:
@@ -2172,9 +2966,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2191,6 +2985,18 @@ static int binder_has_thread_work(struct binder_thread *thread)
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+/*
+ * Called when a dequeued transaction could not be handed to user space:
+ * the sender is failed the same way it would be if we had died.
+ */
+static void binder_cleanup_transaction(struct binder_transaction *t)
+{
+	if (t->buffer->target_node && !(t->flags & TF_ONE_WAY))
+		binder_send_failed_reply(t, BR_FAILED_REPLY);
+	else
+		binder_free_transaction(t);
+}
+
 static int binder_thread_read(struct binder_proc *proc,
 			      struct binder_thread *thread,
 			      void  __user *buffer, int size,
@@ -2209,22 +3015,37 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		uint32_t return_error = thread->return_error;
+		uint32_t return_error2 = thread->return_error2;
+
+		/*
+		 * The copies can fault, so drop the lock for them, and only
+		 * clear an error once userspace has actually been handed it.
+		 */
+		spin_unlock(&proc->inner_lock);
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
 			if (ptr == end)
 				goto done;
-			thread->return_error2 = BR_OK;
+			spin_lock(&proc->inner_lock);
+			if (thread->return_error2 == return_error2)
+				thread->return_error2 = BR_OK;
+			spin_unlock(&proc->inner_lock);
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		if (put_user(return_error, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
+		spin_lock(&proc->inner_lock);
+		if (thread->return_error == return_error)
+			thread->return_error = BR_OK;
+		spin_unlock(&proc->inner_lock);
 		goto done;
 	}
 
@@ -2232,7 +3053,8 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
+	up_read(&binder_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2243,7 +3065,7 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(current, proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2256,10 +3078,12 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	down_read(&binder_lock);
+	spin_lock(&proc->inner_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	spin_unlock(&proc->inner_lock);
 
 	if (ret)
 		return ret;
@@ -2270,37 +3094,51 @@ retry:
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
 
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
 			w = list_first_entry(&proc->todo, struct binder_work, entry);
 		else {
+			spin_unlock(&proc->inner_lock);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			spin_unlock(&proc->inner_lock);
 			break;
+		}
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			t = container_of(w, struct binder_transaction, work);
+			list_del_init(&w->entry);
+			spin_unlock(&proc->inner_lock);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			/*
+			 * This is only ever queued on our own thread->todo,
+			 * so it stays put while we copy without the lock; it
+			 * is only consumed once the copy has succeeded.
+			 */
+			spin_unlock(&proc->inner_lock);
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
 
+			spin_lock(&proc->inner_lock);
+			list_del(&w->entry);
+			spin_unlock(&proc->inner_lock);
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+
 			binder_stat_br(proc, thread, cmd);
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
-
-			list_del(&w->entry);
-			kfree(w);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
@@ -2308,6 +3146,10 @@ retry:
 			const char *cmd_name;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
 			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
+			int node_debug_id = node->debug_id;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+
 			if (weak && !node->has_weak_ref) {
 				cmd = BR_INCREFS;
 				cmd_name = "BR_INCREFS";
@@ -2330,23 +3172,24 @@ retry:
 				node->has_weak_ref = 0;
 			}
 			if (cmd != BR_NOOP) {
+				spin_unlock(&proc->inner_lock);
 				if (put_user(cmd, (uint32_t __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
+				if (put_user(node_ptr, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(node_cookie, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
+					     proc->pid, thread->pid, cmd_name, node_debug_id, node_ptr, node_cookie);
 			} else {
 				list_del_init(&w->entry);
-				if (!weak && !strong) {
+				if (!weak && !strong && !node->tmp_refs) {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p deleted\n",
 						     proc->pid, thread->pid, node->debug_id,
@@ -2360,23 +3203,34 @@ retry:
 						     proc->pid, thread->pid, node->debug_id, node->ptr,
 						     node->cookie);
 				}
+				spin_unlock(&proc->inner_lock);
 			}
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
+			void __user *death_cookie;
 			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
+			death_cookie = death->cookie;
 			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
+				list_del(&w->entry);
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else
+				list_move(&w->entry, &proc->delivered_death);
+			spin_unlock(&proc->inner_lock);
+
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(death_cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
@@ -2385,17 +3239,14 @@ retry:
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      death_cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			spin_unlock(&proc->inner_lock);
+			break;
 		}
 
 		if (!t)
@@ -2406,13 +3257,7 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			binder_transaction_priority(current, t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2422,6 +3267,7 @@ retry:
 		tr.code = t->code;
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
+		trace_binder_transaction_received(t->debug_id);
 
 		if (t->from) {
 			struct task_struct *sender = t->from->proc->tsk;
@@ -2439,11 +3285,16 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		mutex_lock(&proc->alloc_lock);
+		t->buffer->allow_user_free = 1;
+		mutex_unlock(&proc->alloc_lock);
+
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			binder_cleanup_transaction(t);
 			return -EFAULT;
+		}
 		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
 		ptr += sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
@@ -2458,38 +3309,39 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
-		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			spin_lock(&proc->inner_lock);
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
-		} else {
-			t->buffer->transaction = NULL;
-			kfree(t);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION);
-		}
+			spin_unlock(&proc->inner_lock);
+		} else
+			binder_free_transaction(t);
 		break;
 	}
 
 done:
 
 	*consumed = ptr - buffer;
+	spin_lock(&proc->inner_lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		spin_unlock(&proc->inner_lock);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		spin_unlock(&proc->inner_lock);
 	return 0;
 }
 
+/* Called with binder_lock held for write. */
 static void binder_release_work(struct list_head *list)
 {
 	struct binder_work *w;
@@ -2515,7 +3367,8 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+static struct binder_thread *binder_get_thread_ilocked(
+		struct binder_proc *proc, struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2530,26 +3383,48 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
-	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+			return thread;
 	}
+	if (new_thread == NULL)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	get_task_struct(current);
+	thread->task = current;
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
 	return thread;
 }
 
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread, *new_thread;
+
+	spin_lock(&proc->inner_lock);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	spin_unlock(&proc->inner_lock);
+	if (thread)
+		return thread;
+
+	new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	if (new_thread == NULL)
+		return NULL;
+	spin_lock(&proc->inner_lock);
+	thread = binder_get_thread_ilocked(proc, new_thread);
+	spin_unlock(&proc->inner_lock);
+	if (thread != new_thread)
+		kfree(new_thread);
+	return thread;
+}
+
+/* Called with binder_lock held for write. */
 static int binder_free_thread(struct binder_proc *proc,
 			      struct binder_thread *thread)
 {
@@ -2586,6 +3461,7 @@ static int binder_free_thread(struct binder_proc *proc,
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
 	binder_release_work(&thread->todo);
+	put_task_struct(thread->task);
 	kfree(thread);
 	binder_stats_deleted(BINDER_STAT_THREAD);
 	return active_transactions;
@@ -2598,12 +3474,18 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL) {
+		up_read(&binder_lock);
+		return POLLERR;
+	}
 
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
+	up_read(&binder_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2621,6 +3503,46 @@ static unsigned int binder_poll(struct file *filp,
 	return 0;
 }
 
+static int binder_ioctl_set_ctx_mgr(struct binder_proc *proc)
+{
+	struct binder_node *node;
+	int ret = 0;
+
+	mutex_lock(&binder_context_mgr_lock);
+	if (binder_context_mgr_node != NULL) {
+		printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+		ret = -EBUSY;
+		goto out;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->cred->euid) {
+			printk(KERN_ERR "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->cred->euid,
+			       binder_context_mgr_uid);
+			ret = -EPERM;
+			goto out;
+		}
+	} else
+		binder_context_mgr_uid = current->cred->euid;
+	node = binder_new_node(proc, NULL, NULL);
+	if (node == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	spin_lock(&proc->inner_lock);
+	node->local_weak_refs++;
+	node->local_strong_refs++;
+	node->has_strong_ref = 1;
+	node->has_weak_ref = 1;
+	spin_unlock(&proc->inner_lock);
+	smp_wmb();
+	binder_context_mgr_node = node;
+out:
+	mutex_unlock(&binder_context_mgr_lock);
+	return ret;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2635,7 +3557,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2687,43 +3609,30 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		spin_lock(&proc->inner_lock);
+		proc->max_threads = max_threads;
+		spin_unlock(&proc->inner_lock);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
+		ret = binder_ioctl_set_ctx_mgr(proc);
+		if (ret)
 			goto err;
-		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->cred->euid) {
-				printk(KERN_ERR "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->cred->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
-			goto err;
-		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
+		up_read(&binder_lock);
+		down_write(&binder_lock);
 		binder_free_thread(proc, thread);
+		downgrade_write(&binder_lock);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2742,9 +3651,12 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		spin_lock(&proc->inner_lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		spin_unlock(&proc->inner_lock);
+	}
+	up_read(&binder_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2781,7 +3693,7 @@ static struct vm_operations_struct binder_vm_ops = {
 
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	int ret;
+	int ret, i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -2833,6 +3745,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2884,14 +3800,17 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	proc->default_priority = binder_task_priority(current);
+	mutex_init(&proc->outer_lock);
+	spin_lock_init(&proc->inner_lock);
+	mutex_init(&proc->alloc_lock);
+	down_write(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2983,7 +3902,9 @@ static void binder_deferred_release(struct binder_proc *proc)
 			node->proc = NULL;
 			node->local_strong_refs = 0;
 			node->local_weak_refs = 0;
+			spin_lock(&binder_dead_nodes_lock);
 			hlist_add_head(&node->dead_node, &binder_dead_nodes);
+			spin_unlock(&binder_dead_nodes_lock);
 
 			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
 				incoming_refs++;
@@ -3034,20 +3955,31 @@ static void binder_deferred_release(struct binder_proc *proc)
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+		mutex_lock(&proc->alloc_lock);
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
+			struct binder_lru_page *lru_page = &proc->pages[i];
+			void *page_addr = proc->buffer + i * PAGE_SIZE;
+
+			if (!lru_page->page_ptr)
+				continue;
+			if (!list_empty(&lru_page->lru)) {
+				spin_lock(&binder_lru_lock);
+				binder_lru_del_locked(lru_page);
+				spin_unlock(&binder_lru_lock);
+			} else {
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
 					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
+					     proc->pid, i, page_addr);
 			}
+			unmap_kernel_range((unsigned long)page_addr,
+				PAGE_SIZE);
+			__free_page(lru_page->page_ptr);
+			lru_page->page_ptr = NULL;
+			proc->pages_held--;
+			page_count++;
 		}
+		mutex_unlock(&proc->alloc_lock);
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -3071,7 +4003,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3098,7 +4030,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3122,13 +4054,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %d:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3278,6 +4211,10 @@ static void print_binder_proc(struct seq_file *m,
 		     n = rb_next(n))
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
+		seq_printf(m, "  pages: %d held, %d in use, %d lru\n",
+			   proc->pages_held,
+			   proc->pages_held - proc->pages_lru,
+			   proc->pages_lru);
 	}
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
@@ -3330,7 +4267,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3351,17 +4290,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3369,11 +4312,13 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
@@ -3414,6 +4359,9 @@ static void print_binder_proc_stats(struct seq_file *m,
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  pages: %d held, %d in use, %d lru\n",
+		   proc->pages_held, proc->pages_held - proc->pages_lru,
+		   proc->pages_lru);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3439,7 +4387,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder state:\n");
 
@@ -3451,7 +4399,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3462,16 +4410,18 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	seq_printf(m, "lru pages: %d, reclaimed %d\n", binder_lru_count,
+		   atomic_read(&binder_lru_reclaimed));
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3482,13 +4432,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3498,11 +4448,11 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3565,6 +4515,7 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -61,6 +62,32 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
+/*
+ * A userspace buffer to be copied, as is, into the target's transaction
+ * buffer.  It is only accepted in transactions sent with BC_TRANSACTION_SG
+ * or BC_REPLY_SG, whose buffers_size must cover all such buffers (each
+ * rounded up to pointer alignment).  The driver rewrites 'buffer' to the
+ * address of the copy in the target process.
+ *
+ * If BINDER_BUFFER_FLAG_HAS_PARENT is set, 'parent' is the index, in the
+ * offsets array, of an earlier BINDER_TYPE_PTR object whose buffer holds
+ * a pointer to this one at the pointer-aligned 'parent_offset'.  That
+ * pointer is rewritten as well.  A fixup may only target the last buffer
+ * sent or one of its ancestors, never below an earlier fixup into it.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+	size_t			parent;
+	size_t			parent_offset;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +174,12 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	/* total size of the BINDER_TYPE_PTR buffers */
+	size_t			buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +357,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: as BC_TRANSACTION and BC_REPLY, but
+	 * the data may contain BINDER_TYPE_PTR objects.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -0,0 +1,89 @@
+/* drivers/staging/android/binder_trace.h
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(int debug_id, int reply, int to_proc, int to_thread,
+		 unsigned int code, unsigned int flags),
+	TP_ARGS(debug_id, reply, to_proc, to_thread, code, flags),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, reply)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->reply = reply;
+		__entry->to_proc = to_proc;
+		__entry->to_thread = to_thread;
+		__entry->code = code;
+		__entry->flags = flags;
+	),
+	TP_printk("transaction=%d dest_proc=%d dest_thread=%d reply=%d "
+		  "flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(int debug_id),
+	TP_ARGS(debug_id),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+	),
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+	),
+	TP_printk("transaction=%d", __entry->debug_id)
+);
+
+TRACE_EVENT(binder_set_priority,
+	TP_PROTO(int proc, int thread, int old_prio, int desired_prio,
+		 int new_prio),
+	TP_ARGS(proc, thread, old_prio, desired_prio, new_prio),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+		__field(int, old_prio)
+		__field(int, desired_prio)
+		__field(int, new_prio)
+	),
+	TP_fast_assign(
+		__entry->proc = proc;
+		__entry->thread = thread;
+		__entry->old_prio = old_prio;
+		__entry->desired_prio = desired_prio;
+		__entry->new_prio = new_prio;
+	),
+	TP_printk("proc=%d thread=%d old=%d => new=%d desired=%d",
+		  __entry->proc, __entry->thread, __entry->old_prio,
+		  __entry->new_prio, __entry->desired_prio)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
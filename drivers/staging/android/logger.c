@@ -24,6 +24,9 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/time.h>
 #include "logger.h"
 
@@ -34,14 +37,14 @@
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock', which is never held across user copies.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
@@ -51,14 +54,28 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock, except
+ * for buf, which is protected by mutex.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes reads on this fd */
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN]; /* entry being
+							    * read */
 };
 
+/*
+ * struct logger_staging - per-CPU buffer a writer copies its payload into
+ * before taking log->lock, so that the lock only covers a memcpy.
+ */
+struct logger_staging {
+	unsigned char		buf[LOGGER_ENTRY_MAX_PAYLOAD];
+};
+
+static DEFINE_PER_CPU(struct logger_staging, logger_staging);
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -89,7 +106,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,15 +125,13 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - reads exactly 'count' bytes from 'log' into the reader's
+ * private buffer and advances its read head.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			size_t count)
 {
 	size_t len;
 
@@ -126,20 +141,16 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	memcpy(reader->buf, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(reader->buf + len, log->buffer, count - len);
 
 	reader->r_off = logger_offset(reader->r_off + count);
-
-	return count;
 }
 
 /*
@@ -166,9 +177,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -189,26 +200,40 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	/*
+	 * reader->buf is shared by everyone reading this fd, so hold the
+	 * mutex until the entry has been copied to user space.
+	 */
+	if (mutex_lock_interruptible(&reader->mutex))
+		return -ERESTARTSYS;
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
+		return -EINVAL;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	/*
+	 * Get exactly one entry from the log. It is copied out of the ring
+	 * under the lock and to user space after dropping it, so that a
+	 * faulting reader never holds up writers.
+	 */
+	do_read_log(log, reader, ret);
+	spin_unlock(&log->lock);
 
-out:
-	mutex_unlock(&log->mutex);
+	if (copy_to_user(buf, reader->buf, ret))
+		ret = -EFAULT;
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -217,7 +242,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -255,7 +280,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -274,7 +299,7 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -291,94 +316,118 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * copy_payload_from_user - gathers 'count' bytes of payload from the
+ * vector 'iov' into 'buf'. With 'atomic' set, may be called with
+ * preemption disabled and fails rather than faulting pages in.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_payload_from_user(unsigned char *buf, const struct iovec *iov,
+				  unsigned long nr_segs, size_t count,
+				  int atomic)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (count && nr_segs-- > 0) {
+		size_t len;
+		unsigned long left;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, count);
+
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len))
+				return -EFAULT;
+			left = __copy_from_user_inatomic(buf, iov->iov_base,
+							 len);
+		} else
+			left = copy_from_user(buf, iov->iov_base, len);
+		if (unlikely(left))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		iov++;
+		buf += len;
+		count -= len;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The payload is first gathered into this CPU's staging buffer with
+ * preemption disabled, so writers on different CPUs copy in parallel and
+ * log->lock only covers stamping the entry and copying it into the ring.
+ * If the user buffer is not resident the copy is redone into a temporary
+ * buffer where faulting is allowed.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	unsigned char *payload, *slow = NULL;
+	int ret;
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	payload = get_cpu_var(logger_staging).buf;
+	pagefault_disable();
+	ret = copy_payload_from_user(payload, iov, nr_segs, header.len, 1);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		put_cpu_var(logger_staging);
+
+		slow = kmalloc(header.len, GFP_KERNEL);
+		if (!slow)
+			return -ENOMEM;
+		ret = copy_payload_from_user(slow, iov, nr_segs, header.len, 0);
+		if (ret) {
+			kfree(slow);
+			return ret;
+		}
+		payload = slow;
+	}
+
+	header.pid = current->tgid;
+	header.tid = current->pid;
+
+	spin_lock(&log->lock);
+
+	/*
+	 * Stamp the entry under the lock so that entries sit in the log in
+	 * timestamp order, as readers expect.
+	 */
+	now = current_kernel_time();
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * entry after (what will be) the new write offset.
 	 */
 	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
 
 	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, payload, header.len);
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	spin_unlock(&log->lock);
 
-		iov++;
-		ret += nr;
-	}
-
-	mutex_unlock(&log->mutex);
+	if (slow)
+		kfree(slow);
+	else
+		put_cpu_var(logger_staging);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -410,11 +459,12 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
+		mutex_init(&reader->mutex);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -432,7 +482,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
 		kfree(reader);
 	}
 
@@ -462,10 +516,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -476,7 +530,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -516,7 +570,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -549,7 +603,7 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -16,6 +16,15 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in one list per oom_adj value, updated when a process
+ * is created, gets a new oom_adj or is freed, so that picking a victim only
+ * looks at the highest oom_adj list with a live process in it rather than
+ * at every task in the system. If a process could not be indexed for lack
+ * of memory, the index is marked incomplete and the shrinker goes back to
+ * looking at every task, refilling the index as it goes, until it is
+ * complete again. The cost of the shrinker is reported in the read-only
+ * stat_* parameters.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +44,11 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,12 +69,133 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * struct lowmem_task - a process in the kill candidate index
+ *
+ * Only thread group leaders are indexed. No reference is held on the task;
+ * the entry is removed when the task struct is freed.
+ */
+struct lowmem_task {
+	struct hlist_node	hash;	/* in lowmem_task_hash, by task */
+	struct list_head	list;	/* in lowmem_buckets[], by oom_adj */
+	struct task_struct	*task;
+	int			oom_adj;
+};
+
+#define LOWMEM_BUCKETS		(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	8
+
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_HASH_BITS];
+static struct kmem_cache *lowmem_task_cachep;
+static int lowmem_index_dirty;	/* a process is missing from the index */
+
+/* Shrinker cost, exported read-only as module parameters */
+static DEFINE_SPINLOCK(lowmem_stat_lock);
+static struct {
+	unsigned long calls;		/* shrinker invocations */
+	unsigned long scans;		/* ... that looked for a victim */
+	unsigned long kills;
+	unsigned long tasks_scanned;	/* processes whose rss was read */
+	unsigned long total_us;		/* time spent in scans */
+	unsigned long max_us;		/* longest scan */
+} lowmem_stat;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
+static struct hlist_head *lowmem_task_bucket(struct task_struct *task)
+{
+	return &lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)];
+}
+
+/* Caller must hold lowmem_index_lock */
+static struct lowmem_task *lowmem_task_find(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(lt, node, lowmem_task_bucket(task), hash)
+		if (lt->task == task)
+			return lt;
+
+	return NULL;
+}
+
+/*
+ * lowmem_index_update - (re)file the process led by 'task' under its
+ * current oom_adj.
+ */
+static void lowmem_index_update(struct task_struct *task)
+{
+	struct lowmem_task *lt, *new;
+	unsigned long flags;
+	int oom_adj = task->signal->oom_adj;
+
+	new = kmem_cache_alloc(lowmem_task_cachep, GFP_ATOMIC);
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lt = lowmem_task_find(task);
+	if (!lt) {
+		if (!new) {
+			lowmem_index_dirty = 1;
+			spin_unlock_irqrestore(&lowmem_index_lock, flags);
+			lowmem_print(1, "no memory to index %d (%s)\n",
+				     task->pid, task->comm);
+			return;
+		}
+		lt = new;
+		new = NULL;
+		lt->task = task;
+		hlist_add_head(&lt->hash, lowmem_task_bucket(task));
+	} else
+		list_del(&lt->list);
+	lt->oom_adj = oom_adj;
+	list_add_tail(&lt->list, &lowmem_buckets[oom_adj - OOM_DISABLE]);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	if (new)
+		kmem_cache_free(lowmem_task_cachep, new);
+}
+
+/*
+ * lowmem_index_refill - index the process led by 'task' if it is missing,
+ * after an earlier lowmem_index_update() ran out of memory.
+ */
+static void lowmem_index_refill(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lt = lowmem_task_find(task);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	if (!lt)
+		lowmem_index_update(task);
+}
+
+static void lowmem_index_remove(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lt = lowmem_task_find(task);
+	if (lt) {
+		hlist_del(&lt->hash);
+		list_del(&lt->list);
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	if (lt)
+		kmem_cache_free(lowmem_task_cachep, lt);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -76,11 +211,47 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	if (task == lowmem_deathpending)
 		lowmem_deathpending = NULL;
 
+	lowmem_index_remove(task);
+
 	return NOTIFY_OK;
 }
 
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data);
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+
+	lowmem_index_update(task->group_leader);
+
+	return NOTIFY_OK;
+}
+
+static void lowmem_stat_scan(u64 start, int tasks_scanned, int killed)
+{
+	unsigned long us;
+
+	us = (unsigned long)div_u64(sched_clock() - start, NSEC_PER_USEC);
+
+	spin_lock(&lowmem_stat_lock);
+	lowmem_stat.scans++;
+	lowmem_stat.kills += killed;
+	lowmem_stat.tasks_scanned += tasks_scanned;
+	lowmem_stat.total_us += us;
+	if (us > lowmem_stat.max_us)
+		lowmem_stat.max_us = us;
+	spin_unlock(&lowmem_stat_lock);
+}
+
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
+	struct lowmem_task *lt;
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
 	int rem = 0;
@@ -89,10 +260,17 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
+	int tasks_scanned = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
+	unsigned long flags;
+	u64 start;
+
+	spin_lock(&lowmem_stat_lock);
+	lowmem_stat.calls++;
+	spin_unlock(&lowmem_stat_lock);
 
 	/*
 	 * If we already have a death outstanding, then
@@ -129,43 +307,97 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+	start = sched_clock();
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (lowmem_index_dirty) {
+		/*
+		 * The index is missing someone: pick from every process
+		 * instead, and put the missing ones back while we are at it.
+		 * Clear the flag first, so a refill that fails again sets it
+		 * for the next pass.
+		 */
+		lowmem_index_dirty = 0;
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+		read_lock(&tasklist_lock);
+		for_each_process(p) {
+			struct mm_struct *mm;
+			int oom_adj;
+
+			lowmem_index_refill(p);
+
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
+				continue;
+			}
+			oom_adj = p->signal->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
 			task_unlock(p);
-			continue;
+			tasks_scanned++;
+			if (tasksize <= 0)
+				continue;
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+		if (selected)
+			get_task_struct(selected);
+		read_unlock(&tasklist_lock);
+		goto kill;
+	}
+
+	/*
+	 * Walk the oom_adj lists from the top and stop at the first one
+	 * holding a process with memory: every process in lower lists would
+	 * lose to it anyway.
+	 */
+	for (i = OOM_ADJUST_MAX; i >= min_adj && !selected; i--) {
+		list_for_each_entry(lt, &lowmem_buckets[i - OOM_DISABLE], list) {
+			struct mm_struct *mm;
+
+			p = lt->task;
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			tasks_scanned++;
+			if (tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = lt->oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, lt->oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+	if (selected)
+		get_task_struct(selected);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+kill:
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -173,11 +405,12 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
+	lowmem_stat_scan(start, tasks_scanned, selected != NULL);
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -188,15 +421,41 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	lowmem_task_cachep = KMEM_CACHE(lowmem_task, 0);
+	if (!lowmem_task_cachep)
+		return -ENOMEM;
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
 	task_free_register(&task_nb);
+	oom_adj_register(&oom_adj_nb);
+
+	/* Index the processes that were created before us */
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		lowmem_index_update(p);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct lowmem_task *lt, *tmp;
+	int i;
+
 	unregister_shrinker(&lowmem_shrinker);
+	oom_adj_unregister(&oom_adj_nb);
 	task_free_unregister(&task_nb);
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		list_for_each_entry_safe(lt, tmp, &lowmem_buckets[i], list)
+			kmem_cache_free(lowmem_task_cachep, lt);
+	kmem_cache_destroy(lowmem_task_cachep);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +464,13 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(stat_calls, lowmem_stat.calls, ulong, S_IRUGO);
+module_param_named(stat_scans, lowmem_stat.scans, ulong, S_IRUGO);
+module_param_named(stat_kills, lowmem_stat.kills, ulong, S_IRUGO);
+module_param_named(stat_tasks_scanned, lowmem_stat.tasks_scanned, ulong,
+		   S_IRUGO);
+module_param_named(stat_total_us, lowmem_stat.total_us, ulong, S_IRUGO);
+module_param_named(stat_max_us, lowmem_stat.max_us, ulong, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,273 @@
+/*
+ * Compression backends and stream management for zram
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/gfp.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+static struct zcomp_backend *backends[ZCOMP_MAX_BACKENDS + 1] = {
+	&zcomp_lzo,
+#if defined(CONFIG_ZRAM_LZ4_COMPRESS)
+	&zcomp_lz4,
+#endif
+#if defined(CONFIG_ZRAM_ZLIB_COMPRESS)
+	&zcomp_zlib,
+#endif
+	NULL
+};
+
+static int find_backend(const char *comp)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (sysfs_streq(comp, backends[i]->name))
+			return i;
+	}
+	return -1;
+}
+
+int zcomp_available_algorithm(const char *comp)
+{
+	return find_backend(comp) >= 0;
+}
+
+const char *zcomp_backend_name(int idx)
+{
+	if (idx < 0 || idx >= ZCOMP_MAX_BACKENDS)
+		return NULL;
+	return backends[idx] ? backends[idx]->name : NULL;
+}
+
+/* show available compressors, the selected one in square brackets */
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!strcmp(comp, backends[i]->name))
+			sz += sprintf(buf + sz, "[%s] ", backends[i]->name);
+		else
+			sz += sprintf(buf + sz, "%s ", backends[i]->name);
+	}
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	if (zstrm->private)
+		comp->backend->destroy(zstrm->private);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Streams are also allocated from the write path, where we may be
+ * swapping out: only use GFP_NOIO and let the caller fall back to
+ * waiting for an existing stream on failure.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp, gfp_t flags)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), flags);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->private = comp->backend->create(flags);
+	zstrm->buffer = (void *)__get_free_pages(flags | __GFP_ZERO, 1);
+	if (!zstrm->private || !zstrm->buffer) {
+		zcomp_strm_free(comp, zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Get an idle stream, allocating a new one if we are below max_strm.
+ * Sleeps until a stream is released otherwise.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_first_entry(&comp->idle_strm,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+
+		if (comp->avail_strm >= comp->max_strm) {
+			spin_unlock(&comp->strm_lock);
+			wait_event(comp->strm_wait,
+				!list_empty(&comp->idle_strm));
+			continue;
+		}
+
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp, GFP_NOIO);
+		if (likely(zstrm))
+			return zstrm;
+
+		spin_lock(&comp->strm_lock);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	list_add(&zstrm->list, &comp->idle_strm);
+	spin_unlock(&comp->strm_lock);
+
+	wake_up(&comp->strm_wait);
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t *dst_len)
+{
+	return comp->backend->compress(src, zstrm->buffer, dst_len,
+					zstrm->private);
+}
+
+/*
+ * Decompression never sleeps and uses per-CPU state, so readers need
+ * neither a stream nor any lock of ours.
+ */
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+			size_t src_len, unsigned char *dst)
+{
+	void *private = NULL;
+	int cpu, ret;
+
+	cpu = get_cpu();
+	if (comp->decomp_private)
+		private = *per_cpu_ptr(comp->decomp_private, cpu);
+	ret = comp->backend->decompress(src, src_len, dst, private);
+	put_cpu();
+
+	return ret;
+}
+
+static void zcomp_decomp_free(struct zcomp *comp)
+{
+	int cpu;
+
+	if (!comp->decomp_private)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		void *private = *per_cpu_ptr(comp->decomp_private, cpu);
+
+		if (private)
+			comp->backend->destroy_decomp(private);
+	}
+	free_percpu(comp->decomp_private);
+	comp->decomp_private = NULL;
+}
+
+static int zcomp_decomp_alloc(struct zcomp *comp)
+{
+	int cpu;
+
+	if (!comp->backend->create_decomp)
+		return 0;
+
+	comp->decomp_private = alloc_percpu(void *);
+	if (!comp->decomp_private)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		void *private = comp->backend->create_decomp();
+
+		if (!private) {
+			zcomp_decomp_free(comp);
+			return -ENOMEM;
+		}
+		*per_cpu_ptr(comp->decomp_private, cpu) = private;
+	}
+	return 0;
+}
+
+/*
+ * max_strm bounds the number of writers that can compress at once.
+ * One stream is allocated up front so that the write path can always
+ * make progress even when stream allocation fails under memory pressure.
+ */
+struct zcomp *zcomp_create(const char *compress, int max_strm)
+{
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
+	int idx;
+
+	idx = find_backend(compress);
+	if (idx < 0)
+		return NULL;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->max_strm = max_strm > 0 ? max_strm : 1;
+	comp->backend = backends[idx];
+	comp->backend_idx = idx;
+
+	if (zcomp_decomp_alloc(comp))
+		goto out_free;
+
+	zstrm = zcomp_strm_alloc(comp, GFP_KERNEL);
+	if (!zstrm)
+		goto out_decomp;
+	list_add(&zstrm->list, &comp->idle_strm);
+	comp->avail_strm = 1;
+
+	return comp;
+
+out_decomp:
+	zcomp_decomp_free(comp);
+out_free:
+	kfree(comp);
+	return NULL;
+}
+
+/* Caller must make sure no stream is in use */
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(comp, zstrm);
+	}
+	zcomp_decomp_free(comp);
+	kfree(comp);
+}
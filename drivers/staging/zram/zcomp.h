@@ -0,0 +1,88 @@
+/*
+ * Compression backends and stream management for zram
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/* Max no. of compressors that can be built in */
+#define ZCOMP_MAX_BACKENDS	3
+
+/* Longest compressor name, including the trailing NUL */
+#define ZCOMP_NAME_LEN		16
+
+struct zcomp_backend {
+	/* Per-stream compression state, allocated from the write path */
+	void *(*create)(gfp_t flags);
+	void (*destroy)(void *private);
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+
+	/*
+	 * Per-CPU decompression state. Optional: decompressors that
+	 * need no state leave these NULL and get a NULL private.
+	 */
+	void *(*create_decomp)(void);
+	void (*destroy_decomp)(void *private);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private);
+
+	const char *name;
+};
+
+extern struct zcomp_backend zcomp_lzo;
+extern struct zcomp_backend zcomp_lz4;
+extern struct zcomp_backend zcomp_zlib;
+
+/*
+ * A compression stream: private state for the compressor and a buffer
+ * to compress into. A stream is used by one writer at a time, so
+ * writers holding different streams compress in parallel.
+ */
+struct zcomp_strm {
+	void *private;
+	void *buffer;		/* two pages: compressors can expand input */
+	struct list_head list;
+};
+
+struct zcomp {
+	spinlock_t strm_lock;		/* protects idle_strm, avail_strm */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;			/* streams allocated so far */
+	int max_strm;			/* upper bound on avail_strm */
+
+	struct zcomp_backend *backend;
+	int backend_idx;		/* index for per-algorithm stats */
+	void * __percpu *decomp_private;
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+int zcomp_available_algorithm(const char *comp);
+const char *zcomp_backend_name(int idx);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+			size_t src_len, unsigned char *dst);
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * LZ4 backend for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/lz4.h>
+
+#include "zcomp.h"
+
+static void *zcomp_lz4_create(gfp_t flags)
+{
+	return kzalloc(LZ4_MEM_COMPRESS, flags);
+}
+
+static void zcomp_lz4_destroy(void *private)
+{
+	kfree(private);
+}
+
+static int zcomp_lz4_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	/* the stream buffer (2 pages) always covers lz4_compressbound() */
+	return lz4_compress(src, PAGE_SIZE, dst, dst_len, private);
+}
+
+static int zcomp_lz4_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, void *private)
+{
+	size_t dst_len = PAGE_SIZE;
+
+	return lz4_decompress_unknownoutputsize(src, src_len, dst, &dst_len);
+}
+
+struct zcomp_backend zcomp_lz4 = {
+	.create = zcomp_lz4_create,
+	.destroy = zcomp_lz4_destroy,
+	.compress = zcomp_lz4_compress,
+	.decompress = zcomp_lz4_decompress,
+	.name = "lz4",
+};
@@ -0,0 +1,154 @@
+/*
+ * zlib (raw deflate) backend for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+
+#include "zcomp.h"
+
+/* Same parameters as crypto/deflate.c */
+#define ZCOMP_ZLIB_LEVEL	Z_DEFAULT_COMPRESSION
+#define ZCOMP_ZLIB_WINBITS	11
+#define ZCOMP_ZLIB_MEMLEVEL	MAX_MEM_LEVEL
+
+static void zcomp_zlib_free(struct z_stream_s *stream)
+{
+	vfree(stream->workspace);
+	kfree(stream);
+}
+
+static void *zcomp_zlib_create(gfp_t flags)
+{
+	struct z_stream_s *stream;
+
+	stream = kzalloc(sizeof(*stream), flags);
+	if (!stream)
+		return NULL;
+
+	stream->workspace = __vmalloc(zlib_deflate_workspacesize(),
+				flags | __GFP_HIGHMEM | __GFP_ZERO,
+				PAGE_KERNEL);
+	if (!stream->workspace)
+		goto out_free;
+
+	if (zlib_deflateInit2(stream, ZCOMP_ZLIB_LEVEL, Z_DEFLATED,
+			-ZCOMP_ZLIB_WINBITS, ZCOMP_ZLIB_MEMLEVEL,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		goto out_free;
+
+	return stream;
+
+out_free:
+	zcomp_zlib_free(stream);
+	return NULL;
+}
+
+static void zcomp_zlib_destroy(void *private)
+{
+	struct z_stream_s *stream = private;
+
+	zlib_deflateEnd(stream);
+	zcomp_zlib_free(stream);
+}
+
+static int zcomp_zlib_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	struct z_stream_s *stream = private;
+	int ret;
+
+	ret = zlib_deflateReset(stream);
+	if (ret != Z_OK)
+		return -EINVAL;
+
+	stream->next_in = (u8 *)src;
+	stream->avail_in = PAGE_SIZE;
+	stream->next_out = dst;
+	stream->avail_out = 2 * PAGE_SIZE;
+
+	ret = zlib_deflate(stream, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		return -EINVAL;
+
+	*dst_len = stream->total_out;
+	return 0;
+}
+
+static void *zcomp_zlib_create_decomp(void)
+{
+	struct z_stream_s *stream;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return NULL;
+
+	stream->workspace = vmalloc(zlib_inflate_workspacesize());
+	if (!stream->workspace)
+		goto out_free;
+
+	if (zlib_inflateInit2(stream, -ZCOMP_ZLIB_WINBITS) != Z_OK)
+		goto out_free;
+
+	return stream;
+
+out_free:
+	zcomp_zlib_free(stream);
+	return NULL;
+}
+
+static void zcomp_zlib_destroy_decomp(void *private)
+{
+	struct z_stream_s *stream = private;
+
+	zlib_inflateEnd(stream);
+	zcomp_zlib_free(stream);
+}
+
+static int zcomp_zlib_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, void *private)
+{
+	struct z_stream_s *stream = private;
+	int ret;
+
+	ret = zlib_inflateReset(stream);
+	if (ret != Z_OK)
+		return -EINVAL;
+
+	stream->next_in = (u8 *)src;
+	stream->avail_in = src_len;
+	stream->next_out = dst;
+	stream->avail_out = PAGE_SIZE;
+
+	ret = zlib_inflate(stream, Z_SYNC_FLUSH);
+	/* raw deflate may want one extra byte, see crypto/deflate.c */
+	if (ret == Z_OK && !stream->avail_in && stream->avail_out) {
+		u8 zerostuff = 0;
+
+		stream->next_in = &zerostuff;
+		stream->avail_in = 1;
+		ret = zlib_inflate(stream, Z_FINISH);
+	}
+	if (ret != Z_STREAM_END || stream->total_out != PAGE_SIZE)
+		return -EINVAL;
+
+	return 0;
+}
+
+struct zcomp_backend zcomp_zlib = {
+	.create = zcomp_zlib_create,
+	.destroy = zcomp_zlib_destroy,
+	.compress = zcomp_zlib_compress,
+	.create_decomp = zcomp_zlib_create_decomp,
+	.destroy_decomp = zcomp_zlib_destroy_decomp,
+	.decompress = zcomp_zlib_decompress,
+	.name = "zlib",
+};
@@ -0,0 +1,189 @@
+/*
+ * Deduplication of identical pages stored in zram
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Every stored object is described by a zram_entry which may be shared
+ * by several table slots. Entries are indexed by a hash of the page they
+ * hold, so a write whose content is already stored only takes another
+ * reference instead of compressing and allocating again.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+#include "zram_dedup.h"
+
+static struct kmem_cache *zram_entry_cache;
+
+int zram_entry_cache_create(void)
+{
+	zram_entry_cache = kmem_cache_create("zram_entry",
+				sizeof(struct zram_entry), 0, 0, NULL);
+	if (!zram_entry_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void zram_entry_cache_destroy(void)
+{
+	kmem_cache_destroy(zram_entry_cache);
+}
+
+struct zram_entry *zram_entry_alloc(struct zram *zram, unsigned long handle,
+				unsigned int len, gfp_t flags)
+{
+	struct zram_entry *entry;
+
+	entry = kmem_cache_alloc(zram_entry_cache, flags);
+	if (!entry)
+		return NULL;
+
+	RB_CLEAR_NODE(&entry->rb_node);
+	entry->refcount = 1;
+	entry->handle = handle;
+	entry->len = len;
+
+	spin_lock(&zram->dedup_lock);
+	zram->stats.unique_size += len;
+	zram_stat_inc(&zram->stats.pages_unique);
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+void zram_entry_get(struct zram *zram, struct zram_entry *entry)
+{
+	spin_lock(&zram->dedup_lock);
+	entry->refcount++;
+	spin_unlock(&zram->dedup_lock);
+}
+
+void zram_entry_put(struct zram *zram, struct zram_entry *entry)
+{
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		spin_unlock(&zram->dedup_lock);
+		return;
+	}
+
+	if (!RB_EMPTY_NODE(&entry->rb_node))
+		rb_erase(&entry->rb_node, &zram->dedup_root);
+	zram->stats.unique_size -= entry->len;
+	zram_stat_dec(&zram->stats.pages_unique);
+	spin_unlock(&zram->dedup_lock);
+
+	zs_free(zram->mem_pool, entry->handle);
+	kmem_cache_free(zram_entry_cache, entry);
+}
+
+u32 zram_dedup_checksum(const unsigned char *mem)
+{
+	return jhash2((const u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/*
+ * Pages of equal checksum are candidates only: the stored copy is
+ * decompressed into the writer's stream buffer and compared in full.
+ */
+static int zram_dedup_match(struct zram *zram, struct zcomp_strm *zstrm,
+				struct zram_entry *entry,
+				const unsigned char *mem)
+{
+	unsigned char *cmem;
+	int match = 0;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	if (entry->len == PAGE_SIZE)
+		match = !memcmp(cmem, mem, PAGE_SIZE);
+	else if (!zcomp_decompress(zram->comp, cmem, entry->len,
+				zstrm->buffer))
+		match = !memcmp(zstrm->buffer, mem, PAGE_SIZE);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look up a stored page identical to @mem. On success the returned
+ * entry carries a reference for the caller to install in the table.
+ *
+ * Only the first entry of a given checksum is compared, with the tree
+ * unlocked: checksum collisions between different pages are rare, and
+ * missing a duplicate only costs memory.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, struct zcomp_strm *zstrm,
+				const unsigned char *mem, u32 checksum)
+{
+	struct rb_node *node;
+	struct zram_entry *entry = NULL;
+
+	spin_lock(&zram->dedup_lock);
+	node = zram->dedup_root.rb_node;
+	while (node) {
+		struct zram_entry *cur;
+
+		cur = rb_entry(node, struct zram_entry, rb_node);
+		if (checksum < cur->checksum)
+			node = node->rb_left;
+		else if (checksum > cur->checksum)
+			node = node->rb_right;
+		else {
+			entry = cur;
+			entry->refcount++;
+			break;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	if (!entry)
+		return NULL;
+
+	if (zram_dedup_match(zram, zstrm, entry, mem))
+		return entry;
+
+	zram_entry_put(zram, entry);
+	return NULL;
+}
+
+/*
+ * Make a newly written entry visible to zram_dedup_find(). Must be
+ * called after the object has been filled in.
+ */
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry,
+				u32 checksum)
+{
+	struct rb_node **p, *parent = NULL;
+
+	entry->checksum = checksum;
+
+	spin_lock(&zram->dedup_lock);
+	p = &zram->dedup_root.rb_node;
+	while (*p) {
+		struct zram_entry *cur;
+
+		parent = *p;
+		cur = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < cur->checksum)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, p);
+	rb_insert_color(&entry->rb_node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+}
@@ -21,22 +21,30 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
 #include "zram_drv.h"
+#include "zram_dedup.h"
 
 /* Globals */
 static int zram_major;
 static struct zram *devices;
 
+/* Compressor used unless changed through sysfs comp_algorithm */
+static const char *default_compressor = "lzo";
+
 /* Module params (documentation at end) */
 static unsigned int num_devices;
+static unsigned int max_comp_streams;
 
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
@@ -56,18 +64,19 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -111,8 +120,7 @@ static void zram_ioctl_get_stats(struct zram *zram,
 	size_t succ_writes, mem_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
 
-	mem_used = xv_get_total_size_bytes(zram->mem_pool)
-			+ (rs->pages_expand << PAGE_SHIFT);
+	mem_used = zs_get_total_size_bytes(zram->mem_pool);
 	succ_writes = zram_stat64_read(zram, &rs->num_writes) -
 			zram_stat64_read(zram, &rs->failed_writes);
 
@@ -143,73 +151,298 @@ static void zram_ioctl_get_stats(struct zram *zram,
 #endif /* CONFIG_ZRAM_STATS */
 }
 
+#if defined(CONFIG_ZRAM_STATS)
+static u64 zram_comp_clock(void)
+{
+	return sched_clock();
+}
+
+static void zram_comp_stat(struct zram *zram, int write, size_t clen,
+				u64 start)
+{
+	struct zram_comp_stats *cs;
+	u64 delta = sched_clock() - start;
+
+	cs = &zram->comp_stats[zram->comp->backend_idx];
+
+	spin_lock(&zram->stat64_lock);
+	if (write) {
+		cs->comp_pages++;
+		cs->compr_bytes += clen;
+		cs->comp_ns += delta;
+	} else {
+		cs->decomp_pages++;
+		cs->decomp_ns += delta;
+	}
+	spin_unlock(&zram->stat64_lock);
+}
+#else
+#define zram_comp_clock()	0
+#define zram_comp_stat(zram, write, clen, start)
+#endif /* CONFIG_ZRAM_STATS */
+
+#if defined(CONFIG_ZRAM_WRITEBACK)
+static u32 zram_now(void)
+{
+	return (u32)div_u64(get_jiffies_64(), HZ);
+}
+
+static void zram_touch(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = zram_now();
+}
+
+/* Block 0 is never handed out, so 0 means the device is full */
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bitmap_lock);
+	blk = find_first_zero_bit(zram->bitmap, zram->nr_pages);
+	if (blk < zram->nr_pages)
+		set_bit(blk, zram->bitmap);
+	else
+		blk = 0;
+	spin_unlock(&zram->bitmap_lock);
+
+	return blk;
+}
+
+static void free_block_bdev(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bitmap_lock);
+	WARN_ON(!test_bit(blk, zram->bitmap));
+	clear_bit(blk, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+}
+
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	close_bdev_exclusive(zram->backing_dev, FMODE_READ | FMODE_WRITE);
+	vfree(zram->bitmap);
+	zram->backing_dev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/* Called with init_lock held on a device that is not initialized */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long nr_pages, *bitmap;
+	size_t bitmap_sz;
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		return -EINVAL;
+	}
+
+	bitmap_sz = BITS_TO_LONGS(nr_pages) * sizeof(long);
+	bitmap = vmalloc(bitmap_sz);
+	if (!bitmap) {
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		return -ENOMEM;
+	}
+	memset(bitmap, 0, bitmap_sz);
+	set_bit(0, bitmap);
+
+	zram_reset_backing_dev(zram);
+	zram->backing_dev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+
+	pr_info("%s: using %s as backing device (%lu pages)\n",
+		zram->disk->disk_name, path, nr_pages);
+	return 0;
+}
+
+/*
+ * Reads of written back pages are submitted from zram_make_request(),
+ * where bios we submit are only issued after we return. They therefore
+ * complete asynchronously, and the original bio completes when the last
+ * of them has.
+ */
+struct zram_bd_read {
+	struct bio *parent;
+	atomic_t pending;
+	int error;
+};
+
+static void zram_bd_read_put(struct zram_bd_read *rd)
+{
+	if (!atomic_dec_and_test(&rd->pending))
+		return;
+
+	if (rd->error)
+		bio_io_error(rd->parent);
+	else {
+		set_bit(BIO_UPTODATE, &rd->parent->bi_flags);
+		bio_endio(rd->parent, 0);
+	}
+	kfree(rd);
+}
+
+static void zram_bd_read_end_io(struct bio *bio, int err)
+{
+	struct zram_bd_read *rd = bio->bi_private;
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		rd->error = -EIO;
+	else
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+
+	bio_put(bio);
+	zram_bd_read_put(rd);
+}
+
+static int zram_bd_read(struct zram *zram, struct bio *parent,
+			struct zram_bd_read **rdp, struct page *page,
+			unsigned long blk)
+{
+	struct zram_bd_read *rd = *rdp;
+	struct bio *bio;
+
+	if (!rd) {
+		rd = kmalloc(sizeof(*rd), GFP_NOIO);
+		if (!rd)
+			return -ENOMEM;
+		rd->parent = parent;
+		/* Reference of the submitter, dropped by zram_read() */
+		atomic_set(&rd->pending, 1);
+		rd->error = 0;
+		*rdp = rd;
+	}
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->backing_dev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_bd_read_end_io;
+	bio->bi_private = rd;
+
+	atomic_inc(&rd->pending);
+	submit_bio(READ, bio);
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return 0;
+}
+
+static void zram_bd_write_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_bd_write(struct zram *zram, struct page *page,
+			unsigned long blk)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_KERNEL, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->backing_dev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_bd_write_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+#else
+#define zram_touch(zram, index)
+#define zram_reset_backing_dev(zram)
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	struct zram_entry *entry;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
-
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (zram->table[index].element)
+			zram_stat_dec(&zram->stats.pages_same);
+		else
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram->table[index].element = 0;
 		return;
 	}
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
-		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		free_block_bdev(zram, zram->table[index].element);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram->table[index].element = 0;
+		return;
 	}
+#endif
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	entry = zram->table[index].entry;
+	if (unlikely(!entry))
+		return;
 
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
+	clen = entry->len;
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_dec(&zram->stats.pages_expand);
+	} else if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
-out:
+	zram_entry_put(zram, entry);
+
 	zram->stats.compr_size -= clen;
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].entry = NULL;
 }
 
-static void handle_zero_page(struct page *page)
+static void handle_same_page(struct page *page, unsigned long element)
 {
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
-	kunmap_atomic(user_mem, KM_USER0);
-
-	flush_dcache_page(page);
-}
-
-static void handle_uncompressed_page(struct zram *zram,
-				struct page *page, u32 index)
-{
-	unsigned char *user_mem, *cmem;
-
-	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
-
-	memcpy(user_mem, cmem, PAGE_SIZE);
+	if (likely(!element))
+		memset(user_mem, 0, PAGE_SIZE);
+	else {
+		unsigned long *p = user_mem;
+		unsigned int pos;
+
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*p); pos++)
+			p[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
 
 	flush_dcache_page(page);
 }
@@ -220,54 +453,95 @@ static int zram_read(struct zram *zram, struct bio *bio)
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	struct zram_bd_read *rd = NULL;
+#endif
 
 	zram_stat64_inc(zram, &zram->stats.num_reads);
 
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
+		u64 start;
 		size_t clen;
+		unsigned long handle;
+		struct zram_entry *entry;
 		struct page *page;
-		struct zobj_header *zheader;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
+		/*
+		 * Readers only exclude writers replacing or freeing this
+		 * table entry; they never wait for compression to finish.
+		 */
+		read_lock(&zram->table_lock);
+
+		if (zram_test_flag(zram, index, ZRAM_SAME)) {
+			unsigned long element = zram->table[index].element;
+
+			read_unlock(&zram->table_lock);
+			handle_same_page(page, element);
+			index++;
 			continue;
 		}
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			unsigned long blk = zram->table[index].element;
+
+			zram_touch(zram, index);
+			read_unlock(&zram->table_lock);
+			ret = zram_bd_read(zram, bio, &rd, page, blk);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! err=%d, "
+					"page=%u\n", ret, index);
+				zram_stat64_inc(zram,
+						&zram->stats.failed_reads);
+				goto out;
+			}
+			index++;
+			continue;
+		}
+#endif
+
+		entry = zram->table[index].entry;
+
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!entry)) {
+			read_unlock(&zram->table_lock);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
+			index++;
 			continue;
 		}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			continue;
-		}
+		handle = entry->handle;
+		clen = entry->len;
+		zram_touch(zram, index);
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		/* Page is stored uncompressed since it's incompressible */
+		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+			memcpy(user_mem, cmem, PAGE_SIZE);
+			ret = 0;
+		} else {
+			start = zram_comp_clock();
+			ret = zcomp_decompress(zram->comp, cmem, clen,
+						user_mem);
+			if (likely(!ret))
+				zram_comp_stat(zram, 0, 0, start);
+		}
 
+		zs_unmap_object(zram->mem_pool, handle);
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		read_unlock(&zram->table_lock);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -278,11 +552,24 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		index++;
 	}
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	if (rd) {
+		zram_bd_read_put(rd);
+		return 0;
+	}
+#endif
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	if (rd) {
+		rd->error = -EIO;
+		zram_bd_read_put(rd);
+		return 0;
+	}
+#endif
 	bio_io_error(bio);
 	return 0;
 }
@@ -299,101 +586,121 @@ static int zram_write(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		u32 offset;
+		u64 start;
+		u32 checksum = 0;
 		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
+		unsigned long handle, element;
+		struct zram_entry *entry = NULL;
+		struct zcomp_strm *zstrm;
+		struct page *page;
+		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
+		user_mem = kmap_atomic(page, KM_USER0);
+		ret = page_same_filled(user_mem, &element);
+		kunmap_atomic(user_mem, KM_USER0);
+		if (ret) {
+			write_lock(&zram->table_lock);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
 			zram_free_page(zram, index);
+			if (element)
+				zram_stat_inc(&zram->stats.pages_same);
+			else
+				zram_stat_inc(&zram->stats.pages_zero);
+			zram->table[index].element = element;
+			zram_set_flag(zram, index, ZRAM_SAME);
+			write_unlock(&zram->table_lock);
+			index++;
+			continue;
+		}
 
-		mutex_lock(&zram->lock);
-
+		/*
+		 * Compress into a private stream so that writers on other
+		 * CPUs can compress concurrently. The table is only locked
+		 * once the new object is ready.
+		 */
+		zstrm = zcomp_strm_find(zram->comp);
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			continue;
+
+		/* Share the object of an identical page if one is stored */
+		if (zram->use_dedup) {
+			checksum = zram_dedup_checksum(user_mem);
+			entry = zram_dedup_find(zram, zstrm, user_mem, checksum);
+			if (entry) {
+				kunmap_atomic(user_mem, KM_USER0);
+				zcomp_strm_release(zram->comp, zstrm);
+				clen = entry->len;
+				goto install;
+			}
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		start = zram_comp_clock();
+		ret = zcomp_compress(zram->comp, zstrm, user_mem, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zcomp_strm_release(zram->comp, zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
+		zram_comp_stat(zram, 1, clen, start);
 
 		/*
 		 * Page is incompressible. Store it as-is (uncompressed)
 		 * since we do not want to return too many disk write
 		 * errors which has side effect of hanging the system.
 		 */
-		if (unlikely(clen > max_zpage_size)) {
+		if (unlikely(clen > max_zpage_size))
 			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
-			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+		handle = zs_malloc(zram->mem_pool, clen);
+		if (likely(handle)) {
+			entry = zram_entry_alloc(zram, handle, clen, GFP_NOIO);
+			if (unlikely(!entry))
+				zs_free(zram->mem_pool, handle);
 		}
-
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(!entry)) {
+			zcomp_strm_release(zram->comp, zstrm);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		if (unlikely(clen == PAGE_SIZE)) {
+			user_mem = kmap_atomic(page, KM_USER0);
+			memcpy(cmem, user_mem, PAGE_SIZE);
+			kunmap_atomic(user_mem, KM_USER0);
+		} else
+			memcpy(cmem, zstrm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+		zcomp_strm_release(zram->comp, zstrm);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		if (zram->use_dedup)
+			zram_dedup_insert(zram, entry, checksum);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
-#endif
+install:
+		write_lock(&zram->table_lock);
 
-		memcpy(cmem, src, clen);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_free_page(zram, index);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		zram->table[index].entry = entry;
+		zram_touch(zram, index);
+		if (unlikely(clen == PAGE_SIZE)) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+		}
 
 		/* Update stats */
 		zram->stats.compr_size += clen;
@@ -401,7 +708,7 @@ memstore:
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+		write_unlock(&zram->table_lock);
 		index++;
 	}
 
@@ -414,6 +721,121 @@ out:
 	return 0;
 }
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+static int zram_wb_candidate(struct zram *zram, u32 index,
+			enum zram_wb_mode mode, u32 now)
+{
+	struct zram_entry *entry = zram->table[index].entry;
+
+	if (zram_test_flag(zram, index, ZRAM_SAME) ||
+			zram_test_flag(zram, index, ZRAM_WB) || !entry)
+		return 0;
+
+	/*
+	 * Writing back one user of a shared object frees nothing. The
+	 * unlocked read of refcount only makes this a heuristic.
+	 */
+	if (entry->refcount > 1)
+		return 0;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return now - zram->table[index].ac_time >= zram->idle_age;
+}
+
+/*
+ * Move pages selected by @mode out to the backing device. Called with
+ * init_lock held on an initialized device, so the table and pool stay.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0;
+	u32 index, now = zram_now();
+	size_t num_pages = zram->disksize >> PAGE_SHIFT;
+	struct page *page;
+
+	if (!zram->backing_dev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < num_pages; index++) {
+		unsigned long blk;
+		struct zram_entry *entry;
+		unsigned char *user_mem, *cmem;
+
+		read_lock(&zram->table_lock);
+		if (!zram_wb_candidate(zram, index, mode, now)) {
+			read_unlock(&zram->table_lock);
+			continue;
+		}
+		entry = zram->table[index].entry;
+		zram_entry_get(zram, entry);
+
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		if (entry->len == PAGE_SIZE)
+			memcpy(user_mem, cmem, PAGE_SIZE);
+		else
+			ret = zcomp_decompress(zram->comp, cmem, entry->len,
+						user_mem);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+		kunmap_atomic(user_mem, KM_USER0);
+		read_unlock(&zram->table_lock);
+
+		if (unlikely(ret)) {
+			pr_err("Decompression failed! err=%d, page=%u\n",
+				ret, index);
+			zram_entry_put(zram, entry);
+			break;
+		}
+
+		blk = alloc_block_bdev(zram);
+		if (!blk) {
+			zram_entry_put(zram, entry);
+			ret = -ENOSPC;
+			break;
+		}
+
+		ret = zram_bd_write(zram, page, blk);
+		if (ret) {
+			free_block_bdev(zram, blk);
+			zram_entry_put(zram, entry);
+			break;
+		}
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+		/*
+		 * The page may have been rewritten meanwhile. If it still
+		 * holds the same object, what we wrote is still its data.
+		 */
+		write_lock(&zram->table_lock);
+		if (!zram_test_flag(zram, index, ZRAM_SAME) &&
+				!zram_test_flag(zram, index, ZRAM_WB) &&
+				zram->table[index].entry == entry) {
+			zram_free_page(zram, index);
+			zram->table[index].element = blk;
+			zram_set_flag(zram, index, ZRAM_WB);
+			zram_stat_inc(&zram->stats.pages_wb);
+			blk = 0;
+		}
+		write_unlock(&zram->table_lock);
+
+		if (blk)
+			free_block_bdev(zram, blk);
+		zram_entry_put(zram, entry);
+
+		cond_resched();
+	}
+
+	__free_page(page);
+	return ret;
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -471,35 +893,31 @@ static void reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	for (index = 0; zram->table &&
+			index < zram->disksize >> PAGE_SHIFT; index++) {
+		struct zram_entry *entry = zram->table[index].entry;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		if (!entry || zram_test_flag(zram, index, ZRAM_SAME) ||
+				zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		zram_entry_put(zram, entry);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	zram_reset_backing_dev(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -518,16 +936,10 @@ static int zram_ioctl_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor,
+				max_comp_streams ?: num_online_cpus());
+	if (!zram->comp) {
+		pr_err("Error initializing %s compressor\n", zram->compressor);
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -548,7 +960,8 @@ static int zram_ioctl_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -620,7 +1033,9 @@ static int zram_ioctl(struct block_device *bdev, fmode_t mode,
 		break;
 	}
 	case ZRAMIO_INIT:
+		mutex_lock(&zram->init_lock);
 		ret = zram_ioctl_init_device(zram);
+		mutex_unlock(&zram->init_lock);
 		break;
 
 	case ZRAMIO_RESET:
@@ -634,7 +1049,9 @@ static int zram_ioctl(struct block_device *bdev, fmode_t mode,
 		if (bdev)
 			fsync_bdev(bdev);
 
+		mutex_lock(&zram->init_lock);
 		ret = zram_ioctl_reset_device(zram);
+		mutex_unlock(&zram->init_lock);
 		break;
 
 	default:
@@ -651,7 +1068,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->table_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->table_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -665,8 +1084,18 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
+	rwlock_init(&zram->table_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_root = RB_ROOT;
+	zram->use_dedup = 1;
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	spin_lock_init(&zram->bitmap_lock);
+	zram->idle_age = default_idle_age;
+#endif
+	mutex_init(&zram->init_lock);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -710,6 +1139,15 @@ static int create_device(struct zram *zram, int device_id)
 
 	add_disk(zram->disk);
 
+#ifdef CONFIG_SYSFS
+	ret = sysfs_create_group(&disk_to_dev(zram->disk)->kobj,
+				&zram_disk_attr_group);
+	if (ret < 0) {
+		pr_warning("Error creating sysfs group");
+		goto out;
+	}
+#endif
+
 	zram->init_done = 0;
 
 out:
@@ -719,6 +1157,10 @@ out:
 static void destroy_device(struct zram *zram)
 {
 	if (zram->disk) {
+#ifdef CONFIG_SYSFS
+		sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
+				&zram_disk_attr_group);
+#endif
 		del_gendisk(zram->disk);
 		put_disk(zram->disk);
 	}
@@ -738,11 +1180,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	ret = zram_entry_cache_create();
+	if (ret) {
+		pr_warning("Unable to create entry cache\n");
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_cache;
 	}
 
 	if (!num_devices) {
@@ -772,6 +1220,8 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_cache:
+	zram_entry_cache_destroy();
 out:
 	return ret;
 }
@@ -787,16 +1237,21 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			reset_device(zram);
+		zram_reset_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(devices);
+	zram_entry_cache_destroy();
 	pr_debug("Cleanup done!\n");
 }
 
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of zram devices");
+module_param(max_comp_streams, uint, 0);
+MODULE_PARM_DESC(max_comp_streams, "Max parallel compressions per device "
+		"(default: number of online CPUs)");
 
 module_init(zram_init);
 module_exit(zram_exit);
@@ -17,9 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
 
 #include "zram_ioctl.h"
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -27,18 +29,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -50,10 +40,15 @@ static const unsigned default_disksize_perc_ram = 25;
  */
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+/* Pages not accessed for this many seconds are idle for writeback */
+static const unsigned default_idle_age = 60 * 60;
+#endif
+
 /*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ * NOTE: max_zpage_size must be less than PAGE_SIZE, the largest
+ * object zs_malloc() can allocate: uncompressed pages are stored
+ * as PAGE_SIZE objects.
  */
 
 /*-- End of configurable params */
@@ -68,19 +63,45 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/*
+	 * Page is one word repeated (zeros included). The word is kept
+	 * in the table entry and no memory is allocated.
+	 */
+	ZRAM_SAME,
+
+	/*
+	 * Page was written back to the backing device. The block it
+	 * occupies there is kept in the table entry.
+	 */
+	ZRAM_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A stored object. Shared by all table entries holding the same page
+ * content; see zram_dedup.c.
+ */
+struct zram_entry {
+	struct rb_node rb_node;	/* in zram->dedup_root, keyed by checksum */
+	u32 checksum;
+	unsigned int refcount;	/* protected by zram->dedup_lock */
+	unsigned long handle;	/* zsmalloc handle */
+	unsigned int len;	/* object size (compressed length) */
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		struct zram_entry *entry;	/* NULL if not stored */
+		unsigned long element;		/* ZRAM_SAME fill word or
+						 * ZRAM_WB block */
+	};
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	u32 ac_time;	/* last access, seconds since boot */
+#endif
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -88,6 +109,8 @@ struct zram_stats {
 	/* basic stats */
 	size_t compr_size;	/* compressed size of pages stored -
 				 * needed to enforce memlimit */
+	size_t unique_size;	/* compr_size without duplicates;
+				 * protected by dedup_lock */
 	/* more stats */
 #if defined(CONFIG_ZRAM_STATS)
 	u64 num_reads;		/* failed + successful */
@@ -97,20 +120,44 @@ struct zram_stats {
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other same filled pages */
+	u32 pages_unique;	/* no. of objects stored (dedup_lock) */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_wb;		/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+#endif
+};
+
+/*
+ * Per-algorithm cost and effectiveness. Kept across device resets so
+ * that different compressors can be compared on the same workload.
+ */
+struct zram_comp_stats {
+#if defined(CONFIG_ZRAM_STATS)
+	u64 comp_pages;		/* pages fed to the compressor */
+	u64 compr_bytes;	/* compressor output for those pages */
+	u64 comp_ns;		/* time spent compressing */
+	u64 decomp_pages;
+	u64 decomp_ns;		/* time spent decompressing */
 #endif
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;	/* pool of compression streams */
+	char compressor[ZCOMP_NAME_LEN];
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t table_lock;	/* protect table entries and 32-bit stats.
+				 * Compression happens outside of it. */
+	spinlock_t dedup_lock;	/* protect dedup_root and entry refcounts */
+	struct rb_root dedup_root;
+	int use_dedup;
+	struct mutex init_lock;	/* serialize init, reset and
+				 * compressor changes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -120,31 +167,64 @@ struct zram {
 	 */
 	size_t disksize;	/* bytes */
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	/* Device incompressible and idle pages are written back to */
+	struct block_device *backing_dev;
+	unsigned long *bitmap;	/* blocks in use on backing_dev */
+	unsigned long nr_pages;	/* size of backing_dev in pages */
+	spinlock_t bitmap_lock;
+	unsigned int idle_age;	/* seconds without access before a
+				 * page counts as idle */
+#endif
+
 	struct zram_stats stats;
+	struct zram_comp_stats comp_stats[ZCOMP_MAX_BACKENDS];
+};
+
+#ifdef CONFIG_SYSFS
+extern struct attribute_group zram_disk_attr_group;
+#endif
+
+#if defined(CONFIG_ZRAM_WRITEBACK)
+/* What zram_writeback() writes out */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,		/* incompressible pages */
+	ZRAM_WB_IDLE,		/* pages idle for at least idle_age */
 };
 
+int zram_set_backing_dev(struct zram *zram, const char *path);
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
+
 /*-- */
 
 /* Debugging and Stats */
 #if defined(CONFIG_ZRAM_STATS)
-static void zram_stat_inc(u32 *v)
+static inline void zram_stat_inc(u32 *v)
 {
 	*v = *v + 1;
 }
 
-static void zram_stat_dec(u32 *v)
+static inline void zram_stat_dec(u32 *v)
 {
 	*v = *v - 1;
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static inline void zram_stat64_inc(struct zram *zram, u64 *v)
 {
 	spin_lock(&zram->stat64_lock);
 	*v = *v + 1;
 	spin_unlock(&zram->stat64_lock);
 }
 
-static u64 zram_stat64_read(struct zram *zram, u64 *v)
+static inline void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+{
+	spin_lock(&zram->stat64_lock);
+	*v = *v + inc;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static inline u64 zram_stat64_read(struct zram *zram, u64 *v)
 {
 	u64 val;
 
@@ -158,6 +238,7 @@ static u64 zram_stat64_read(struct zram *zram, u64 *v)
 #define zram_stat_inc(v)
 #define zram_stat_dec(v)
 #define zram_stat64_inc(r, v)
+#define zram_stat64_add(r, v, i)
 #define zram_stat64_read(r, v)
 #endif /* CONFIG_ZRAM_STATS */
 
@@ -0,0 +1,367 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+#ifdef CONFIG_SYSFS
+
+static struct zram *dev_to_zram(struct device *dev)
+{
+	return dev_to_disk(dev)->private_data;
+}
+
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t sz;
+
+	mutex_lock(&zram->init_lock);
+	sz = zcomp_available_show(zram->compressor, buf);
+	mutex_unlock(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	char compressor[ZCOMP_NAME_LEN];
+	size_t sz;
+
+	strlcpy(compressor, buf, sizeof(compressor));
+	/* ignore trailing newline */
+	sz = strlen(compressor);
+	if (sz > 0 && compressor[sz - 1] == '\n')
+		compressor[sz - 1] = 0x00;
+
+	if (!zcomp_available_algorithm(compressor))
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	strlcpy(zram->compressor, compressor, sizeof(zram->compressor));
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long freed;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	freed = zs_compact(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	pr_debug("Compaction freed %lu pages\n", freed);
+	return len;
+}
+
+/*
+ * Memory held by the allocator in bytes, bytes used by stored objects,
+ * the difference as a percentage of the former, and pages freed by
+ * compaction so far.
+ */
+static ssize_t frag_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zs_pool_stats stats;
+	u64 mem_used, frag = 0;
+
+	memset(&stats, 0, sizeof(stats));
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zs_get_pool_stats(zram->mem_pool, &stats);
+	mutex_unlock(&zram->init_lock);
+
+	mem_used = stats.pages_total << PAGE_SHIFT;
+	if (mem_used)
+		frag = div64_u64((mem_used - stats.obj_bytes) * 100, mem_used);
+
+	return sprintf(buf, "%llu %llu %llu %llu\n", mem_used,
+			stats.obj_bytes, frag, stats.pages_compacted);
+}
+
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->use_dedup);
+}
+
+/*
+ * Can be changed at any time: pages stored while deduplication was off
+ * are simply never matched.
+ */
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long val;
+
+	if (strict_strtoul(buf, 10, &val))
+		return -EINVAL;
+
+	zram->use_dedup = !!val;
+	return len;
+}
+
+#if defined(CONFIG_ZRAM_WRITEBACK)
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	char name[BDEVNAME_SIZE];
+	ssize_t sz;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->backing_dev)
+		sz = sprintf(buf, "%s\n", bdevname(zram->backing_dev, name));
+	else
+		sz = sprintf(buf, "none\n");
+	mutex_unlock(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	char *path;
+	size_t sz;
+	int ret;
+
+	path = kstrndup(buf, PATH_MAX, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	/* ignore trailing newline */
+	sz = strlen(path);
+	if (sz > 0 && path[sz - 1] == '\n')
+		path[sz - 1] = 0x00;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		kfree(path);
+		pr_info("Can't set backing device for initialized device\n");
+		return -EBUSY;
+	}
+	ret = zram_set_backing_dev(zram, path);
+	mutex_unlock(&zram->init_lock);
+	kfree(path);
+
+	return ret ? ret : len;
+}
+
+static ssize_t idle_age_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", zram->idle_age);
+}
+
+static ssize_t idle_age_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long val;
+
+	if (strict_strtoul(buf, 10, &val) || val > UINT_MAX)
+		return -EINVAL;
+
+	zram->idle_age = val;
+	return len;
+}
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	enum zram_wb_mode mode;
+	int ret;
+
+	if (sysfs_streq(buf, "huge"))
+		mode = ZRAM_WB_HUGE;
+	else if (sysfs_streq(buf, "idle"))
+		mode = ZRAM_WB_IDLE;
+	else
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	ret = zram_writeback(zram, mode);
+	mutex_unlock(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
+#if defined(CONFIG_ZRAM_STATS)
+/*
+ * Pages currently on the backing device, pages read back from it and
+ * pages written to it.
+ */
+static ssize_t bd_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u %llu %llu\n", zram->stats.pages_wb,
+		zram_stat64_read(zram, &zram->stats.bd_reads),
+		zram_stat64_read(zram, &zram->stats.bd_writes));
+}
+
+static DEVICE_ATTR(bd_stats, S_IRUGO, bd_stats_show, NULL);
+#endif
+
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(idle_age, S_IRUGO | S_IWUSR,
+		idle_age_show, idle_age_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
+#if defined(CONFIG_ZRAM_STATS)
+/*
+ * Zero filled pages, other same filled pages, pages sharing an object
+ * with another page, and bytes these save compared to storing every
+ * page on its own.
+ */
+static ssize_t dedup_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	u32 pages_zero, pages_same, pages_dup;
+	u64 saved;
+
+	read_lock(&zram->table_lock);
+	spin_lock(&zram->dedup_lock);
+	pages_zero = zram->stats.pages_zero;
+	pages_same = zram->stats.pages_same;
+	pages_dup = zram->stats.pages_stored - zram->stats.pages_unique;
+	saved = zram->stats.compr_size - zram->stats.unique_size;
+	spin_unlock(&zram->dedup_lock);
+	read_unlock(&zram->table_lock);
+
+	saved += (u64)(pages_zero + pages_same) << PAGE_SHIFT;
+
+	return sprintf(buf, "%u %u %u %llu\n", pages_zero, pages_same,
+			pages_dup, saved);
+}
+
+static DEVICE_ATTR(dedup_stats, S_IRUGO, dedup_stats_show, NULL);
+
+/*
+ * One line per compressor used on this device since module load:
+ * name, pages compressed, their original and compressed size in bytes,
+ * average ns per compressed page, pages decompressed and average ns
+ * per decompressed page.
+ */
+static ssize_t comp_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; i < ZCOMP_MAX_BACKENDS; i++) {
+		struct zram_comp_stats cs;
+		const char *name = zcomp_backend_name(i);
+		u64 comp_avg = 0, decomp_avg = 0;
+
+		if (!name)
+			continue;
+
+		spin_lock(&zram->stat64_lock);
+		cs = zram->comp_stats[i];
+		spin_unlock(&zram->stat64_lock);
+
+		if (cs.comp_pages)
+			comp_avg = div64_u64(cs.comp_ns, cs.comp_pages);
+		if (cs.decomp_pages)
+			decomp_avg = div64_u64(cs.decomp_ns, cs.decomp_pages);
+
+		sz += scnprintf(buf + sz, PAGE_SIZE - sz,
+			"%-8s %8llu %12llu %12llu %8llu %8llu %8llu\n", name,
+			cs.comp_pages, cs.comp_pages << PAGE_SHIFT,
+			cs.compr_bytes, comp_avg, cs.decomp_pages, decomp_avg);
+	}
+
+	return sz;
+}
+
+static DEVICE_ATTR(comp_stats, S_IRUGO, comp_stats_show, NULL);
+#endif
+
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(frag_stats, S_IRUGO, frag_stats_show, NULL);
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		use_dedup_show, use_dedup_store);
+
+static struct attribute *zram_disk_attrs[] = {
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_frag_stats.attr,
+	&dev_attr_use_dedup.attr,
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle_age.attr,
+	&dev_attr_writeback.attr,
+#if defined(CONFIG_ZRAM_STATS)
+	&dev_attr_bd_stats.attr,
+#endif
+#endif
+#if defined(CONFIG_ZRAM_STATS)
+	&dev_attr_comp_stats.attr,
+	&dev_attr_dedup_stats.attr,
+#endif
+	NULL,
+};
+
+struct attribute_group zram_disk_attr_group = {
+	.attrs = zram_disk_attrs,
+};
+
+#endif	/* CONFIG_SYSFS */
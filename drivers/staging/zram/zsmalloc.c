@@ -0,0 +1,523 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are segregated by size into classes ZS_ALIGN bytes apart.
+ * Each class carves its objects out of zspages: groups of 0-order
+ * pages sized to minimize the space wasted at the end. A handle is a
+ * small slab object recording where its object lives, so objects can
+ * be moved without the caller noticing. zs_compact() uses that to
+ * migrate objects out of sparsely used zspages and free them, which
+ * returns memory that would otherwise stay lost to fragmentation.
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_ALIGN);
+
+	return idx;
+}
+
+/*
+ * Choose the no. of pages per zspage that wastes the least space
+ * for objects of the given size.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	int max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int waste = zspage_size % class_size;
+		int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+static void obj_location(struct size_class *class, struct zspage *zspage,
+			int idx, struct page **page, unsigned long *offset)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+
+	*page = zspage->pages[off >> PAGE_SHIFT];
+	*offset = off & ~PAGE_MASK;
+}
+
+static void free_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+			struct size_class *class)
+{
+	int i;
+	size_t size;
+	struct zspage *zspage;
+
+	/* zspage, handle back-references and used map in one go */
+	size = sizeof(*zspage) +
+		class->objs_per_zspage * sizeof(struct zs_handle *) +
+		BITS_TO_LONGS(class->objs_per_zspage) * sizeof(long);
+
+	zspage = kzalloc(size, pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->handles = (struct zs_handle **)(zspage + 1);
+	zspage->used_map = (unsigned long *)
+			(zspage->handles + class->objs_per_zspage);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (unlikely(!zspage->pages[i]))
+			goto fail;
+	}
+
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+/**
+ * zs_malloc - allocate object of given size from pool
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ *
+ * Returns an opaque handle to the object, or 0 on failure. Use
+ * zs_map_object() to get at the object's memory.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	int idx, class_idx;
+	struct zspage *zspage;
+	struct zs_handle *handle;
+	struct size_class *class;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(pool->handle_cachep,
+				pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class_idx = get_size_class_index(size);
+	class = &pool->size_class[class_idx];
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(pool, class);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(pool->handle_cachep, handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+		class->zspages++;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	idx = find_first_zero_bit(zspage->used_map, class->objs_per_zspage);
+	BUG_ON(idx >= class->objs_per_zspage);
+
+	__set_bit(idx, zspage->used_map);
+	zspage->handles[idx] = handle;
+	zspage->inuse++;
+	class->objs_inuse++;
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	handle->zspage = zspage;
+	handle->idx = idx;
+	handle->class_idx = class_idx;
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zspage *zspage, *free = NULL;
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+
+	if (unlikely(!handle))
+		return;
+
+	/* class_idx never changes; zspage only under class->lock */
+	class = &pool->size_class[handle->class_idx];
+
+	spin_lock(&class->lock);
+	zspage = handle->zspage;
+
+	__clear_bit(handle->idx, zspage->used_map);
+	zspage->handles[handle->idx] = NULL;
+	zspage->inuse--;
+	class->objs_inuse--;
+
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		class->zspages--;
+		free = zspage;
+	} else if (zspage->inuse == class->objs_per_zspage - 1) {
+		/* was full */
+		list_move(&zspage->list, &class->partial);
+	}
+	spin_unlock(&class->lock);
+
+	if (free)
+		free_zspage(pool, class, free);
+	kmem_cache_free(pool->handle_cachep, handle);
+}
+
+/*
+ * Copy between an object and a linear buffer. The object may cross
+ * one page boundary. Uses KM_USER1.
+ */
+static void copy_object(struct size_class *class, struct zspage *zspage,
+			int idx, char *buf, int to_obj)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+	int done = 0;
+
+	while (done < class->size) {
+		struct page *page = zspage->pages[off >> PAGE_SHIFT];
+		unsigned long offset = off & ~PAGE_MASK;
+		int len = min_t(int, class->size - done, PAGE_SIZE - offset);
+		char *vaddr = kmap_atomic(page, KM_USER1);
+
+		if (to_obj)
+			memcpy(vaddr + offset, buf + done, len);
+		else
+			memcpy(buf + done, vaddr + offset, len);
+		kunmap_atomic(vaddr, KM_USER1);
+
+		done += len;
+		off += len;
+	}
+}
+
+/**
+ * zs_map_object - get address of allocated object from handle
+ * @pool: pool the object was allocated from
+ * @obj: handle returned from zs_malloc
+ * @mm: what the caller is going to do with the object
+ *
+ * The object stays mapped, and cannot be moved by compaction, until
+ * zs_unmap_object() is called. The caller must not sleep meanwhile
+ * and may map only one object at a time. Uses KM_USER1.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct mapping_area *area;
+	struct page *page;
+	unsigned long offset;
+
+	BUG_ON(!handle);
+
+	read_lock(&pool->migrate_lock);
+	area = per_cpu_ptr(pool->area, get_cpu());
+	area->mm = mm;
+
+	class = &pool->size_class[handle->class_idx];
+	obj_location(class, handle->zspage, handle->idx, &page, &offset);
+
+	if (offset + class->size <= PAGE_SIZE) {
+		/* this object is contained entirely within a page */
+		area->vaddr = kmap_atomic(page, KM_USER1);
+		return area->vaddr + offset;
+	}
+
+	area->vaddr = NULL;
+	if (mm != ZS_MM_WO)
+		copy_object(class, handle->zspage, handle->idx, area->buf, 0);
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct mapping_area *area;
+
+	area = per_cpu_ptr(pool->area, smp_processor_id());
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		struct size_class *class;
+
+		class = &pool->size_class[handle->class_idx];
+		copy_object(class, handle->zspage, handle->idx, area->buf, 1);
+	}
+	put_cpu();
+	read_unlock(&pool->migrate_lock);
+}
+
+/*
+ * Move object at src_idx in src to a free slot in dst.
+ * Called with migrate_lock held for write and class->lock held.
+ */
+static void migrate_object(struct zs_pool *pool, struct size_class *class,
+			struct zspage *src, int src_idx, struct zspage *dst)
+{
+	struct mapping_area *area;
+	struct zs_handle *handle = src->handles[src_idx];
+	int dst_idx;
+
+	dst_idx = find_first_zero_bit(dst->used_map, class->objs_per_zspage);
+	BUG_ON(dst_idx >= class->objs_per_zspage);
+
+	/* Nobody else can be mapping: use this CPU's bounce buffer */
+	area = per_cpu_ptr(pool->area, smp_processor_id());
+	copy_object(class, src, src_idx, area->buf, 0);
+	copy_object(class, dst, dst_idx, area->buf, 1);
+
+	__clear_bit(src_idx, src->used_map);
+	src->handles[src_idx] = NULL;
+	src->inuse--;
+
+	__set_bit(dst_idx, dst->used_map);
+	dst->handles[dst_idx] = handle;
+	dst->inuse++;
+
+	handle->zspage = dst;
+	handle->idx = dst_idx;
+}
+
+/*
+ * Move objects from the emptiest partial zspage to the fullest ones
+ * as long as that empties it. Returns the zspage if it ends up empty,
+ * NULL if there is nothing (more) to gain in this class.
+ */
+static struct zspage *compact_zspage(struct zs_pool *pool,
+			struct size_class *class)
+{
+	struct zspage *zspage, *src = NULL, *dst = NULL;
+	unsigned long free_objs;
+	int idx;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+	if (!src)
+		return NULL;
+
+	/* Free slots outside src must be able to take all of src */
+	free_objs = class->zspages * class->objs_per_zspage -
+			class->objs_inuse;
+	if (free_objs - (class->objs_per_zspage - src->inuse) < src->inuse)
+		return NULL;
+
+	while (src->inuse) {
+		if (!dst) {
+			list_for_each_entry(zspage, &class->partial, list) {
+				if (zspage != src &&
+				    (!dst || zspage->inuse > dst->inuse))
+					dst = zspage;
+			}
+			BUG_ON(!dst);
+		}
+
+		idx = find_first_bit(src->used_map, class->objs_per_zspage);
+		migrate_object(pool, class, src, idx, dst);
+
+		if (dst->inuse == class->objs_per_zspage) {
+			list_move(&dst->list, &class->full);
+			dst = NULL;
+		}
+	}
+
+	list_del(&src->list);
+	class->zspages--;
+	return src;
+}
+
+/**
+ * zs_compact - free zspages by migrating objects out of them
+ * @pool: pool to compact
+ *
+ * Objects are moved from sparsely used zspages into the fullest ones
+ * of the same class. Mapped objects are never moved: each step waits
+ * for current mappings to go away. Must be called from process
+ * context. Returns the no. of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+	struct zspage *zspage;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		do {
+			write_lock(&pool->migrate_lock);
+			spin_lock(&class->lock);
+			zspage = compact_zspage(pool, class);
+			spin_unlock(&class->lock);
+			write_unlock(&pool->migrate_lock);
+
+			if (zspage) {
+				free_zspage(pool, class, zspage);
+				freed += class->pages_per_zspage;
+			}
+			cond_resched();
+		} while (zspage);
+	}
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+
+void zs_get_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	stats->obj_bytes = 0;
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		stats->obj_bytes += (u64)class->objs_inuse * class->size;
+	}
+	stats->pages_total = atomic_long_read(&pool->pages_allocated);
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+
+static void free_mapping_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->area, cpu)->buf);
+	free_percpu(pool->area);
+}
+
+/*
+ * Create a memory pool. Pages are allocated with the given flags;
+ * name is used for the handle slab cache.
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_ALIGN;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / class->size;
+		spin_lock_init(&class->lock);
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+
+	rwlock_init(&pool->migrate_lock);
+	pool->flags = flags;
+
+	pool->area = alloc_percpu(struct mapping_area);
+	if (!pool->area)
+		goto fail_pool;
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = per_cpu_ptr(pool->area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail_area;
+	}
+
+	pool->handle_cache_name = kasprintf(GFP_KERNEL, "zs_handle-%s", name);
+	if (!pool->handle_cache_name)
+		goto fail_area;
+
+	pool->handle_cachep = kmem_cache_create(pool->handle_cache_name,
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!pool->handle_cachep)
+		goto fail_name;
+
+	return pool;
+
+fail_name:
+	kfree(pool->handle_cache_name);
+fail_area:
+	free_mapping_areas(pool);
+fail_pool:
+	kfree(pool);
+	return NULL;
+}
+
+/* All objects must have been freed */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->zspages)
+			pr_info("zsmalloc: class %d: %lu zspages still "
+				"in use\n", class->size, class->zspages);
+	}
+
+	kmem_cache_destroy(pool->handle_cachep);
+	kfree(pool->handle_cache_name);
+	free_mapping_areas(pool);
+	kfree(pool);
+}
@@ -0,0 +1,94 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/* Size classes are separated by ZS_ALIGN bytes */
+#define ZS_ALIGN		16
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * A zspage is a group of up to this many 0-order pages holding objects
+ * of one size class. Objects may cross page boundaries within a zspage,
+ * which lets e.g. three 1.3K objects share one page instead of two.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* End of user params */
+
+#define ZS_SIZE_CLASSES	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+				/ ZS_ALIGN + 1)
+
+/* What a handle returned by zs_malloc() points to */
+struct zs_handle {
+	struct zspage *zspage;
+	u16 idx;		/* object index within zspage */
+	u16 class_idx;
+};
+
+struct zspage {
+	struct list_head list;		/* class->partial or class->full */
+	int inuse;			/* no. of allocated objects */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	/* Back-references so that compaction can update handles */
+	struct zs_handle **handles;
+	unsigned long *used_map;	/* bit set: object allocated */
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;
+	int size;			/* object size */
+	int pages_per_zspage;
+	int objs_per_zspage;
+
+	/* stats */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+};
+
+/* Bounce buffer for objects that cross a page boundary */
+struct mapping_area {
+	char *buf;
+	char *vaddr;		/* kmap address if not bounced */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	/*
+	 * Held for read while an object is mapped and for write while
+	 * compaction moves objects, so mapped objects never move.
+	 */
+	rwlock_t migrate_lock;
+
+	struct kmem_cache *handle_cachep;
+	char *handle_cache_name;
+	struct mapping_area __percpu *area;
+	gfp_t flags;
+
+	/* stats */
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+#endif
@@ -32,10 +32,24 @@
 
 #include <linux/usb/android_composite.h>
 
+#define BULK_REQ_LEN_MAX           131072
 #define BULK_BUFFER_SIZE           4096
 
-/* number of tx requests to allocate */
-#define TX_REQ_MAX 4
+/* default and maximum number of tx requests to allocate */
+#define TX_REQ_DEFAULT 4
+#define TX_REQ_MAX 32
+
+static unsigned int adb_tx_req_len = BULK_BUFFER_SIZE;
+module_param(adb_tx_req_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adb_tx_req_len, "bulk IN request buffer size");
+
+static unsigned int adb_rx_req_len = BULK_BUFFER_SIZE;
+module_param(adb_rx_req_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adb_rx_req_len, "bulk OUT request buffer size");
+
+static unsigned int adb_tx_reqs = TX_REQ_DEFAULT;
+module_param(adb_tx_reqs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adb_tx_reqs, "number of bulk IN requests (1-32)");
 
 static const char shortname[] = "android_adb";
 
@@ -60,6 +74,10 @@ struct adb_dev {
 	wait_queue_head_t write_wq;
 	struct usb_request *rx_req;
 	int rx_done;
+
+	/* request sizes, fixed when the function is bound */
+	unsigned int tx_req_len;
+	unsigned int rx_req_len;
 };
 
 static struct usb_interface_descriptor adb_interface_desc = {
@@ -222,6 +240,28 @@ static void adb_complete_out(struct usb_ep *ep, struct usb_request *req)
 	wake_up(&dev->read_wq);
 }
 
+/*
+ * Turn a request size from a module parameter into one we can use on
+ * 'ep': it is kept between BULK_BUFFER_SIZE and BULK_REQ_LEN_MAX, so
+ * that readers sized for the old fixed buffers still fit, and rounded
+ * down to whole packets, so that a short packet still ends an OUT
+ * transfer.
+ */
+static unsigned int adb_req_len(const char *name, unsigned int len,
+		struct usb_ep *ep, struct usb_endpoint_descriptor *hs_desc)
+{
+	unsigned int maxp = max_t(unsigned int, ep->maxpacket,
+				  le16_to_cpu(hs_desc->wMaxPacketSize));
+
+	if (len < BULK_BUFFER_SIZE) {
+		printk(KERN_WARNING "adb: %s of %u is too small, using %d\n",
+		       name, len, BULK_BUFFER_SIZE);
+		return BULK_BUFFER_SIZE;
+	}
+	len = min_t(unsigned int, len, BULK_REQ_LEN_MAX);
+	return max(len - len % maxp, maxp);
+}
+
 static int __init create_bulk_endpoints(struct adb_dev *dev,
 				struct usb_endpoint_descriptor *in_desc,
 				struct usb_endpoint_descriptor *out_desc)
@@ -229,7 +269,7 @@ static int __init create_bulk_endpoints(struct adb_dev *dev,
 	struct usb_composite_dev *cdev = dev->cdev;
 	struct usb_request *req;
 	struct usb_ep *ep;
-	int i;
+	int i, tx_reqs;
 
 	DBG(cdev, "create_bulk_endpoints dev: %p\n", dev);
 
@@ -252,16 +292,34 @@ static int __init create_bulk_endpoints(struct adb_dev *dev,
 	dev->ep_out = ep;
 
 	/* now allocate requests for our endpoints */
-	req = adb_request_new(dev->ep_out, BULK_BUFFER_SIZE);
+	dev->tx_req_len = adb_req_len("adb_tx_req_len", adb_tx_req_len,
+				     dev->ep_in, &adb_highspeed_in_desc);
+	dev->rx_req_len = adb_req_len("adb_rx_req_len", adb_rx_req_len,
+				     dev->ep_out, &adb_highspeed_out_desc);
+	tx_reqs = clamp_t(int, adb_tx_reqs, 1, TX_REQ_MAX);
+
+	req = adb_request_new(dev->ep_out, dev->rx_req_len);
+	if (!req && dev->rx_req_len > BULK_BUFFER_SIZE) {
+		/* fall back to the default size */
+		dev->rx_req_len = BULK_BUFFER_SIZE;
+		req = adb_request_new(dev->ep_out, dev->rx_req_len);
+	}
 	if (!req)
 		goto fail;
 	req->complete = adb_complete_out;
 	dev->rx_req = req;
 
-	for (i = 0; i < TX_REQ_MAX; i++) {
-		req = adb_request_new(dev->ep_in, BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+retry_tx_alloc:
+	for (i = 0; i < tx_reqs; i++) {
+		req = adb_request_new(dev->ep_in, dev->tx_req_len);
+		if (!req) {
+			if (dev->tx_req_len <= BULK_BUFFER_SIZE)
+				goto fail;
+			while ((req = req_get(dev, &dev->tx_idle)))
+				adb_request_free(req, dev->ep_in);
+			dev->tx_req_len = BULK_BUFFER_SIZE;
+			goto retry_tx_alloc;
+		}
 		req->complete = adb_complete_in;
 		req_put(dev, &dev->tx_idle, req);
 	}
@@ -284,7 +342,7 @@ static ssize_t adb_read(struct file *fp, char __user *buf,
 
 	DBG(cdev, "adb_read(%d)\n", count);
 
-	if (count > BULK_BUFFER_SIZE)
+	if (count > dev->rx_req_len)
 		return -EINVAL;
 
 	if (_lock(&dev->read_excl))
@@ -377,8 +435,8 @@ static ssize_t adb_write(struct file *fp, const char __user *buf,
 		}
 
 		if (req != 0) {
-			if (count > BULK_BUFFER_SIZE)
-				xfer = BULK_BUFFER_SIZE;
+			if (count > dev->tx_req_len)
+				xfer = dev->tx_req_len;
 			else
 				xfer = count;
 			if (copy_from_user(req->buf, buf, xfer)) {
@@ -37,6 +37,7 @@
 #include <linux/usb/android_composite.h>
 #include <linux/usb/f_mtp.h>
 
+#define BULK_REQ_LEN_MAX           131072
 #define BULK_BUFFER_SIZE           16384
 #define INTR_BUFFER_SIZE           28
 
@@ -50,9 +51,27 @@
 #define STATE_CANCELED              3   /* transaction canceled by host */
 #define STATE_ERROR                 4   /* error from completion routine */
 
-/* number of tx and rx requests to allocate */
-#define TX_REQ_MAX 4
-#define RX_REQ_MAX 2
+/* default and maximum number of tx and rx requests to allocate */
+#define TX_REQ_DEFAULT 4
+#define TX_REQ_MAX 32
+#define RX_REQ_DEFAULT 2
+#define RX_REQ_MAX 8
+
+static unsigned int mtp_tx_req_len = BULK_BUFFER_SIZE;
+module_param(mtp_tx_req_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_tx_req_len, "bulk IN request buffer size");
+
+static unsigned int mtp_rx_req_len = BULK_BUFFER_SIZE;
+module_param(mtp_rx_req_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_rx_req_len, "bulk OUT request buffer size");
+
+static unsigned int mtp_tx_reqs = TX_REQ_DEFAULT;
+module_param(mtp_tx_reqs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_tx_reqs, "number of bulk IN requests (1-32)");
+
+static unsigned int mtp_rx_reqs = RX_REQ_DEFAULT;
+module_param(mtp_rx_reqs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_rx_reqs, "number of bulk OUT requests (2-8)");
 
 /* ID for Microsoft MTP OS String */
 #define MTP_OS_STRING_ID   0xEE
@@ -94,7 +113,13 @@ struct mtp_dev {
 	wait_queue_head_t write_wq;
 	struct usb_request *rx_req[RX_REQ_MAX];
 	struct usb_request *intr_req;
-	int rx_done;
+	/* number of rx requests completed since the counter was reset */
+	unsigned int rx_done;
+
+	/* request sizes and rx depth, fixed when the function is bound */
+	unsigned int tx_req_len;
+	unsigned int rx_req_len;
+	int rx_reqs;
 	/* true if interrupt endpoint is busy */
 	int intr_busy;
 
@@ -361,7 +386,8 @@ static void mtp_complete_out(struct usb_ep *ep, struct usb_request *req)
 {
 	struct mtp_dev *dev = _mtp_dev;
 
-	dev->rx_done = 1;
+	/* OUT requests complete in the order they were queued */
+	dev->rx_done++;
 	if (req->status != 0)
 		dev->state = STATE_ERROR;
 
@@ -379,6 +405,28 @@ static void mtp_complete_intr(struct usb_ep *ep, struct usb_request *req)
 		dev->state = STATE_ERROR;
 }
 
+/*
+ * Turn a request size from a module parameter into one we can use on
+ * 'ep': it is kept between BULK_BUFFER_SIZE and BULK_REQ_LEN_MAX, so
+ * that readers sized for the old fixed buffers still fit, and rounded
+ * down to whole packets, so that a short packet still ends an OUT
+ * transfer.
+ */
+static unsigned int mtp_req_len(const char *name, unsigned int len,
+		struct usb_ep *ep, struct usb_endpoint_descriptor *hs_desc)
+{
+	unsigned int maxp = max_t(unsigned int, ep->maxpacket,
+				  le16_to_cpu(hs_desc->wMaxPacketSize));
+
+	if (len < BULK_BUFFER_SIZE) {
+		printk(KERN_WARNING "mtp: %s of %u is too small, using %d\n",
+		       name, len, BULK_BUFFER_SIZE);
+		return BULK_BUFFER_SIZE;
+	}
+	len = min_t(unsigned int, len, BULK_REQ_LEN_MAX);
+	return max(len - len % maxp, maxp);
+}
+
 static int __init create_bulk_endpoints(struct mtp_dev *dev,
 				struct usb_endpoint_descriptor *in_desc,
 				struct usb_endpoint_descriptor *out_desc,
@@ -387,7 +435,7 @@ static int __init create_bulk_endpoints(struct mtp_dev *dev,
 	struct usb_composite_dev *cdev = dev->cdev;
 	struct usb_request *req;
 	struct usb_ep *ep;
-	int i;
+	int i, tx_reqs;
 
 	DBG(cdev, "create_bulk_endpoints dev: %p\n", dev);
 
@@ -428,17 +476,40 @@ static int __init create_bulk_endpoints(struct mtp_dev *dev,
 	dev->ep_intr = ep;
 
 	/* now allocate requests for our endpoints */
-	for (i = 0; i < TX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_in, BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+	dev->tx_req_len = mtp_req_len("mtp_tx_req_len", mtp_tx_req_len,
+				     dev->ep_in, &mtp_highspeed_in_desc);
+	dev->rx_req_len = mtp_req_len("mtp_rx_req_len", mtp_rx_req_len,
+				     dev->ep_out, &mtp_highspeed_out_desc);
+	tx_reqs = clamp_t(int, mtp_tx_reqs, 1, TX_REQ_MAX);
+	dev->rx_reqs = clamp_t(int, mtp_rx_reqs, 2, RX_REQ_MAX);
+retry_tx_alloc:
+	for (i = 0; i < tx_reqs; i++) {
+		req = mtp_request_new(dev->ep_in, dev->tx_req_len);
+		if (!req) {
+			if (dev->tx_req_len <= BULK_BUFFER_SIZE)
+				goto fail;
+			/* fall back to the default size */
+			while ((req = req_get(dev, &dev->tx_idle)))
+				mtp_request_free(req, dev->ep_in);
+			dev->tx_req_len = BULK_BUFFER_SIZE;
+			goto retry_tx_alloc;
+		}
 		req->complete = mtp_complete_in;
 		req_put(dev, &dev->tx_idle, req);
 	}
-	for (i = 0; i < RX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_out, BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+retry_rx_alloc:
+	for (i = 0; i < dev->rx_reqs; i++) {
+		req = mtp_request_new(dev->ep_out, dev->rx_req_len);
+		if (!req) {
+			if (dev->rx_req_len <= BULK_BUFFER_SIZE)
+				goto fail;
+			while (--i >= 0) {
+				mtp_request_free(dev->rx_req[i], dev->ep_out);
+				dev->rx_req[i] = NULL;
+			}
+			dev->rx_req_len = BULK_BUFFER_SIZE;
+			goto retry_rx_alloc;
+		}
 		req->complete = mtp_complete_out;
 		dev->rx_req[i] = req;
 	}
@@ -466,7 +537,7 @@ static ssize_t mtp_read(struct file *fp, char __user *buf,
 
 	DBG(cdev, "mtp_read(%d)\n", count);
 
-	if (count > BULK_BUFFER_SIZE)
+	if (count > dev->rx_req_len)
 		return -EINVAL;
 
 	spin_lock_irq(&dev->lock);
@@ -582,8 +653,8 @@ static ssize_t mtp_write(struct file *fp, const char __user *buf,
 			break;
 		}
 
-		if (count > BULK_BUFFER_SIZE)
-			xfer = BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 		if (xfer && copy_from_user(req->buf, buf, xfer)) {
@@ -666,8 +737,8 @@ static void send_file_work(struct work_struct *data) {
 			break;
 		}
 
-		if (count > BULK_BUFFER_SIZE)
-			xfer = BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 		ret = vfs_read(filp, req->buf, xfer, &offset);
@@ -706,11 +777,12 @@ static void receive_file_work(struct work_struct *data)
 {
 	struct mtp_dev	*dev = container_of(data, struct mtp_dev, receive_file_work);
 	struct usb_composite_dev *cdev = dev->cdev;
-	struct usb_request *read_req = NULL, *write_req = NULL;
+	struct usb_request *req;
 	struct file *filp;
 	loff_t offset;
-	int64_t count;
-	int ret, cur_buf = 0;
+	int64_t count, to_queue;
+	int ret, head = 0, queued = 0, depth, eof = 0;
+	unsigned int reaped = 0;
 	int r = 0;
 
 	/* read our parameters */
@@ -721,62 +793,86 @@ static void receive_file_work(struct work_struct *data)
 
 	DBG(cdev, "receive_file_work(%lld)\n", count);
 
-	while (count > 0 || write_req) {
-		if (count > 0) {
-			/* queue a request */
-			read_req = dev->rx_req[cur_buf];
-			cur_buf = (cur_buf + 1) % RX_REQ_MAX;
+	/* if xfer_file_length is 0xFFFFFFFF, then we read until we get a
+	 * short packet, so we must never have a request queued past it.
+	 * Otherwise keep all of our requests queued, so the host can fill
+	 * the next buffers while we are writing out the oldest one.
+	 */
+	depth = (count == 0xFFFFFFFF) ? 1 : dev->rx_reqs;
+	to_queue = count;
+	dev->rx_done = 0;
 
-			read_req->length = (count > BULK_BUFFER_SIZE
-					? BULK_BUFFER_SIZE : count);
-			dev->rx_done = 0;
-			ret = usb_ep_queue(dev->ep_out, read_req, GFP_KERNEL);
+	while (to_queue > 0 || queued) {
+		while (to_queue > 0 && queued < depth) {
+			/* queue a request */
+			req = dev->rx_req[(head + queued) % dev->rx_reqs];
+			req->length = (to_queue > dev->rx_req_len
+					? dev->rx_req_len : to_queue);
+			ret = usb_ep_queue(dev->ep_out, req, GFP_KERNEL);
 			if (ret < 0) {
 				r = -EIO;
 				dev->state = STATE_ERROR;
-				break;
+				goto out;
 			}
+			if (count != 0xFFFFFFFF)
+				to_queue -= req->length;
+			queued++;
 		}
 
-		if (write_req) {
-			DBG(cdev, "rx %p %d\n", write_req, write_req->actual);
-			ret = vfs_write(filp, write_req->buf, write_req->actual,
-				&offset);
-			DBG(cdev, "vfs_write %d\n", ret);
-			if (ret != write_req->actual) {
-				r = -EIO;
-				dev->state = STATE_ERROR;
-				break;
-			}
-			write_req = NULL;
+		/* wait for the oldest read to complete */
+		req = dev->rx_req[head];
+		ret = wait_event_interruptible(dev->read_wq,
+			dev->rx_done != reaped || dev->state != STATE_BUSY);
+		if (dev->state == STATE_CANCELED) {
+			r = -ECANCELED;
+			goto out;
 		}
-
-		if (read_req) {
-			/* wait for our last read to complete */
-			ret = wait_event_interruptible(dev->read_wq,
-				dev->rx_done || dev->state != STATE_BUSY);
-			if (dev->state == STATE_CANCELED) {
-				r = -ECANCELED;
-				if (!dev->rx_done)
-					usb_ep_dequeue(dev->ep_out, read_req);
-				break;
-			}
-			/* if xfer_file_length is 0xFFFFFFFF, then we read until
-			 * we get a zero length packet
+		if (dev->state != STATE_BUSY) {
+			r = -EIO;
+			goto out;
+		}
+		if (ret < 0) {
+			r = ret;
+			goto out;
+		}
+		reaped++;
+		head = (head + 1) % dev->rx_reqs;
+		queued--;
+
+		if (req->actual < req->length) {
+			/* short packet is used to signal EOF for sizes > 4 gig */
+			DBG(cdev, "got short packet\n");
+			to_queue = 0;
+			eof = 1;
+			/* the host ended the transfer early: take back
+			 * anything still queued before we block in the
+			 * filesystem, so it can't swallow the next command
 			 */
-			if (count != 0xFFFFFFFF)
-				count -= read_req->actual;
-			if (read_req->actual < read_req->length) {
-				/* short packet is used to signal EOF for sizes > 4 gig */
-				DBG(cdev, "got short packet\n");
-				count = 0;
+			while (queued > 0) {
+				queued--;
+				usb_ep_dequeue(dev->ep_out,
+					dev->rx_req[(head + queued) % dev->rx_reqs]);
 			}
+		}
 
-			write_req = read_req;
-			read_req = NULL;
+		DBG(cdev, "rx %p %d\n", req, req->actual);
+		ret = vfs_write(filp, req->buf, req->actual, &offset);
+		DBG(cdev, "vfs_write %d\n", ret);
+		if (ret != req->actual) {
+			r = -EIO;
+			dev->state = STATE_ERROR;
+			goto out;
 		}
+		if (eof)
+			break;
 	}
 
+out:
+	/* take back anything still queued, newest first */
+	while (queued-- > 0)
+		usb_ep_dequeue(dev->ep_out,
+			dev->rx_req[(head + queued) % dev->rx_reqs]);
+
 	DBG(cdev, "receive_file_work returning %d\n", r);
 	/* write the result */
 	dev->xfer_result = r;
@@ -1012,7 +1108,7 @@ mtp_function_unbind(struct usb_configuration *c, struct usb_function *f)
 	spin_lock_irq(&dev->lock);
 	while ((req = req_get(dev, &dev->tx_idle)))
 		mtp_request_free(req, dev->ep_in);
-	for (i = 0; i < RX_REQ_MAX; i++)
+	for (i = 0; i < dev->rx_reqs; i++)
 		mtp_request_free(dev->rx_req[i], dev->ep_out);
 	mtp_request_free(dev->intr_req, dev->ep_intr);
 	dev->state = STATE_OFFLINE;
@@ -22,11 +22,15 @@
 
 #include <linux/device.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/slab.h>
 #include <linux/err.h>
+#include <linux/workqueue.h>
 
 #include <mach/nvmap.h>
 #include "nvmap.h"
@@ -68,9 +72,20 @@
  * and to ensure that the minimum free block size in the carveout (i.e., the
  * "small" threshold) is still a meaningful size.
  *
+ * free blocks are indexed by an rbtree sorted by address, where each node
+ * also caches the largest free block in its subtree. first-fit and last-fit
+ * searches skip whole subtrees that are too small for the request, so both
+ * run in O(log n) for the common case; freed blocks are coalesced with their
+ * neighbours in the (address ordered) all_list without searching.
  */
 
 #define MAX_BUDDY_NR	128	/* maximum buddies in a buddy allocator */
+#define MAX_BUDDY_ORDER	7	/* log2(MAX_BUDDY_NR) */
+
+/* background compaction defaults; both are tunable per heap in sysfs */
+#define COMPACT_THRESHOLD	500	/* fragmentation, in permille */
+#define COMPACT_BATCH		4	/* blocks relocated per pass */
+#define COMPACT_INTERVAL	(HZ / 10)	/* delay between passes */
 
 enum direction {
 	TOP_DOWN,
@@ -111,7 +126,8 @@ struct list_block {
 	size_t size;
 	size_t align;
 	struct nvmap_heap *heap;
-	struct list_head free_list;
+	struct rb_node free_node;
+	size_t free_max;	/* largest free block in this free_node subtree */
 };
 
 struct combo_block {
@@ -131,11 +147,13 @@ struct buddy_heap {
 	unsigned int nr_buddies;
 	struct list_head buddy_list;
 	struct buddy_bits bitmap[MAX_BUDDY_NR];
+	unsigned int nr_free[MAX_BUDDY_ORDER + 1];	/* free buddies by order */
 };
 
 struct nvmap_heap {
 	struct list_head all_list;
-	struct list_head free_list;
+	struct rb_root free_blocks;	/* free list_blocks, by address */
+	size_t free_size;		/* total size of free_blocks */
 	struct mutex lock;
 	struct list_head buddy_list;
 	unsigned int min_buddy_shift;
@@ -144,6 +162,17 @@ struct nvmap_heap {
 	const char *name;
 	void *arg;
 	struct device dev;
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	struct delayed_work compact_work;
+	unsigned int compact_threshold;
+	unsigned int compact_batch;
+	/* compaction cost, protected by lock */
+	unsigned int compact_passes;	/* background passes run */
+	unsigned int compact_moved;	/* blocks relocated */
+	u64 compact_bytes;		/* bytes copied by relocation */
+	u64 compact_us;			/* time spent in background passes */
+	u64 compact_stall_us;		/* time allocations spent compacting */
+#endif
 };
 
 static struct kmem_cache *buddy_heap_cache;
@@ -190,6 +219,7 @@ static unsigned long heap_stat(struct nvmap_heap *heap, struct heap_stat *stat)
 {
 	struct buddy_heap *bh;
 	struct list_block *l = NULL;
+	struct rb_node *n;
 	unsigned long base = -1ul;
 
 	memset(stat, 0, sizeof(*stat));
@@ -210,7 +240,8 @@ static unsigned long heap_stat(struct nvmap_heap *heap, struct heap_stat *stat)
 		stat->count--;
 	}
 
-	list_for_each_entry(l, &heap->free_list, free_list) {
+	for (n = rb_first(&heap->free_blocks); n; n = rb_next(n)) {
+		l = rb_entry(n, struct list_block, free_node);
 		stat->free += l->size;
 		stat->free_count++;
 		stat->free_largest = max(l->size, stat->free_largest);
@@ -250,6 +281,41 @@ static struct device_attribute heap_stat_base =
 static struct device_attribute heap_attr_name =
 	__ATTR(name, S_IRUGO, heap_name_show, NULL);
 
+static ssize_t heap_compact_show(struct device *dev,
+				 struct device_attribute *attr, char *buf);
+
+static struct device_attribute heap_stat_frag_ratio =
+	__ATTR(frag_ratio, S_IRUGO, heap_compact_show, NULL);
+
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+static ssize_t heap_compact_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count);
+
+static struct device_attribute heap_compact_threshold =
+	__ATTR(compact_threshold, S_IRUGO | S_IWUSR, heap_compact_show,
+	       heap_compact_store);
+
+static struct device_attribute heap_compact_batch =
+	__ATTR(compact_batch, S_IRUGO | S_IWUSR, heap_compact_show,
+	       heap_compact_store);
+
+static struct device_attribute heap_compact_passes =
+	__ATTR(compact_passes, S_IRUGO, heap_compact_show, NULL);
+
+static struct device_attribute heap_compact_moved =
+	__ATTR(compact_moved, S_IRUGO, heap_compact_show, NULL);
+
+static struct device_attribute heap_compact_bytes =
+	__ATTR(compact_bytes, S_IRUGO, heap_compact_show, NULL);
+
+static struct device_attribute heap_compact_us =
+	__ATTR(compact_us, S_IRUGO, heap_compact_show, NULL);
+
+static struct device_attribute heap_compact_stall_us =
+	__ATTR(compact_stall_us, S_IRUGO, heap_compact_show, NULL);
+#endif
+
 static struct attribute *heap_stat_attrs[] = {
 	&heap_stat_total_max.attr,
 	&heap_stat_total_count.attr,
@@ -259,6 +325,16 @@ static struct attribute *heap_stat_attrs[] = {
 	&heap_stat_free_size.attr,
 	&heap_stat_base.attr,
 	&heap_attr_name.attr,
+	&heap_stat_frag_ratio.attr,
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	&heap_compact_threshold.attr,
+	&heap_compact_batch.attr,
+	&heap_compact_passes.attr,
+	&heap_compact_moved.attr,
+	&heap_compact_bytes.attr,
+	&heap_compact_us.attr,
+	&heap_compact_stall_us.attr,
+#endif
 	NULL,
 };
 
@@ -300,7 +376,183 @@ static ssize_t heap_stat_show(struct device *dev,
 	else
 		return -EINVAL;
 }
+
+static inline struct list_block *free_entry(struct rb_node *n)
+{
+	return rb_entry(n, struct list_block, free_node);
+}
+
+static inline size_t free_max_of(struct rb_node *n)
+{
+	return n ? free_entry(n)->free_max : 0;
+}
+
+static void free_max_update(struct rb_node *n, void *unused)
+{
+	struct list_block *b = free_entry(n);
+
+	b->free_max = max(b->size, max(free_max_of(n->rb_left),
+				       free_max_of(n->rb_right)));
+}
+
+static void free_insert(struct nvmap_heap *heap, struct list_block *b)
+{
+	struct rb_node **p = &heap->free_blocks.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (b->block.base < free_entry(parent)->block.base)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	b->free_max = b->size;
+	heap->free_size += b->size;
+	rb_link_node(&b->free_node, parent, p);
+	rb_insert_color(&b->free_node, &heap->free_blocks);
+	rb_augment_insert(&b->free_node, free_max_update, NULL);
+}
+
+static void free_erase(struct nvmap_heap *heap, struct list_block *b)
+{
+	struct rb_node *deepest = rb_augment_erase_begin(&b->free_node);
+
+	heap->free_size -= b->size;
+	rb_erase(&b->free_node, &heap->free_blocks);
+	rb_augment_erase_end(deepest, free_max_update, NULL);
+}
+
+/* b (still in the tree) changed size; fix the cached maxima above it */
+static void free_resized(struct list_block *b)
+{
+	struct rb_node *n;
+
+	for (n = &b->free_node; n; n = rb_parent(n))
+		free_max_update(n, NULL);
+}
+
+/* lowest (dir == BOTTOM_UP) or highest (TOP_DOWN) addressed free block
+ * of at least len bytes in the subtree n */
+static struct list_block *free_first(struct rb_node *n, size_t len,
+				     enum direction dir)
+{
+	while (n) {
+		struct rb_node *near = (dir == BOTTOM_UP) ? n->rb_left : n->rb_right;
+		struct rb_node *far = (dir == BOTTOM_UP) ? n->rb_right : n->rb_left;
+
+		if (near && free_max_of(near) >= len)
+			n = near;
+		else if (free_entry(n)->size >= len)
+			return free_entry(n);
+		else if (far && free_max_of(far) >= len)
+			n = far;
+		else
+			break;
+	}
+	return NULL;
+}
+
+/* next free block of at least len bytes after b, in direction dir */
+static struct list_block *free_next(struct list_block *b, size_t len,
+				    enum direction dir)
+{
+	struct rb_node *n = &b->free_node;
+	struct rb_node *parent;
+	struct rb_node *far = (dir == BOTTOM_UP) ? n->rb_right : n->rb_left;
+
+	if (far && free_max_of(far) >= len)
+		return free_first(far, len, dir);
+
+	while ((parent = rb_parent(n)) != NULL) {
+		struct rb_node *near = (dir == BOTTOM_UP) ?
+			parent->rb_left : parent->rb_right;
+
+		if (n == near) {
+			far = (dir == BOTTOM_UP) ? parent->rb_right : parent->rb_left;
+			if (free_entry(parent)->size >= len)
+				return free_entry(parent);
+			if (far && free_max_of(far) >= len)
+				return free_first(far, len, dir);
+		}
+		n = parent;
+	}
+	return NULL;
+}
+
+/* permille of the free list space outside the largest free block; must be
+ * called while holding the heap's lock */
+static unsigned int heap_fragmentation(struct nvmap_heap *heap)
+{
+	size_t free_max = free_max_of(heap->free_blocks.rb_node);
+
+	if (!heap->free_size)
+		return 0;
+	return 1000 - (unsigned int)div_u64((u64)free_max * 1000,
+					    heap->free_size);
+}
+
+static ssize_t heap_compact_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct nvmap_heap *heap = container_of(dev, struct nvmap_heap, dev);
+	ssize_t ret = -EINVAL;
+
+	mutex_lock(&heap->lock);
+	if (attr == &heap_stat_frag_ratio)
+		ret = sprintf(buf, "%u\n", heap_fragmentation(heap));
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	else if (attr == &heap_compact_threshold)
+		ret = sprintf(buf, "%u\n", heap->compact_threshold);
+	else if (attr == &heap_compact_batch)
+		ret = sprintf(buf, "%u\n", heap->compact_batch);
+	else if (attr == &heap_compact_passes)
+		ret = sprintf(buf, "%u\n", heap->compact_passes);
+	else if (attr == &heap_compact_moved)
+		ret = sprintf(buf, "%u\n", heap->compact_moved);
+	else if (attr == &heap_compact_bytes)
+		ret = sprintf(buf, "%llu\n", heap->compact_bytes);
+	else if (attr == &heap_compact_us)
+		ret = sprintf(buf, "%llu\n", heap->compact_us);
+	else if (attr == &heap_compact_stall_us)
+		ret = sprintf(buf, "%llu\n", heap->compact_stall_us);
+#endif
+	mutex_unlock(&heap->lock);
+	return ret;
+}
+
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+static ssize_t heap_compact_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct nvmap_heap *heap = container_of(dev, struct nvmap_heap, dev);
+	unsigned long val;
+
+	if (strict_strtoul(buf, 10, &val))
+		return -EINVAL;
+
+	mutex_lock(&heap->lock);
+	if (attr == &heap_compact_threshold)
+		heap->compact_threshold = min(val, 1000ul);
+	else if (attr == &heap_compact_batch)
+		heap->compact_batch = max(val, 1ul);
+	mutex_unlock(&heap->lock);
+	return count;
+}
+#endif
+
 #ifndef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+/* true if the buddy heap has any free buddy of at least order */
+static inline bool buddy_has_free(struct buddy_heap *heap, unsigned int order)
+{
+	for (; order <= MAX_BUDDY_ORDER; order++)
+		if (heap->nr_free[order])
+			return true;
+	return false;
+}
+
 static struct nvmap_heap_block *buddy_alloc(struct buddy_heap *heap,
 					    size_t size, size_t align,
 					    unsigned int mem_prot)
@@ -315,6 +567,9 @@ static struct nvmap_heap_block *buddy_alloc(struct buddy_heap *heap,
 	if (heap->heap_base->mem_prot != mem_prot)
 		return NULL;
 
+	if (!buddy_has_free(heap, order))
+		return NULL;
+
 	align = max(align, (size_t)(1 << min_shift));
 	align_mask = (align >> min_shift) - 1;
 
@@ -340,12 +595,14 @@ static struct nvmap_heap_block *buddy_alloc(struct buddy_heap *heap,
 	if (!b)
 		return NULL;
 
+	heap->nr_free[heap->bitmap[best].order]--;
 	while (heap->bitmap[best].order != order) {
 		unsigned int buddy;
 		heap->bitmap[best].order--;
 		buddy = best ^ (1 << heap->bitmap[best].order);
 		heap->bitmap[buddy].order = heap->bitmap[best].order;
 		heap->bitmap[buddy].alloc = 0;
+		heap->nr_free[heap->bitmap[buddy].order]++;
 	}
 	heap->bitmap[best].alloc = 1;
 	b->block.base = heap->heap_base->block.base + (best << min_shift);
@@ -364,6 +621,7 @@ static struct buddy_heap *do_buddy_free(struct nvmap_heap_block *block)
 
 	index = (block->base - h->heap_base->block.base) >> min_shift;
 	h->bitmap[index].alloc = 0;
+	h->nr_free[h->bitmap[index].order]++;
 
 	for (;;) {
 		unsigned int buddy = index ^ (1 << h->bitmap[index].order);
@@ -371,6 +629,8 @@ static struct buddy_heap *do_buddy_free(struct nvmap_heap_block *block)
 		    h->bitmap[buddy].order != h->bitmap[index].order)
 			break;
 
+		h->nr_free[h->bitmap[index].order] -= 2;
+		h->nr_free[h->bitmap[index].order + 1]++;
 		h->bitmap[buddy].order++;
 		h->bitmap[index].order++;
 		index = min(buddy, index);
@@ -416,32 +676,28 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 	dir = (len <= heap->small_alloc) ? BOTTOM_UP : TOP_DOWN;
 #endif
 
-	if (dir == BOTTOM_UP) {
-		list_for_each_entry(i, &heap->free_list, free_list) {
-			size_t fix_size;
+	/* only blocks of at least len bytes are visited; alignment may
+	 * still rule some of them out */
+	for (i = free_first(heap->free_blocks.rb_node, len, dir); i;
+	     i = free_next(i, len, dir)) {
+		if (dir == BOTTOM_UP) {
 			fix_base = ALIGN(i->block.base, align);
-			fix_size = i->size - (fix_base - i->block.base);
 
 			/* needed for compaction. relocated chunk
 			 * should never go up */
-			if (base_max && fix_base > base_max) {
+			if (base_max && fix_base > base_max)
 				break;
-			}
 
-			if (fix_size >= len) {
+			if (fix_base + len <= i->block.base + i->size) {
 				b = i;
 				break;
 			}
-		}
-	} else {
-		list_for_each_entry_reverse(i, &heap->free_list, free_list) {
-			if (i->size >= len) {
-				fix_base = i->block.base + i->size - len;
-				fix_base &= ~(align-1);
-				if (fix_base >= i->block.base) {
-					b = i;
-					break;
-				}
+		} else {
+			fix_base = i->block.base + i->size - len;
+			fix_base &= ~(align-1);
+			if (fix_base >= i->block.base) {
+				b = i;
+				break;
 			}
 		}
 	}
@@ -449,8 +705,10 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 	if (!b)
 		return NULL;
 
-	if (dir == BOTTOM_UP)
-		b->block.type = BLOCK_FIRST_FIT;
+	free_erase(heap, b);
+	/* anything not BLOCK_EMPTY is allocated; do_heap_free relies on it
+	 * to find free neighbours */
+	b->block.type = BLOCK_FIRST_FIT;
 
 	/* split free block */
 	if (b->block.base != fix_base) {
@@ -471,7 +729,7 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		b->orig_addr = fix_base;
 		b->size -= rem->size;
 		list_add_tail(&rem->all_list,  &b->all_list);
-		list_add_tail(&rem->free_list, &b->free_list);
+		free_insert(heap, rem);
 	}
 
 	b->orig_addr = b->block.base;
@@ -489,11 +747,10 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		rem->orig_addr = rem->block.base;
 		b->size = len;
 		list_add(&rem->all_list,  &b->all_list);
-		list_add(&rem->free_list, &b->free_list);
+		free_insert(heap, rem);
 	}
 
 out:
-	list_del(&b->free_list);
 	b->heap = heap;
 	b->mem_prot = mem_prot;
 	b->align = align;
@@ -506,10 +763,12 @@ static void freelist_debug(struct nvmap_heap *heap, const char *title,
 {
 	int i;
 	struct list_block *n;
+	struct rb_node *node;
 
 	dev_debug(&heap->dev, "%s\n", title);
 	i = 0;
-	list_for_each_entry(n, &heap->free_list, free_list) {
+	for (node = rb_first(&heap->free_blocks); node; node = rb_next(node)) {
+		n = free_entry(node);
 		dev_debug(&heap->dev,"\t%d [%p..%p]%s\n", i, (void *)n->orig_addr,
 			  (void *)(n->orig_addr + n->size),
 			  (n == token) ? "<--" : "");
@@ -532,25 +791,16 @@ static struct list_block *do_heap_free(struct nvmap_heap_block *block)
 
 	freelist_debug(heap, "free list before", b);
 
-	/* Find position of first free block to the right of freed one */
-	list_for_each_entry(n, &heap->free_list, free_list) {
-		if (n->block.base > b->block.base)
-			break;
-	}
-
-	/* Add freed block before found free one */
-	list_add_tail(&b->free_list, &n->free_list);
 	BUG_ON(list_empty(&b->all_list));
 
-	freelist_debug(heap, "free list pre-merge", b);
-
 	/* merge freed block with next if they connect
 	 * freed block becomes bigger, next one is destroyed */
-	if (!list_is_last(&b->free_list, &heap->free_list)) {
-		n = list_first_entry(&b->free_list, struct list_block, free_list);
-		if (n->block.base == b->block.base + b->size) {
+	if (b->all_list.next != &heap->all_list) {
+		n = list_entry(b->all_list.next, struct list_block, all_list);
+		if (n->block.type == BLOCK_EMPTY &&
+		    n->block.base == b->block.base + b->size) {
+			free_erase(heap, n);
 			list_del(&n->all_list);
-			list_del(&n->free_list);
 			BUG_ON(b->orig_addr >= n->orig_addr);
 			b->size += n->size;
 			kmem_cache_free(block_cache, n);
@@ -559,20 +809,24 @@ static struct list_block *do_heap_free(struct nvmap_heap_block *block)
 
 	/* merge freed block with prev if they connect
 	 * previous free block becomes bigger, freed one is destroyed */
-	if (b->free_list.prev != &heap->free_list) {
-		n = list_entry(b->free_list.prev, struct list_block, free_list);
-		if (n->block.base + n->size == b->block.base) {
+	if (b->all_list.prev != &heap->all_list) {
+		n = list_entry(b->all_list.prev, struct list_block, all_list);
+		if (n->block.type == BLOCK_EMPTY &&
+		    n->block.base + n->size == b->block.base) {
 			list_del(&b->all_list);
-			list_del(&b->free_list);
 			BUG_ON(n->orig_addr >= b->orig_addr);
 			n->size += b->size;
+			heap->free_size += b->size;
+			free_resized(n);
 			kmem_cache_free(block_cache, b);
-			b = n;
+			freelist_debug(heap, "free list after", n);
+			return n;
 		}
 	}
 
-	freelist_debug(heap, "free list after", b);
 	b->block.type = BLOCK_EMPTY;
+	free_insert(heap, b);
+	freelist_debug(heap, "free list after", b);
 	return b;
 }
 
@@ -608,6 +862,7 @@ static struct nvmap_heap_block *do_buddy_alloc(struct nvmap_heap *h,
 	bh->nr_buddies = h->buddy_heap_size >> h->min_buddy_shift;
 	bh->bitmap[0].alloc = 0;
 	bh->bitmap[0].order = order_of(h->buddy_heap_size, h->min_buddy_shift);
+	bh->nr_free[bh->bitmap[0].order] = 1;
 	list_add_tail(&bh->buddy_list, &h->buddy_list);
 	return buddy_alloc(bh, len, align, mem_prot);
 }
@@ -684,8 +939,11 @@ fail:
 }
 
 
+/* with nowait set, a block whose handle is busy is skipped rather than
+ * waited for; the background compactor must not block other nvmap users
+ * while it holds the heap lock. */
 static struct nvmap_heap_block *do_heap_relocate_listblock(
-		struct list_block *block, bool fast)
+		struct list_block *block, bool fast, bool nowait)
 {
 	struct nvmap_heap_block *heap_block = &block->block;
 	struct nvmap_heap_block *heap_block_new = NULL;
@@ -704,7 +962,10 @@ static struct nvmap_heap_block *do_heap_relocate_listblock(
 		return NULL;
 	}
 
-	mutex_lock(&handle->lock);
+	if (!nowait)
+		mutex_lock(&handle->lock);
+	else if (!mutex_trylock(&handle->lock))
+		return NULL;
 
 	share = nvmap_get_share_from_dev(handle->dev);
 
@@ -712,7 +973,12 @@ static struct nvmap_heap_block *do_heap_relocate_listblock(
 	 * pin_lock, but then we'll need to lock every handle during
 	 * each pinning operation. Need to estimate performance impact
 	 * if we decide to simplify locking this way. */
-	mutex_lock(&share->pin_lock);
+	if (!nowait)
+		mutex_lock(&share->pin_lock);
+	else if (!mutex_trylock(&share->pin_lock)) {
+		mutex_unlock(&handle->lock);
+		return NULL;
+	}
 
 	/* abort if block is pinned */
 	if (atomic_read(&handle->pin))
@@ -753,14 +1019,20 @@ static struct nvmap_heap_block *do_heap_relocate_listblock(
 				dst_base, src_base, src_size);
 	BUG_ON(error);
 
+	heap->compact_moved++;
+	heap->compact_bytes += src_size;
+
 fail:
 	mutex_unlock(&share->pin_lock);
 	mutex_unlock(&handle->lock);
 	return heap_block_new;
 }
 
-static void nvmap_heap_compact(struct nvmap_heap *heap,
-				size_t requested_size, bool fast)
+/* relocates blocks towards the bottom of the heap, at most max_moves of
+ * them unless max_moves is 0; returns the number of blocks relocated. */
+static int nvmap_heap_compact(struct nvmap_heap *heap,
+				size_t requested_size, bool fast,
+				unsigned int max_moves, bool nowait)
 {
 	struct list_block *block_current = NULL;
 	struct list_block *block_prev = NULL;
@@ -772,7 +1044,8 @@ static void nvmap_heap_compact(struct nvmap_heap *heap,
 	ptr = heap->all_list.next;
 
 	/* walk through all blocks */
-	while (ptr != &heap->all_list) {
+	while (ptr != &heap->all_list &&
+	       (!max_moves || relocation_count < max_moves)) {
 		block_current = list_entry(ptr, struct list_block, all_list);
 
 		ptr_prev = ptr->prev;
@@ -783,7 +1056,8 @@ static void nvmap_heap_compact(struct nvmap_heap *heap,
 			continue;
 		}
 
-		if (fast && block_current->size >= requested_size)
+		if (fast && requested_size &&
+		    block_current->size >= requested_size)
 			break;
 
 		/* relocate prev block */
@@ -794,7 +1068,8 @@ static void nvmap_heap_compact(struct nvmap_heap *heap,
 
 			BUG_ON(block_prev->block.type != BLOCK_FIRST_FIT);
 
-			if (do_heap_relocate_listblock(block_prev, true)) {
+			if (do_heap_relocate_listblock(block_prev, true,
+						       nowait)) {
 
 				/* After relocation current free block can be
 				 * destroyed when it is merged with previous
@@ -813,7 +1088,8 @@ static void nvmap_heap_compact(struct nvmap_heap *heap,
 
 			BUG_ON(block_next->block.type != BLOCK_FIRST_FIT);
 
-			if (do_heap_relocate_listblock(block_next, fast)) {
+			if (do_heap_relocate_listblock(block_next, fast,
+						       nowait)) {
 				ptr = ptr_prev->next;
 				relocation_count++;
 				continue;
@@ -821,7 +1097,43 @@ static void nvmap_heap_compact(struct nvmap_heap *heap,
 		}
 		ptr = ptr_next;
 	}
-	pr_err("Relocated %d chunks\n", relocation_count);
+	if (!max_moves)
+		pr_err("Relocated %d chunks\n", relocation_count);
+	return relocation_count;
+}
+
+/*
+ * background compaction: when freeing leaves the heap fragmented past
+ * compact_threshold, relocate up to compact_batch blocks per pass, with
+ * the heap lock dropped between passes, until it is not (or until a pass
+ * cannot move anything). allocations then rarely need to compact
+ * synchronously.
+ */
+static void heap_compact_work(struct work_struct *work)
+{
+	struct nvmap_heap *heap = container_of(work, struct nvmap_heap,
+					       compact_work.work);
+	ktime_t start;
+	int moved = 0;
+
+	mutex_lock(&heap->lock);
+	if (heap_fragmentation(heap) >= heap->compact_threshold) {
+		start = ktime_get();
+		moved = nvmap_heap_compact(heap, 0, true,
+					   heap->compact_batch, true);
+		heap->compact_us += ktime_us_delta(ktime_get(), start);
+		heap->compact_passes++;
+	}
+	if (moved && heap_fragmentation(heap) >= heap->compact_threshold)
+		schedule_delayed_work(&heap->compact_work, COMPACT_INTERVAL);
+	mutex_unlock(&heap->lock);
+}
+
+/* must be called while holding the heap's lock */
+static void heap_compact_check(struct nvmap_heap *heap)
+{
+	if (heap_fragmentation(heap) >= heap->compact_threshold)
+		schedule_delayed_work(&heap->compact_work, COMPACT_INTERVAL);
 }
 #endif
 
@@ -858,14 +1170,17 @@ struct nvmap_heap_block *nvmap_heap_alloc(struct nvmap_heap *h, size_t len,
 	len = ALIGN(len, PAGE_SIZE);
 	b = do_heap_alloc(h, len, align, prot, 0);
 	if (!b) {
+		ktime_t start = ktime_get();
+
 		pr_err("Compaction triggered!\n");
-		nvmap_heap_compact(h, len, true);
+		nvmap_heap_compact(h, len, true, 0, false);
 		b = do_heap_alloc(h, len, align, prot, 0);
 		if (!b) {
 			pr_err("Full compaction triggered!\n");
-			nvmap_heap_compact(h, len, false);
+			nvmap_heap_compact(h, len, false, 0, false);
 			b = do_heap_alloc(h, len, align, prot, 0);
 		}
+		h->compact_stall_us += ktime_us_delta(ktime_get(), start);
 	}
 #else
 	if (len <= h->buddy_heap_size / 2) {
@@ -919,6 +1234,9 @@ void nvmap_heap_free(struct nvmap_heap_block *b)
 		lb = container_of(b, struct list_block, block);
 		nvmap_flush_heap_block(NULL, b, lb->size, lb->mem_prot);
 		do_heap_free(b);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+		heap_compact_check(h);
+#endif
 	}
 
 	if (bh) {
@@ -1009,15 +1327,20 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 	h->buddy_heap_size = buddy_size;
 	if (buddy_size)
 		h->min_buddy_shift = ilog2(buddy_size / MAX_BUDDY_NR);
-	INIT_LIST_HEAD(&h->free_list);
+	h->free_blocks = RB_ROOT;
 	INIT_LIST_HEAD(&h->buddy_list);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	INIT_DELAYED_WORK(&h->compact_work, heap_compact_work);
+	h->compact_threshold = COMPACT_THRESHOLD;
+	h->compact_batch = COMPACT_BATCH;
+#endif
 	INIT_LIST_HEAD(&h->all_list);
 	mutex_init(&h->lock);
 	l->block.base = base;
 	l->block.type = BLOCK_EMPTY;
 	l->size = len;
 	l->orig_addr = base;
-	list_add_tail(&l->free_list, &h->free_list);
+	free_insert(h, l);
 	list_add_tail(&l->all_list, &h->all_list);
 
 	inner_flush_cache_all();
@@ -1052,6 +1375,9 @@ void nvmap_heap_destroy(struct nvmap_heap *heap)
 
 	sysfs_remove_group(&heap->dev.kobj, &heap_stat_attr_group);
 	device_unregister(&heap->dev);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	cancel_delayed_work_sync(&heap->compact_work);
+#endif
 
 	while (!list_empty(&heap->buddy_list)) {
 		struct buddy_heap *b;
@@ -906,6 +906,7 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 
 		release_task(leader);
+		oom_adj_notify(tsk);
 	}
 
 	sig->group_exit_task = NULL;
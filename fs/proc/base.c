@@ -1082,6 +1082,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 		task->signal->oom_score_adj = (oom_adjust * OOM_SCORE_ADJ_MAX) /
 								-OOM_DISABLE;
 	unlock_task_sighand(task, &flags);
+	oom_adj_notify(task);
 	put_task_struct(task);
 
 	return count;
@@ -1187,6 +1188,7 @@ static ssize_t oom_score_adj_write(struct file *file, const char __user *buf,
 		task->signal->oom_adj = (oom_score_adj * OOM_ADJUST_MAX) /
 							OOM_SCORE_ADJ_MAX;
 	unlock_task_sighand(task, &flags);
+	oom_adj_notify(task);
 	put_task_struct(task);
 	return count;
 }
@@ -0,0 +1,129 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * file_direct.c
+ */
+
+/*
+ * This file decompresses datablocks straight into the page cache,
+ * bypassing the read_page cache and the extra memcpy out of it.  All
+ * the page cache pages covered by the datablock are grabbed up front;
+ * if any of them can't be grabbed, or is already up to date, the
+ * caller falls back to reading the block through the cache.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "squashfs.h"
+#include "page_actor.h"
+
+/*
+ * Read the datablock <block> (compressed size <bsize>) into the page
+ * cache.  Returns 0 with every page, including <target_page>, up to date
+ * and unlocked.  Returns -EAGAIN if the block should be read through the
+ * cache instead, or another negative error if the read failed; in both
+ * cases <target_page> is still locked and the caller deals with it.
+ */
+int squashfs_readpage_block(struct page *target_page, u64 block, int bsize)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int file_end = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int end_index = start_index | mask;
+	int i, n, pages, grabbed = 0, bytes, res = -EAGAIN;
+	struct squashfs_page_actor *actor;
+	struct page **page;
+	void *pageaddr;
+
+	if (end_index > file_end)
+		end_index = file_end;
+	pages = end_index - start_index + 1;
+
+	page = kmalloc(pages * sizeof(*page), GFP_KERNEL);
+	if (page == NULL)
+		return res;
+
+	for (i = 0, n = start_index; n <= end_index; i++, n++) {
+		page[i] = (n == target_page->index) ? target_page :
+			grab_cache_page_nowait(target_page->mapping, n);
+		if (page[i] == NULL)
+			goto release;
+		grabbed++;
+		if (PageUptodate(page[i]))
+			goto release;
+	}
+
+	actor = squashfs_page_actor_init_special(page, pages, 0);
+	if (actor == NULL)
+		goto release;
+
+	res = squashfs_read_data(inode->i_sb, block, bsize, NULL, actor);
+	kfree(actor);
+	if (res < 0)
+		goto release;
+
+	/*
+	 * Anything other than exactly enough data to reach into the last
+	 * page would leave stale page contents visible.
+	 */
+	if ((res + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT != pages) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		res = -EIO;
+		goto release;
+	}
+
+	bytes = res & (PAGE_CACHE_SIZE - 1);
+	if (bytes) {
+		pageaddr = kmap_atomic(page[pages - 1], KM_USER0);
+		memset(pageaddr + bytes, 0, PAGE_CACHE_SIZE - bytes);
+		kunmap_atomic(pageaddr, KM_USER0);
+	}
+
+	for (i = 0; i < pages; i++) {
+		flush_dcache_page(page[i]);
+		SetPageUptodate(page[i]);
+		unlock_page(page[i]);
+		if (page[i] != target_page)
+			page_cache_release(page[i]);
+	}
+
+	kfree(page);
+	return 0;
+
+release:
+	for (i = 0; i < grabbed; i++) {
+		if (page[i] == target_page)
+			continue;
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+
+	kfree(page);
+	return res;
+}
@@ -62,6 +62,10 @@
 /* Meaning: Select to disable background processing */
 /* #define CONFIG_DISABLE_BACKGROUND */
 
+/* Default: Unselected */
+/* Meaning: Select to read tags serially in the yaffs2 mount scan */
+/* #define CONFIG_YAFFS_DISABLE_PARALLEL_SCAN */
+
 
 /*
 Older-style on-NAND data format has a "pageStatus" byte to record
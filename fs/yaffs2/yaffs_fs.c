@@ -41,6 +41,11 @@
 #define YAFFS_COMPILE_EXPORTFS
 #endif
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)) && \
+	!defined(CONFIG_YAFFS_DISABLE_PARALLEL_SCAN)
+#define YAFFS_COMPILE_PARALLEL_SCAN
+#endif
+
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 19))
 #include <linux/config.h>
@@ -133,6 +138,7 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yaffs_guts.h"
 
 #include "yaffs_linux.h"
+#include "yaffs_nand.h"
 
 #include "yaffs_mtdif.h"
 #include "yaffs_mtdif1.h"
@@ -142,6 +148,7 @@ unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS | YAFFS_TRACE_ALWAYS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
+unsigned int yaffs_idle_checkpoint = 60; /* seconds idle before checkpointing, 0 = never */
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -149,11 +156,13 @@ module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
+module_param(yaffs_idle_checkpoint, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
 MODULE_PARM(yaffs_gc_control, "i");
+MODULE_PARM(yaffs_idle_checkpoint, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -411,14 +420,35 @@ static unsigned yaffs_gc_control_callback(yaffs_Device *dev)
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking %p\n"), current));
-	down(&(yaffs_DeviceToContext(dev)->grossLock));
+	down_write(&(yaffs_DeviceToContext(dev)->grossLock));
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked %p\n"), current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking %p\n"), current));
-	up(&(yaffs_DeviceToContext(dev)->grossLock));
+	up_write(&(yaffs_DeviceToContext(dev)->grossLock));
+}
+
+/*
+ * Shared form of the gross lock, taken by file reads and writes,
+ * readlink, follow_link and background garbage collection. The guts
+ * code sorts these out among themselves: writes and gc serialise on
+ * allocLock, and a reader only waits for a write to the same file or
+ * for gc moving one of that file's chunks. Directory operations,
+ * truncates, syncs and checkpoints still take the lock exclusively.
+ */
+static void yaffs_GrossLockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locking shared %p\n"), current));
+	down_read(&(yaffs_DeviceToContext(dev)->grossLock));
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs locked shared %p\n"), current));
+}
+
+static void yaffs_GrossUnlockShared(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_LOCK, (TSTR("yaffs unlocking shared %p\n"), current));
+	up_read(&(yaffs_DeviceToContext(dev)->grossLock));
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -610,11 +640,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user *buffer,
 
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -634,11 +664,11 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	int ret;
 	yaffs_Device *dev = yaffs_DentryToObject(dentry)->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	alias = yaffs_GetSymlinkAlias(yaffs_DentryToObject(dentry));
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	if (!alias) {
 		ret = -ENOMEM;
@@ -851,13 +881,13 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	ret = yaffs_ReadDataFromFile(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -949,7 +979,7 @@ static int yaffs_writepage(struct page *page)
 	buffer = kmap(page);
 
 	obj = yaffs_InodeToObject(inode);
-	yaffs_GrossLock(obj->myDev);
+	yaffs_GrossLockShared(obj->myDev);
 
 	T(YAFFS_TRACE_OS,
 		(TSTR("yaffs_writepage at %08x, size %08x\n"),
@@ -965,7 +995,7 @@ static int yaffs_writepage(struct page *page)
 		(TSTR("writepag1: obj = %05x, ino = %05x\n"),
 		(int)obj->variant.fileVariant.fileSize, (int)inode->i_size));
 
-	yaffs_GrossUnlock(obj->myDev);
+	yaffs_GrossUnlockShared(obj->myDev);
 
 	kunmap(page);
 	set_page_writeback(page);
@@ -1281,7 +1311,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	inode = f->f_dentry->d_inode;
 
@@ -1319,7 +1349,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
 
@@ -1339,11 +1369,11 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 	nFreeChunks = yaffs_GetNumberOfFreeChunks(dev);
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 
 	return (nFreeChunks > 20) ? 1 : 0;
 }
@@ -1358,10 +1388,10 @@ static void yaffs_release_space(struct file *f)
 
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_GrossLockShared(dev);
 
 
-	yaffs_GrossUnlock(dev);
+	yaffs_GrossUnlockShared(dev);
 }
 
 
@@ -2002,6 +2032,103 @@ static int yaffs_do_sync_fs(struct super_block *sb,
 	return 0;
 }
 
+/*
+ * yaffs2 mount scan read ahead.
+ * yaffs_ScanReadTags() queues one work item per block on the unbound
+ * workqueue. Each reads the tags of every chunk in its block; the last one
+ * to finish wakes yaffs_ScanReadWait().
+ */
+
+#ifdef YAFFS_COMPILE_PARALLEL_SCAN
+
+struct yaffs_ScanWork {
+	struct work_struct work;
+	yaffs_Device *dev;
+	int block;
+	yaffs_ExtendedTags *tags;
+};
+
+static void yaffs_ScanReadBlock(yaffs_Device *dev, int block,
+				yaffs_ExtendedTags *tags)
+{
+	int chunk = block * dev->param.nChunksPerBlock;
+	int c;
+
+	for (c = 0; c < dev->param.nChunksPerBlock; c++)
+		yaffs_ReadChunkTagsFromNAND(dev, chunk + c, &tags[c]);
+}
+
+static void yaffs_ScanWorkFunc(struct work_struct *work)
+{
+	struct yaffs_ScanWork *sw =
+		container_of(work, struct yaffs_ScanWork, work);
+	struct yaffs_LinuxContext *context = yaffs_DeviceToContext(sw->dev);
+
+	yaffs_ScanReadBlock(sw->dev, sw->block, sw->tags);
+
+	if (atomic_dec_and_test(&context->scanPending))
+		wake_up(&context->scanWait);
+}
+
+static void yaffs_ScanReadTags(yaffs_Device *dev, const int *blocks,
+				int nBlocks, yaffs_ExtendedTags *tags)
+{
+	struct yaffs_LinuxContext *context = yaffs_DeviceToContext(dev);
+	struct yaffs_ScanWork *sw;
+	int i;
+
+	sw = kmalloc(nBlocks * sizeof(struct yaffs_ScanWork), GFP_NOFS);
+	if (!sw) {
+		/* Just read them here */
+		for (i = 0; i < nBlocks; i++)
+			yaffs_ScanReadBlock(dev, blocks[i],
+				&tags[i * dev->param.nChunksPerBlock]);
+		return;
+	}
+
+	context->scanWork = sw;
+	atomic_set(&context->scanPending, nBlocks);
+
+	for (i = 0; i < nBlocks; i++) {
+		INIT_WORK(&sw[i].work, yaffs_ScanWorkFunc);
+		sw[i].dev = dev;
+		sw[i].block = blocks[i];
+		sw[i].tags = &tags[i * dev->param.nChunksPerBlock];
+		queue_work(system_unbound_wq, &sw[i].work);
+	}
+}
+
+static void yaffs_ScanReadWait(yaffs_Device *dev)
+{
+	struct yaffs_LinuxContext *context = yaffs_DeviceToContext(dev);
+
+	if (!context->scanWork)
+		return;
+
+	wait_event(context->scanWait, !atomic_read(&context->scanPending));
+	kfree(context->scanWork);
+	context->scanWork = NULL;
+}
+
+static void yaffs_ScanSetup(yaffs_Device *dev)
+{
+	struct yaffs_LinuxContext *context = yaffs_DeviceToContext(dev);
+
+	context->scanWork = NULL;
+	atomic_set(&context->scanPending, 0);
+	init_waitqueue_head(&context->scanWait);
+
+	if (dev->param.isYaffs2) {
+		dev->param.scanReadTags = yaffs_ScanReadTags;
+		dev->param.scanReadWait = yaffs_ScanReadWait;
+	}
+}
+#else
+static void yaffs_ScanSetup(yaffs_Device *dev)
+{
+}
+#endif
+
 /*
  * yaffs background thread functions .
  * yaffs_BackgroundThread() the thread function
@@ -2030,6 +2157,8 @@ static int yaffs_BackgroundThread(void *data)
 	unsigned long next_gc = now;
 	unsigned long expires;
 	unsigned int urgency;
+	unsigned long idle_since = now;
+	__u32 idle_writes = dev->nPageWrites;
 
 	int gcResult;
 	struct timer_list timer;
@@ -2050,16 +2179,21 @@ static int yaffs_BackgroundThread(void *data)
 		if(try_to_freeze())
 			continue;
 
-		yaffs_GrossLock(dev);
-
 		now = jiffies;
 
 		if(time_after(now, next_dir_update)){
+			yaffs_GrossLock(dev);
 			yaffs_UpdateDirtyDirectories(dev);
+			yaffs_GrossUnlock(dev);
 			next_dir_update = now + HZ;
 		}
 
+		/*
+		 * gc only moves chunks around, so it shares the gross lock
+		 * with file reads and writes.
+		 */
 		if(time_after(now,next_gc)){
+			yaffs_GrossLockShared(dev);
 			if(!dev->isCheckpointed){
 				urgency = yaffs_bg_gc_urgency(dev);
 				gcResult = yaffs_BackgroundGarbageCollect(dev, urgency);
@@ -2074,8 +2208,33 @@ static int yaffs_BackgroundThread(void *data)
 				* to cut down on wake ups
 				*/
 				next_gc = next_dir_update;
+			yaffs_GrossUnlockShared(dev);
+		}
+
+		/*
+		 * Write a checkpoint once the device has had no writes for a
+		 * while, so that a mount after an unclean shutdown can
+		 * restore it rather than scanning the whole device.
+		 */
+		if(dev->nPageWrites != idle_writes){
+			idle_writes = dev->nPageWrites;
+			idle_since = now;
+		} else if(yaffs_idle_checkpoint &&
+			!dev->isCheckpointed &&
+			!(context->superBlock->s_flags & MS_RDONLY) &&
+			time_after(now, idle_since + yaffs_idle_checkpoint * HZ) &&
+			!yaffs_bg_gc_urgency(dev)){
+			T(YAFFS_TRACE_BACKGROUND | YAFFS_TRACE_CHECKPOINT,
+				(TSTR("yaffs_background: idle checkpoint\n")));
+			yaffs_GrossLock(dev);
+			yaffs_FlushSuperBlock(context->superBlock, 1);
+			context->superBlock->s_dirt = 0;
+			if(dev->isCheckpointed)
+				dev->idleCheckpoints++;
+			idle_writes = dev->nPageWrites;
+			yaffs_GrossUnlock(dev);
+			idle_since = now;
 		}
-		yaffs_GrossUnlock(dev);
 #if 1
 		expires = next_dir_update;
 		if (time_before(next_gc,expires))
@@ -2338,6 +2497,7 @@ typedef struct {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int cache_size;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -2392,6 +2552,9 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 			options->empty_lost_and_found_overridden=1;
 		} else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
+		else if (!strncmp(cur_opt, "cache-size=", 11))
+			options->cache_size =
+				simple_strtol(cur_opt + 11, NULL, 0);
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
 			options->skip_checkpoint_read = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-write"))
@@ -2420,6 +2583,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	char devname_buf[BDEVNAME_SIZE + 1];
 	struct mtd_info *mtd;
 	int err;
+	unsigned long mountStart;
 	char *data_str = (char *)data;
 	struct yaffs_LinuxContext *context = NULL;
 	yaffs_DeviceParam *param;
@@ -2632,6 +2796,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	param->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	param->nReservedBlocks = 5;
 	param->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	if (!options.no_cache && options.cache_size > 0)
+		param->nShortOpCaches = options.cache_size;
 	param->inbandTags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2733,11 +2899,20 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         YINIT_LIST_HEAD(&(yaffs_DeviceToContext(dev)->searchContexts));
         param->removeObjectCallback = yaffs_RemoveObjectCallback;
 
-	init_MUTEX(&(yaffs_DeviceToContext(dev)->grossLock));
+	init_rwsem(&(yaffs_DeviceToContext(dev)->grossLock));
+
+	yaffs_ScanSetup(dev);
 
 	yaffs_GrossLock(dev);
 
+	mountStart = jiffies;
 	err = yaffs_GutsInitialise(dev);
+	dev->mountMs = jiffies_to_msecs(jiffies - mountStart);
+
+	T(YAFFS_TRACE_OS,
+	  (TSTR("yaffs_read_super: mount took %u ms, %s\n"),
+	   dev->mountMs,
+	   dev->mountFromCheckpoint ? "checkpoint restored" : "scanned"));
 
 	T(YAFFS_TRACE_OS,
 	  (TSTR("yaffs_read_super: guts initialised %s\n"),
@@ -2937,6 +3112,13 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "refreshCount....... %u\n", dev->refreshCount);
 	buf +=
 	    sprintf(buf, "nBackgroudDeletions %u\n", dev->nBackgroundDeletions);
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "mountMs............ %u\n", dev->mountMs);
+	buf += sprintf(buf, "mountFromCheckpoint %u\n", dev->mountFromCheckpoint);
+	buf += sprintf(buf, "scanBlocks......... %u\n", dev->scanBlocks);
+	buf += sprintf(buf, "scanTagReads....... %u\n", dev->scanTagReads);
+	buf += sprintf(buf, "scanReadAhead...... %u\n", dev->scanReadAhead);
+	buf += sprintf(buf, "idleCheckpoints.... %u\n", dev->idleCheckpoints);
 
 	return buf;
 }
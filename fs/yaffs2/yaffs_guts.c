@@ -227,6 +227,8 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 {
 	int i, j;
 
+	YMUTEX_LOCK(&dev->stateLock);
+
 	dev->tempInUse++;
 	if (dev->tempInUse > dev->maxTemp)
 		dev->maxTemp = dev->tempInUse;
@@ -241,6 +243,7 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 					    dev->tempBuffer[j].line;
 			}
 
+			YMUTEX_UNLOCK(&dev->stateLock);
 			return dev->tempBuffer[i].buffer;
 		}
 	}
@@ -259,6 +262,8 @@ __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo)
 	 */
 
 	dev->unmanagedTempAllocations++;
+	YMUTEX_UNLOCK(&dev->stateLock);
+
 	return YMALLOC(dev->nDataBytesPerChunk);
 
 }
@@ -268,22 +273,29 @@ void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer,
 {
 	int i;
 
+	YMUTEX_LOCK(&dev->stateLock);
+
 	dev->tempInUse--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->tempBuffer[i].buffer == buffer) {
 			dev->tempBuffer[i].line = 0;
+			YMUTEX_UNLOCK(&dev->stateLock);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanagedTempDeallocations++;
+
+	YMUTEX_UNLOCK(&dev->stateLock);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		T(YAFFS_TRACE_BUFFERS,
 		  (TSTR("Releasing unmanaged temp buffer in line %d" TENDSTR),
 		   lineNo));
 		YFREE(buffer);
-		dev->unmanagedTempDeallocations++;
 	}
 
 }
@@ -1203,6 +1215,8 @@ static void yaffs_HandleUpdateChunk(yaffs_Device *dev, int chunkInNAND,
 
 void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 {
+	/* Can be called from concurrent readers via yaffs_ReadChunkWithTagsFromNAND() */
+	YMUTEX_LOCK(&dev->stateLock);
 	if (!bi->gcPrioritise) {
 		bi->gcPrioritise = 1;
 		dev->hasPendingPrioritisedGCs = 1;
@@ -1214,6 +1228,7 @@ void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 
 		}
 	}
+	YMUTEX_UNLOCK(&dev->stateLock);
 }
 
 static void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
@@ -2092,6 +2107,7 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 
 		memset(tn, 0, sizeof(yaffs_Object));
 		tn->beingCreated = 1;
+		YRWSEM_INIT(&tn->dataLock);
 
 		tn->myDev = dev;
 		tn->hdrChunk = 0;
@@ -3107,6 +3123,30 @@ static void yaffs_SkipRestOfBlock(yaffs_Device *dev)
 }
 
 
+/*
+ * Chunk moves made by gc and by cache write back change the tnode tree of
+ * whatever object owns the chunk, so they take its dataLock to keep that
+ * object's readers out. The writer holding allocLock may already have it.
+ * Returns 1 if the lock was taken here and needs yaffs_UnlockObjectData().
+ */
+static int yaffs_LockObjectData(yaffs_Object *obj, int subclass)
+{
+	if (obj->dataLocked)
+		return 0;
+
+	YRWSEM_WRITE_LOCK_NESTED(&obj->dataLock, subclass);
+	obj->dataLocked = 1;
+	return 1;
+}
+
+static void yaffs_UnlockObjectData(yaffs_Object *obj, int locked)
+{
+	if (locked) {
+		obj->dataLocked = 0;
+		YRWSEM_WRITE_UNLOCK(&obj->dataLock);
+	}
+}
+
 static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 		int wholeBlock)
 {
@@ -3308,10 +3348,14 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 						} else {
 							/* It's a data chunk */
 							int ok;
+							int locked;
+
+							locked = yaffs_LockObjectData(object, 2);
 							ok = yaffs_PutChunkIntoFile
 							    (object,
 							     tags.chunkId,
 							     newChunk, 0);
+							yaffs_UnlockObjectData(object, locked);
 						}
 					}
 				}
@@ -3635,7 +3679,9 @@ int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, unsigned urgency)
 
 	T(YAFFS_TRACE_BACKGROUND, (TSTR("Background gc %u" TENDSTR),urgency));
 
+	YMUTEX_LOCK(&dev->allocLock);
 	yaffs_CheckGarbageCollection(dev, 1);
+	YMUTEX_UNLOCK(&dev->allocLock);
 	return erasedChunks > dev->nFreeChunks/2;
 }
 
@@ -4225,68 +4271,139 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache chunks are hashed on (object, chunkId) so lookups don't have to scan the
+ *   whole cache, and in-use chunks are kept on a list in order of use so the least
+ *   recently used one can be pushed out directly. Dirty chunks are also kept on their
+ *   own list so flushing only has to look at those.
  */
 
+static struct ylist_head *yaffs_ChunkCacheBucket(yaffs_Device *dev,
+					const yaffs_Object *obj, int chunkId)
+{
+	__u32 hash = obj->objectId * 37 + chunkId;
+
+	return &dev->srCacheBucket[hash & (YAFFS_NCACHE_BUCKETS - 1)];
+}
+
+/* Attach a free cache chunk to (obj, chunkId). It starts off clean and most recently used. */
+static void yaffs_AssignChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+					yaffs_Object *obj, int chunkId)
+{
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->nBytes = 0;
+	ylist_add(&cache->hashLink, yaffs_ChunkCacheBucket(dev, obj, chunkId));
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheLru);
+}
+
+static void yaffs_CleanChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (cache->dirty) {
+		ylist_del_init(&cache->dirtyLink);
+		dev->srDirtyCount--;
+		cache->dirty = 0;
+	}
+}
+
+/* Detach a cache chunk from its object and put it back on the free list. */
+static void yaffs_ReleaseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_CleanChunkCache(dev, cache);
+	ylist_del_init(&cache->hashLink);
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheFree);
+	cache->object = NULL;
+}
+
+/* Write a dirty cache chunk out. If that fails the chunk is dropped.
+ * Called with cacheLock held. The chunk is locked while cacheLock is
+ * dropped for the write.
+ */
+static int yaffs_WriteBackChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_Object *obj = cache->object;
+	int chunkWritten;
+	int locked;
+
+	cache->locked = 1;
+	YMUTEX_UNLOCK(&dev->cacheLock);
+
+	locked = yaffs_LockObjectData(obj, 1);
+	chunkWritten = yaffs_WriteChunkDataToObject(obj,
+						    cache->chunkId,
+						    cache->data,
+						    cache->nBytes,
+						    1);
+	yaffs_UnlockObjectData(obj, locked);
+
+	YMUTEX_LOCK(&dev->cacheLock);
+	cache->locked = 0;
+
+	if (chunkWritten > 0)
+		yaffs_CleanChunkCache(dev, cache);
+	else
+		yaffs_ReleaseChunkCache(dev, cache);
+
+	return chunkWritten;
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->param.nShortOpCaches;
+	int found = 0;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
-			return 1;
+	if (dev->param.nShortOpCaches > 0) {
+		YMUTEX_LOCK(&dev->cacheLock);
+		ylist_for_each(i, &dev->srCacheDirty) {
+			cache = ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+			if (cache->object == obj) {
+				found = 1;
+				break;
+			}
+		}
+		YMUTEX_UNLOCK(&dev->cacheLock);
 	}
 
-	return 0;
+	return found;
 }
 
 
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
+	yaffs_ChunkCache *c;
 	int chunkWritten = 0;
-	int nCaches = obj->myDev->param.nShortOpCaches;
 
-	if (nCaches > 0) {
+	if (dev->param.nShortOpCaches > 0) {
+		YMUTEX_LOCK(&dev->cacheLock);
 		do {
 			cache = NULL;
 
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
+			/* Find the unlocked dirty cache for this object with
+			 * the lowest chunk id. Locked ones are in use and get
+			 * written back when they are unlocked.
+			 */
+			ylist_for_each(i, &dev->srCacheDirty) {
+				c = ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+				if (c->object == obj && !c->locked &&
+				    (!cache || c->chunkId < cache->chunkId))
+					cache = c;
 			}
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
-
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
+			if (cache) {
+				/* Write it out. It stays cached as a clean chunk. */
+				chunkWritten = yaffs_WriteBackChunkCache(dev, cache);
 			}
 
 		} while (cache && chunkWritten > 0);
+		YMUTEX_UNLOCK(&dev->cacheLock);
 
 		if (cache) {
 			/* Hoosterman, disk full while writing cache out. */
@@ -4305,44 +4422,47 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
+	struct ylist_head *i;
 	yaffs_Object *obj;
-	int nCaches = dev->param.nShortOpCaches;
-	int i;
 
 	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
+	 * until there are no further dirty objects. Locked chunks are
+	 * skipped, not waited for, so they don't hold up the rest.
 	 */
-	do {
+	while (dev->param.nShortOpCaches > 0) {
 		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
-
+		YMUTEX_LOCK(&dev->cacheLock);
+		ylist_for_each(i, &dev->srCacheDirty) {
+			yaffs_ChunkCache *c =
+				ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+			if (!c->locked) {
+				obj = c->object;
+				break;
+			}
 		}
-		if (obj)
-			yaffs_FlushFilesChunkCache(obj);
-
-	} while (obj);
+		YMUTEX_UNLOCK(&dev->cacheLock);
+		if (!obj)
+			break;
+		/* Written back or dropped, this takes at least one chunk
+		 * off the dirty list, so the loop ends.
+		 */
+		yaffs_FlushFilesChunkCache(obj);
+	}
 
 }
 
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then push out the least recently used one, writing it back first if it is dirty.
+ * Called with cacheLock held, which the write back drops for a while.
  */
 static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 {
-	int i;
-
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
-	}
+	if (dev->param.nShortOpCaches > 0 &&
+	    !ylist_empty(&dev->srCacheFree))
+		return ylist_entry(dev->srCacheFree.next,
+				   yaffs_ChunkCache, lruLink);
 
 	return NULL;
 }
@@ -4350,47 +4470,30 @@ static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 {
 	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
+	struct ylist_head *i;
 
 	if (dev->param.nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
+		/* Try find an unused one... */
 
 		cache = yaffs_GrabChunkCacheWorker(dev);
 
 		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->param.nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
+			/* With locking we can't assume we can use the tail */
+			for (i = dev->srCacheLru.prev; i != &dev->srCacheLru; i = i->prev) {
+				cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+				if (!cache->locked)
+					break;
+				cache = NULL;
 			}
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
-				cache = yaffs_GrabChunkCacheWorker(dev);
+			if (cache) {
+				if (cache->dirty &&
+				    yaffs_WriteBackChunkCache(dev, cache) <= 0)
+					T(YAFFS_TRACE_ERROR,
+					  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+				if (cache->object)
+					yaffs_ReleaseChunkCache(dev, cache);
 			}
-
 		}
 		return cache;
 	} else
@@ -4398,46 +4501,66 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 
 }
 
+/* As yaffs_GrabChunkCache(), but never writes anything back. Used on the read
+ * path, which can run alongside other readers and so must not touch NAND
+ * allocation. Returns NULL if every in-use chunk is dirty or locked.
+ */
+static yaffs_ChunkCache *yaffs_GrabCleanChunkCache(yaffs_Device *dev)
+{
+	yaffs_ChunkCache *cache;
+	struct ylist_head *i;
+
+	cache = yaffs_GrabChunkCacheWorker(dev);
+	if (cache || dev->param.nShortOpCaches < 1)
+		return cache;
+
+	for (i = dev->srCacheLru.prev; i != &dev->srCacheLru; i = i->prev) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (!cache->locked && !cache->dirty) {
+			yaffs_ReleaseChunkCache(dev, cache);
+			return cache;
+		}
+	}
+
+	return NULL;
+}
+
 /* Find a cached chunk */
 static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
+
 	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
+		ylist_for_each(i, yaffs_ChunkCacheBucket(dev, obj, chunkId)) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId) {
 				dev->cacheHits++;
 
-				return &dev->srCache[i];
+				return cache;
 			}
 		}
 	}
 	return NULL;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Move the chunk to the head of the least recently used list */
 static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 				int isAWrite)
 {
 
 	if (dev->param.nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
-
-		dev->srLastUse++;
+		ylist_del(&cache->lruLink);
+		ylist_add(&cache->lruLink, &dev->srCacheLru);
 
-		cache->lastUse = dev->srLastUse;
-
-		if (isAWrite)
+		if (isAWrite && !cache->dirty) {
+			ylist_add_tail(&cache->dirtyLink, &dev->srCacheDirty);
+			dev->srDirtyCount++;
 			cache->dirty = 1;
+		}
 	}
 }
 
@@ -4447,11 +4570,16 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
  */
 static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 {
-	if (object->myDev->param.nShortOpCaches > 0) {
-		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
+	yaffs_Device *dev = object->myDev;
+
+	if (dev->param.nShortOpCaches > 0) {
+		yaffs_ChunkCache *cache;
 
+		YMUTEX_LOCK(&dev->cacheLock);
+		cache = yaffs_FindChunkCache(object, chunkId);
 		if (cache)
-			cache->object = NULL;
+			yaffs_ReleaseChunkCache(dev, cache);
+		YMUTEX_UNLOCK(&dev->cacheLock);
 	}
 }
 
@@ -4460,15 +4588,20 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
+	struct ylist_head *i;
+	struct ylist_head *n;
+	yaffs_ChunkCache *cache;
 	yaffs_Device *dev = in->myDev;
 
 	if (dev->param.nShortOpCaches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+		YMUTEX_LOCK(&dev->cacheLock);
+		ylist_for_each_safe(i, n, &dev->srCacheLru) {
+			cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (cache->object == in)
+				yaffs_ReleaseChunkCache(dev, cache);
 		}
+		YMUTEX_UNLOCK(&dev->cacheLock);
 	}
 }
 
@@ -5037,6 +5170,10 @@ int yaffs_CheckpointRestore(yaffs_Device *dev)
  * An incomplete chunk to end off with
  *
  * Curve-balls: the first chunk might also be the last chunk.
+ *
+ * Reads hold the file's dataLock shared, so they run alongside writes to
+ * other files and gc, and only wait when one of this file's chunks moves.
+ * Writes take allocLock and then the file's dataLock.
  */
 
 int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
@@ -5048,12 +5185,15 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	int nToCopy;
 	int n = nBytes;
 	int nDone = 0;
+	int loading;
 	yaffs_ChunkCache *cache;
 
 	yaffs_Device *dev;
 
 	dev = in->myDev;
 
+	YRWSEM_READ_LOCK(&in->dataLock);
+
 	while (n > 0) {
 		/* chunk = offset / dev->nDataBytesPerChunk + 1; */
 		/* start = offset % dev->nDataBytesPerChunk; */
@@ -5068,42 +5208,59 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		else
 			nToCopy = dev->nDataBytesPerChunk - start;
 
+		YMUTEX_LOCK(&dev->cacheLock);
+
 		cache = yaffs_FindChunkCache(in, chunk);
 
+		/* A locked chunk is still being loaded by another reader.
+		 * Don't wait for it and don't load a second copy, just
+		 * read the chunk from NAND ourselves.
+		 */
+		loading = cache && cache->locked;
+		if (loading)
+			cache = NULL;
+
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
 		 * else bypass the cache.
 		 */
 		if (cache || nToCopy != dev->nDataBytesPerChunk || dev->param.inbandTags) {
-			if (dev->param.nShortOpCaches > 0) {
 
-				/* If we can't find the data in the cache, then load it up. */
+			/* If we can't find the data in the cache, then load it up.
+			 * The chunk is locked while cacheLock is dropped for the
+			 * NAND read, so nobody else uses or reclaims it half
+			 * filled.
+			 */
 
-				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+			if (!cache && !loading && dev->param.nShortOpCaches > 0) {
+				cache = yaffs_GrabCleanChunkCache(dev);
+				if (cache) {
+					yaffs_AssignChunkCache(dev, cache, in, chunk);
+					cache->locked = 1;
+					YMUTEX_UNLOCK(&dev->cacheLock);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
-					cache->nBytes = 0;
+					YMUTEX_LOCK(&dev->cacheLock);
 				}
+			}
 
+			if (cache) {
 				yaffs_UseChunkCache(dev, cache, 0);
 
-				cache->locked = 1;
-
-
 				memcpy(buffer, &cache->data[start], nToCopy);
 
 				cache->locked = 0;
+
+				YMUTEX_UNLOCK(&dev->cacheLock);
 			} else {
 				/* Read into the local buffer then copy..*/
 
-				__u8 *localBuffer =
-				    yaffs_GetTempBuffer(dev, __LINE__);
+				__u8 *localBuffer;
+
+				YMUTEX_UNLOCK(&dev->cacheLock);
+
+				localBuffer = yaffs_GetTempBuffer(dev, __LINE__);
 				yaffs_ReadChunkDataFromObject(in, chunk,
 							      localBuffer);
 
@@ -5116,6 +5273,8 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 		} else {
 
+			YMUTEX_UNLOCK(&dev->cacheLock);
+
 			/* A full chunk. Read directly into the supplied buffer. */
 			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
 
@@ -5128,6 +5287,8 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 	}
 
+	YRWSEM_READ_UNLOCK(&in->dataLock);
+
 	return nDone;
 }
 
@@ -5202,21 +5363,28 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			 */
 			if (dev->param.nShortOpCaches > 0) {
 				yaffs_ChunkCache *cache;
-				/* If we can't find the data in the cache, then load the cache */
+				int spaceOk = yaffs_CheckSpaceForAllocation(dev, 1);
+
+				YMUTEX_LOCK(&dev->cacheLock);
+
+				/* If we can't find the data in the cache, then load the cache.
+				 * cacheLock is dropped for the NAND read, with the chunk locked.
+				 */
 				cache = yaffs_FindChunkCache(in, chunk);
 
-				if (!cache
-				    && yaffs_CheckSpaceForAllocation(dev, 1)) {
+				if (!cache && spaceOk) {
 					cache = yaffs_GrabChunkCache(dev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->data);
+					if (cache) {
+						yaffs_AssignChunkCache(dev, cache, in, chunk);
+						cache->locked = 1;
+						YMUTEX_UNLOCK(&dev->cacheLock);
+						yaffs_ReadChunkDataFromObject(in, chunk,
+									      cache->data);
+						YMUTEX_LOCK(&dev->cacheLock);
+					}
 				} else if (cache &&
 					!cache->dirty &&
-					!yaffs_CheckSpaceForAllocation(dev, 1)) {
+					!spaceOk) {
 					/* Drop the cache if it was a read cache item and
 					 * no space check has been made for it.
 					 */
@@ -5232,20 +5400,25 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 					       nToCopy);
 
 
-					cache->locked = 0;
 					cache->nBytes = nToWriteBack;
 
 					if (writeThrough) {
+						YMUTEX_UNLOCK(&dev->cacheLock);
 						chunkWritten =
 						    yaffs_WriteChunkDataToObject
 						    (cache->object,
 						     cache->chunkId,
 						     cache->data, cache->nBytes,
 						     1);
-						cache->dirty = 0;
+						YMUTEX_LOCK(&dev->cacheLock);
+						yaffs_CleanChunkCache(dev, cache);
 					}
 
+					cache->locked = 0;
+					YMUTEX_UNLOCK(&dev->cacheLock);
+
 				} else {
+					YMUTEX_UNLOCK(&dev->cacheLock);
 					chunkWritten = -1;	/* fail the write */
 				}
 			} else {
@@ -5310,8 +5483,21 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough)
 {
+	yaffs_Device *dev = in->myDev;
+	int nDone;
+
+	YMUTEX_LOCK(&dev->allocLock);
+	YRWSEM_WRITE_LOCK(&in->dataLock);
+	in->dataLocked = 1;
+
 	yaffs_HandleHole(in,offset);
-	return yaffs_DoWriteDataToFile(in,buffer,offset,nBytes,writeThrough);
+	nDone = yaffs_DoWriteDataToFile(in,buffer,offset,nBytes,writeThrough);
+
+	in->dataLocked = 0;
+	YRWSEM_WRITE_UNLOCK(&in->dataLock);
+	YMUTEX_UNLOCK(&dev->allocLock);
+
+	return nDone;
 }
 
 
@@ -5901,6 +6087,116 @@ static int ybicmp(const void *a, const void *b)
 }
 
 
+/*
+ * Mount scan read ahead.
+ * If the OS layer supplies scanReadTags, the tags for the next window of
+ * blocks are read (possibly by several threads) while the scan works
+ * through the current window. Only the tag reads are moved; the object
+ * tree is still rebuilt by the one scanning thread, in the same order.
+ */
+#define YAFFS_SCAN_WINDOW	16
+
+typedef struct {
+	yaffs_ExtendedTags *tags[2];
+	int blocks[2][YAFFS_SCAN_WINDOW];
+	int nBlocks[2];
+	int cur;	/* Window being worked through */
+	int pos;	/* Next block within it */
+	int next;	/* Next blockIndex entry to read, counting down */
+	int pending;	/* Set while the other window is being read */
+} yaffs_ScanAhead;
+
+static void yaffs_ScanAheadStart(yaffs_Device *dev, yaffs_ScanAhead *sa,
+				const yaffs_BlockIndex *blockIndex)
+{
+	int w = !sa->cur;
+	int n = 0;
+
+	while (n < YAFFS_SCAN_WINDOW && sa->next >= 0)
+		sa->blocks[w][n++] = blockIndex[sa->next--].block;
+
+	sa->nBlocks[w] = n;
+	if (n) {
+		dev->param.scanReadTags(dev, sa->blocks[w], n, sa->tags[w]);
+		sa->pending = 1;
+	}
+}
+
+static void yaffs_ScanAheadInit(yaffs_Device *dev, yaffs_ScanAhead *sa,
+				const yaffs_BlockIndex *blockIndex, int nBlocksToScan)
+{
+	int bytes = YAFFS_SCAN_WINDOW * dev->param.nChunksPerBlock *
+			sizeof(yaffs_ExtendedTags);
+
+	memset(sa, 0, sizeof(yaffs_ScanAhead));
+
+	if (!dev->param.scanReadTags || !dev->param.scanReadWait ||
+	    nBlocksToScan < 2)
+		return;
+
+	sa->tags[0] = YMALLOC_ALT(bytes);
+	sa->tags[1] = YMALLOC_ALT(bytes);
+	if (!sa->tags[0] || !sa->tags[1]) {
+		/* Not fatal, just scan without read ahead */
+		if (sa->tags[0])
+			YFREE_ALT(sa->tags[0]);
+		if (sa->tags[1])
+			YFREE_ALT(sa->tags[1]);
+		sa->tags[0] = sa->tags[1] = NULL;
+		return;
+	}
+
+	sa->next = nBlocksToScan - 1;
+	yaffs_ScanAheadStart(dev, sa, blockIndex);
+	dev->scanReadAhead = 1;
+}
+
+/*
+ * Returns the tags for every chunk in blk, which must be the next block in
+ * scan order, or NULL when not reading ahead.
+ */
+static const yaffs_ExtendedTags *yaffs_ScanAheadGet(yaffs_Device *dev,
+				yaffs_ScanAhead *sa,
+				const yaffs_BlockIndex *blockIndex, int blk)
+{
+	if (!sa->tags[0])
+		return NULL;
+
+	if (sa->pos >= sa->nBlocks[sa->cur]) {
+		/* Done with this window. Swap to the one read ahead and
+		 * start reading the next.
+		 */
+		if (sa->pending) {
+			dev->param.scanReadWait(dev);
+			sa->pending = 0;
+		}
+		sa->cur = !sa->cur;
+		sa->pos = 0;
+		yaffs_ScanAheadStart(dev, sa, blockIndex);
+	}
+
+	if (sa->pos >= sa->nBlocks[sa->cur] ||
+	    sa->blocks[sa->cur][sa->pos] != blk)
+		YBUG();
+
+	return &sa->tags[sa->cur][sa->pos++ * dev->param.nChunksPerBlock];
+}
+
+static void yaffs_ScanAheadDeinit(yaffs_Device *dev, yaffs_ScanAhead *sa)
+{
+	if (!sa->tags[0])
+		return;
+
+	/* A scan that gave up early can leave a read in flight */
+	if (sa->pending)
+		dev->param.scanReadWait(dev);
+
+	YFREE_ALT(sa->tags[0]);
+	YFREE_ALT(sa->tags[1]);
+	sa->tags[0] = sa->tags[1] = NULL;
+}
+
+
 struct yaffs_ShadowFixerStruct {
 	int objectId;
 	int shadowedId;
@@ -6585,6 +6881,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
+	yaffs_ScanAhead scanAhead;
+	const yaffs_ExtendedTags *blockTags;
 
 	if (!dev->param.isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
@@ -6716,6 +7014,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	T(YAFFS_TRACE_SCAN_DEBUG,
 	  (TSTR("%d blocks to be scanned" TENDSTR), nBlocksToScan));
 
+	dev->scanBlocks = nBlocksToScan;
+	dev->scanTagReads = 0;
+	dev->scanReadAhead = 0;
+	yaffs_ScanAheadInit(dev, &scanAhead, blockIndex, nBlocksToScan);
+
 	/* For each block.... backwards */
 	for (blockIterator = endIterator; !alloc_failed && blockIterator >= startIterator;
 			blockIterator--) {
@@ -6733,6 +7036,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		blockTags = yaffs_ScanAheadGet(dev, &scanAhead, blockIndex, blk);
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->param.nChunksPerBlock - 1;
@@ -6745,8 +7050,18 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->param.nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			dev->scanTagReads++;
+			if (blockTags) {
+				/* Read ahead: account for it and handle errors
+				 * as yaffs_ReadChunkWithTagsFromNAND() would.
+				 */
+				tags = blockTags[c];
+				dev->nPageReads++;
+				if (tags.eccResult > YAFFS_ECC_RESULT_NO_ERROR)
+					yaffs_HandleChunkError(dev, bi);
+			} else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
+								&tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -7174,6 +7489,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 		}
 
 	}
+
+	yaffs_ScanAheadDeinit(dev, &scanAhead);
 	
 	yaffs_SkipRestOfBlock(dev);
 
@@ -7953,6 +8270,10 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->oldestDirtySequence = 0;
 	dev->oldestDirtyBlock = 0;
 
+	YMUTEX_INIT(&dev->allocLock);
+	YMUTEX_INIT(&dev->cacheLock);
+	YMUTEX_INIT(&dev->stateLock);
+
 	/* Initialise temporary buffers and caches. */
 	if (!yaffs_InitialiseTempBuffers(dev))
 		init_failed = 1;
@@ -7977,16 +8298,24 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		for (i = 0; i < YAFFS_NCACHE_BUCKETS; i++)
+			YINIT_LIST_HEAD(&dev->srCacheBucket[i]);
+		YINIT_LIST_HEAD(&dev->srCacheLru);
+		YINIT_LIST_HEAD(&dev->srCacheFree);
+		YINIT_LIST_HEAD(&dev->srCacheDirty);
+
 		for (i = 0; i < dev->param.nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			YINIT_LIST_HEAD(&dev->srCache[i].dirtyLink);
+			ylist_add_tail(&dev->srCache[i].lruLink, &dev->srCacheFree);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->param.totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
 
-		dev->srLastUse = 0;
+		dev->srDirtyCount = 0;
 	}
 
 	dev->cacheHits = 0;
@@ -8013,7 +8342,12 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	if (!init_failed) {
 		/* Now scan the flash. */
 		if (dev->param.isYaffs2) {
+			dev->mountFromCheckpoint = 0;
+			dev->scanBlocks = 0;
+			dev->scanTagReads = 0;
+			dev->scanReadAhead = 0;
 			if (yaffs_CheckpointRestore(dev)) {
+				dev->mountFromCheckpoint = 1;
 				yaffs_CheckObjectDetailsLoaded(dev->rootDir);
 				T(YAFFS_TRACE_ALWAYS,
 				  (TSTR("yaffs: restored from checkpoint" TENDSTR)));
@@ -8154,7 +8488,6 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	int nFree;
 	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -8166,10 +8499,7 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	/* Now count the number of dirty chunks in the cache and subtract those */
 
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->param.nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
+	nDirtyCacheChunks = dev->param.nShortOpCaches > 0 ? dev->srDirtyCount : 0;
 
 	nFree -= nDirtyCacheChunks;
 
@@ -87,7 +87,8 @@
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
+#define YAFFS_NCACHE_BUCKETS		64	/* Must be a power of 2 */
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -112,9 +113,11 @@
 
 /* ChunkCache is used for short read/write operations.*/
 typedef struct {
+	struct ylist_head hashLink;	/* Bucket chain, keyed on (object, chunkId) */
+	struct ylist_head lruLink;	/* On srCacheLru while in use, else srCacheFree */
+	struct ylist_head dirtyLink;	/* On srCacheDirty while dirty */
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -471,6 +474,13 @@ struct yaffs_ObjectStruct {
 
 	void *myInode;
 
+	/* File data and tnode tree. Readers take it shared, writers and
+	 * chunk moves (gc, cache write back) take it exclusively.
+	 * dataLocked is only looked at by the holder of allocLock.
+	 */
+	yrwsem_t dataLock;
+	__u8 dataLocked;
+
 	yaffs_ObjectType variantType;
 
 	yaffs_ObjectVariant variant;
@@ -602,6 +612,16 @@ struct yaffs_DeviceParamStruct {
 	/*  Callback to control garbage collection. */
 	unsigned (*gcControl)(struct yaffs_DeviceStruct *dev);
 
+	/* Optional yaffs2 mount scan read ahead. scanReadTags starts reading
+	 * the tags of every chunk in blocks[0..nBlocks-1] into tags[], one
+	 * nChunksPerBlock run per block, and may return before they are in.
+	 * scanReadWait waits for the last scanReadTags to finish. Reads must
+	 * go through yaffs_ReadChunkTagsFromNAND().
+	 */
+	void (*scanReadTags)(struct yaffs_DeviceStruct *dev, const int *blocks,
+				int nBlocks, yaffs_ExtendedTags *tags);
+	void (*scanReadWait)(struct yaffs_DeviceStruct *dev);
+
         /* Debug control flags. Don't use unless you know what you're doing */
 	int useHeaderFileSize;	/* Flag to determine if we should use file sizes from the header */
 	int disableLazyLoad;	/* Disable lazy loading on this device */
@@ -727,8 +747,24 @@ struct yaffs_DeviceStruct {
 	int bufferedBlock;	/* Which block is buffered here? */
 	int doingBufferedBlockRewrite;
 
+	/* yaffs_fs.c lets file reads, file writes and background gc into a
+	 * device at once. Writes and gc also take allocLock, which covers
+	 * chunk allocation, block state and gc, and serialises them. Each
+	 * object's dataLock keeps readers out of a file while its chunks
+	 * move. Lock order is allocLock, dataLock, then cacheLock or
+	 * stateLock. cacheLock and stateLock are never held across NAND
+	 * access.
+	 */
+	ymutex_t allocLock;	/* Allocation, block state and gc */
+	ymutex_t cacheLock;	/* Short op cache */
+	ymutex_t stateLock;	/* Temp buffers and block error accounting */
+
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head srCacheBucket[YAFFS_NCACHE_BUCKETS];
+	struct ylist_head srCacheLru;	/* In use, most recently used first */
+	struct ylist_head srCacheFree;
+	struct ylist_head srCacheDirty;
+	int srDirtyCount;
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -778,6 +814,14 @@ struct yaffs_DeviceStruct {
 	__u32 refreshCount;
 	__u32 cacheHits;
 
+	/* Mount statistics */
+	__u32 mountMs;			/* Time taken by the last mount, set by the OS layer */
+	__u32 mountFromCheckpoint;	/* Set if the last mount restored a checkpoint */
+	__u32 scanBlocks;		/* Blocks scanned by the last mount */
+	__u32 scanTagReads;		/* Chunk tags read by the last mount scan */
+	__u32 scanReadAhead;		/* Set if the scan used scanReadTags */
+	__u32 idleCheckpoints;		/* Checkpoints written because the device went idle */
+
 };
 
 typedef struct yaffs_DeviceStruct yaffs_Device;
@@ -19,13 +19,15 @@
 #include "devextras.h"
 #include "yportenv.h"
 
+struct yaffs_ScanWork;
+
 struct yaffs_LinuxContext {
 	struct ylist_head	contextList; /* List of these we have mounted */
 	struct yaffs_DeviceStruct *dev;
 	struct super_block * superBlock;
 	struct task_struct *bgThread; /* Background thread for this device */
 	int bgRunning;
-        struct semaphore grossLock;     /* Gross locking semaphore */
+	struct rw_semaphore grossLock;	/* Gross lock; file data ops and bg gc take it shared */
 	__u8 *spareBuffer;      /* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
@@ -34,6 +36,11 @@ struct yaffs_LinuxContext {
 	void (*putSuperFunc)(struct super_block *sb);
 
 	struct task_struct *readdirProcess;
+
+	/* Mount scan read ahead */
+	struct yaffs_ScanWork *scanWork;
+	atomic_t scanPending;
+	wait_queue_head_t scanWait;
 };
 
 #define yaffs_DeviceToContext(dev) ((struct yaffs_LinuxContext *)((dev)->context))
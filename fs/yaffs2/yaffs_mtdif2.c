@@ -141,7 +141,10 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		ops.len = data ? dev->nDataBytesPerChunk : packed_tags_size;
 		ops.ooboffs = 0;
 		ops.datbuf = data;
-		ops.oobbuf = yaffs_DeviceToContext(dev)->spareBuffer;
+		/* Read the tags straight into pt rather than the shared
+		 * spareBuffer, several readers can be in here at once.
+		 */
+		ops.oobbuf = packed_tags_ptr;
 		retval = mtd->read_oob(mtd, addr, &ops);
 	}
 #else
@@ -171,7 +174,9 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		}
 	} else {
 		if (tags) {
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 17))
 			memcpy(packed_tags_ptr, yaffs_DeviceToContext(dev)->spareBuffer, packed_tags_size);
+#endif
 			yaffs_UnpackTags2(tags, &pt, !dev->param.noTagsECC);
 		}
 	}
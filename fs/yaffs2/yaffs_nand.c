@@ -17,6 +17,26 @@
 
 #include "yaffs_getblockinfo.h"
 
+/*
+ * Read the tags of a chunk without counting the read or handling ECC errors.
+ * Touches no device state, so the mount scan may call it from several
+ * threads at once. The caller does the accounting and error handling.
+ */
+int yaffs_ReadChunkTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
+					yaffs_ExtendedTags *tags)
+{
+	int realignedChunkInNAND = chunkInNAND - dev->chunkOffset;
+
+	if (dev->param.readChunkWithTagsFromNAND)
+		return dev->param.readChunkWithTagsFromNAND(dev, realignedChunkInNAND,
+						NULL, tags);
+	else
+		return yaffs_TagsCompatabilityReadChunkWithTagsFromNAND(dev,
+									realignedChunkInNAND,
+									NULL,
+									tags);
+}
+
 int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 					   __u8 *buffer,
 					   yaffs_ExtendedTags *tags)
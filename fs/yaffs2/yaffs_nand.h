@@ -23,6 +23,9 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 					__u8 *buffer,
 					yaffs_ExtendedTags *tags);
 
+int yaffs_ReadChunkTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
+					yaffs_ExtendedTags *tags);
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						int chunkInNAND,
 						const __u8 *buffer,
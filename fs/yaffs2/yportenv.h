@@ -47,6 +47,7 @@
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/mutex.h>
 
 #define YCHAR char
 #define YUCHAR unsigned char
@@ -74,6 +75,20 @@
 #define YYIELD() schedule()
 #define Y_DUMP_STACK() dump_stack()
 
+/* Locks for device and object state shared by concurrent callers */
+typedef struct mutex ymutex_t;
+#define YMUTEX_INIT(m)		mutex_init(m)
+#define YMUTEX_LOCK(m)		mutex_lock(m)
+#define YMUTEX_UNLOCK(m)	mutex_unlock(m)
+
+typedef struct rw_semaphore yrwsem_t;
+#define YRWSEM_INIT(s)		init_rwsem(s)
+#define YRWSEM_READ_LOCK(s)	down_read(s)
+#define YRWSEM_READ_UNLOCK(s)	up_read(s)
+#define YRWSEM_WRITE_LOCK(s)	down_write(s)
+#define YRWSEM_WRITE_LOCK_NESTED(s, n)	down_write_nested(s, n)
+#define YRWSEM_WRITE_UNLOCK(s)	up_write(s)
+
 #define YAFFS_ROOT_MODE			0755
 #define YAFFS_LOSTNFOUND_MODE		0700
 
@@ -157,6 +172,24 @@
 #define Y_DUMP_STACK() do { } while (0)
 #endif
 
+#ifndef YMUTEX_INIT
+/* Single threaded environments don't need these locks */
+typedef int ymutex_t;
+#define YMUTEX_INIT(m)		do { } while (0)
+#define YMUTEX_LOCK(m)		do { } while (0)
+#define YMUTEX_UNLOCK(m)	do { } while (0)
+#endif
+
+#ifndef YRWSEM_INIT
+typedef int yrwsem_t;
+#define YRWSEM_INIT(s)		do { } while (0)
+#define YRWSEM_READ_LOCK(s)	do { } while (0)
+#define YRWSEM_READ_UNLOCK(s)	do { } while (0)
+#define YRWSEM_WRITE_LOCK(s)	do { } while (0)
+#define YRWSEM_WRITE_LOCK_NESTED(s, n)	do { } while (0)
+#define YRWSEM_WRITE_UNLOCK(s)	do { } while (0)
+#endif
+
 #ifndef YBUG
 #define YBUG() do {\
 	T(YAFFS_TRACE_BUG,\
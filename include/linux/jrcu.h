@@ -52,8 +52,9 @@ static inline void __rcu_check_callbacks(int cpu, int user) { }
 #define rcu_check_callbacks                    __rcu_check_callbacks
 
 #define rcu_needs_cpu(cpu)                     (0)
-#define rcu_batches_completed()                        (0)
-#define rcu_batches_completed_bh()             (0)
+extern long rcu_batches_completed(void);
+
+#define rcu_batches_completed_bh               rcu_batches_completed
 #define rcu_preempt_depth()                    (0)
 
 extern void rcu_force_quiescent_state(void);
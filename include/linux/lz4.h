@@ -0,0 +1,30 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  LZ4 is a byte oriented LZ77 codec that favours compression and
+ *  decompression speed over ratio.  Only the raw block format is
+ *  supported; there is no frame header or checksum.
+ */
+
+#define LZ4_MEM_COMPRESS	(4096 * sizeof(u32))
+
+#define lz4_compressbound(x)	((x) + ((x) / 255) + 16)
+
+/*
+ * This requires 'wrkmem' of size LZ4_MEM_COMPRESS and 'dst' of at
+ * least lz4_compressbound(src_len) bytes.  Returns 0 on success.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * Safe decompression with overrun testing.  On entry *dst_len is the
+ * size of 'dst', on return the number of bytes decompressed.
+ * Returns 0 on success, < 0 on malformed input.
+ */
+int lz4_decompress_unknownoutputsize(const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t *dst_len);
+
+#endif
@@ -628,6 +628,15 @@ struct signal_struct {
 
 	int oom_adj;		/* OOM kill score adjustment (bit shift) */
 	int oom_score_adj;	/* OOM kill score adjustment */
+
+#ifdef CONFIG_CGROUPS
+	/*
+	 * Taken for reading by copy_process() around a CLONE_THREAD fork,
+	 * and for writing to keep the thread group from growing while it
+	 * is moved between cgroups as a whole.
+	 */
+	struct rw_semaphore threadgroup_fork_lock;
+#endif
 };
 
 /* Context switch must be unlocked if interrupts are to be enabled */
@@ -1686,6 +1695,9 @@ extern void thread_group_times(struct task_struct *p, cputime_t *ut, cputime_t *
 
 extern int task_free_register(struct notifier_block *n);
 extern int task_free_unregister(struct notifier_block *n);
+extern int oom_adj_register(struct notifier_block *n);
+extern int oom_adj_unregister(struct notifier_block *n);
+extern void oom_adj_notify(struct task_struct *tsk);
 
 /*
  * Per process flags
@@ -2239,6 +2251,31 @@ static inline void task_unlock(struct task_struct *p)
 	spin_unlock(&p->alloc_lock);
 }
 
+/* See threadgroup_fork_lock in signal_struct */
+#ifdef CONFIG_CGROUPS
+static inline void threadgroup_fork_read_lock(struct task_struct *tsk)
+{
+	down_read(&tsk->signal->threadgroup_fork_lock);
+}
+static inline void threadgroup_fork_read_unlock(struct task_struct *tsk)
+{
+	up_read(&tsk->signal->threadgroup_fork_lock);
+}
+static inline void threadgroup_fork_write_lock(struct task_struct *tsk)
+{
+	down_write(&tsk->signal->threadgroup_fork_lock);
+}
+static inline void threadgroup_fork_write_unlock(struct task_struct *tsk)
+{
+	up_write(&tsk->signal->threadgroup_fork_lock);
+}
+#else
+static inline void threadgroup_fork_read_lock(struct task_struct *tsk) {}
+static inline void threadgroup_fork_read_unlock(struct task_struct *tsk) {}
+static inline void threadgroup_fork_write_lock(struct task_struct *tsk) {}
+static inline void threadgroup_fork_write_unlock(struct task_struct *tsk) {}
+#endif
+
 extern struct sighand_struct *lock_task_sighand(struct task_struct *tsk,
 							unsigned long *flags);
 
@@ -32,6 +32,19 @@ enum {
 	WAKE_LOCK_TYPE_COUNT
 };
 
+#ifdef CONFIG_WAKELOCK_STAT
+struct wake_lock_stat {
+	int             count;
+	int             expire_count;
+	int             wakeup_count;
+	ktime_t         total_time;
+	ktime_t         prevent_suspend_time;
+	ktime_t         max_time;
+};
+
+struct wake_lock_cpu_stat;
+#endif
+
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
 	struct list_head    link;
@@ -39,15 +52,12 @@ struct wake_lock {
 	const char         *name;
 	unsigned long       expires;
 #ifdef CONFIG_WAKELOCK_STAT
-	struct {
-		int             count;
-		int             expire_count;
-		int             wakeup_count;
-		ktime_t         total_time;
-		ktime_t         prevent_suspend_time;
-		ktime_t         max_time;
-		ktime_t         last_time;
-	} stat;
+	/* The counters are kept per cpu in cpu_stat and added to stat when
+	 * read; stat takes them directly if cpu_stat could not be allocated.
+	 */
+	struct wake_lock_stat stat;
+	struct wake_lock_cpu_stat __percpu *cpu_stat;
+	ktime_t             last_time;
 #endif
 #endif
 };
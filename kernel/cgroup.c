@@ -1686,15 +1686,98 @@ int cgroup_path(const struct cgroup *cgrp, char *buf, int buflen)
 }
 EXPORT_SYMBOL_GPL(cgroup_path);
 
-/**
- * cgroup_attach_task - attach task 'tsk' to cgroup 'cgrp'
- * @cgrp: the cgroup the task is attaching to
- * @tsk: the task to be attached
- *
- * Call holding cgroup_mutex. May take task_lock of
- * the task 'tsk' during call.
+/*
+ * A css_set that some of the tasks being attached are in, and the
+ * css_set they move to.  Each pair is resolved once per batch, so a
+ * thread group whose threads all share a css_set costs one
+ * find_css_set() however many threads it has.
  */
-int cgroup_attach_task(struct cgroup *cgrp, struct task_struct *tsk)
+struct cg_list_entry {
+	struct css_set *cg;
+	struct css_set *newcg;
+	struct list_head links;
+};
+
+static struct css_set *css_set_check_fetched(struct list_head *cg_list,
+					     struct css_set *cg)
+{
+	struct cg_list_entry *cg_entry;
+
+	list_for_each_entry(cg_entry, cg_list, links)
+		if (cg_entry->cg == cg)
+			return cg_entry->newcg;
+	return NULL;
+}
+
+/*
+ * Resolve the css_set that tasks in @cg move to when attached to
+ * @cgrp, unless an earlier task of the batch already did.
+ */
+static int css_set_prefetch(struct cgroup *cgrp, struct css_set *cg,
+			    struct list_head *cg_list)
+{
+	struct cg_list_entry *cg_entry;
+	struct css_set *newcg;
+
+	if (css_set_check_fetched(cg_list, cg))
+		return 0;
+
+	cg_entry = kmalloc(sizeof(*cg_entry), GFP_KERNEL);
+	if (!cg_entry)
+		return -ENOMEM;
+	newcg = find_css_set(cg, cgrp);
+	if (!newcg) {
+		kfree(cg_entry);
+		return -ENOMEM;
+	}
+	get_css_set(cg);
+	cg_entry->cg = cg;
+	cg_entry->newcg = newcg;
+	list_add(&cg_entry->links, cg_list);
+	return 0;
+}
+
+static void css_set_put_fetched(struct list_head *cg_list)
+{
+	struct cg_list_entry *cg_entry, *tmp_entry;
+
+	/* put_css_set will not destroy cg until after an RCU grace period */
+	list_for_each_entry_safe(cg_entry, tmp_entry, cg_list, links) {
+		list_del(&cg_entry->links);
+		put_css_set(cg_entry->cg);
+		put_css_set(cg_entry->newcg);
+		kfree(cg_entry);
+	}
+}
+
+/*
+ * Move tasks whose ->cgroups have been switched onto the task lists of
+ * their new css_sets, all under one css_set_lock.
+ */
+static void css_set_move_tasks(struct task_struct **tasks, int count)
+{
+	struct task_struct *tsk;
+	int i;
+
+	write_lock(&css_set_lock);
+	for (i = 0; i < count; i++) {
+		tsk = tasks[i];
+		if (!list_empty(&tsk->cg_list)) {
+			list_del(&tsk->cg_list);
+			list_add(&tsk->cg_list, &tsk->cgroups->tasks);
+		}
+	}
+	write_unlock(&css_set_lock);
+}
+
+/*
+ * Attach @tsk to @cgrp.  With @cg_list, its new css_set is taken from
+ * those resolved by css_set_prefetch() and the caller moves it onto that
+ * css_set's task list, with css_set_move_tasks(); otherwise both are
+ * done here.
+ */
+static int __cgroup_attach_task(struct cgroup *cgrp, struct task_struct *tsk,
+				struct list_head *cg_list)
 {
 	int retval = 0;
 	struct cgroup_subsys *ss, *failed_ss = NULL;
@@ -1737,15 +1820,30 @@ int cgroup_attach_task(struct cgroup *cgrp, struct task_struct *tsk)
 	cg = tsk->cgroups;
 	get_css_set(cg);
 	task_unlock(tsk);
-	/*
-	 * Locate or allocate a new css_set for this task,
-	 * based on its final set of cgroups
-	 */
-	newcg = find_css_set(cg, cgrp);
-	put_css_set(cg);
-	if (!newcg) {
-		retval = -ENOMEM;
-		goto out;
+	if (cg_list) {
+		/*
+		 * With cgroup_mutex held only exit can change tsk->cgroups
+		 * since it was prefetched, and then tsk is on its way out.
+		 */
+		newcg = css_set_check_fetched(cg_list, cg);
+		if (newcg)
+			get_css_set(newcg);
+		put_css_set(cg);
+		if (!newcg) {
+			retval = -ESRCH;
+			goto out;
+		}
+	} else {
+		/*
+		 * Locate or allocate a new css_set for this task,
+		 * based on its final set of cgroups
+		 */
+		newcg = find_css_set(cg, cgrp);
+		put_css_set(cg);
+		if (!newcg) {
+			retval = -ENOMEM;
+			goto out;
+		}
 	}
 
 	task_lock(tsk);
@@ -1759,12 +1857,8 @@ int cgroup_attach_task(struct cgroup *cgrp, struct task_struct *tsk)
 	task_unlock(tsk);
 
 	/* Update the css_set linked lists if we're using them */
-	write_lock(&css_set_lock);
-	if (!list_empty(&tsk->cg_list)) {
-		list_del(&tsk->cg_list);
-		list_add(&tsk->cg_list, &newcg->tasks);
-	}
-	write_unlock(&css_set_lock);
+	if (!cg_list)
+		css_set_move_tasks(&tsk, 1);
 
 	for_each_subsys(root, ss) {
 		if (ss->attach)
@@ -1797,6 +1891,186 @@ out:
 	return retval;
 }
 
+/**
+ * cgroup_attach_task - attach task 'tsk' to cgroup 'cgrp'
+ * @cgrp: the cgroup the task is attaching to
+ * @tsk: the task to be attached
+ *
+ * Call holding cgroup_mutex. May take task_lock of
+ * the task 'tsk' during call.
+ */
+int cgroup_attach_task(struct cgroup *cgrp, struct task_struct *tsk)
+{
+	return __cgroup_attach_task(cgrp, tsk, NULL);
+}
+
+/**
+ * cgroup_attach_proc - attach all threads of a thread group to 'cgrp'
+ * @cgrp: the cgroup the threads are attaching to
+ * @leader: the thread group leader
+ *
+ * Subsystems are asked once, with threadgroup set, whether @leader and
+ * its threads may move, and are told once that they did.  Each thread's
+ * css_set is switched here.
+ *
+ * The caller keeps the group from creating threads meanwhile, by
+ * holding threadgroup_fork_lock of @leader for writing; otherwise a
+ * thread forked in the middle would inherit the old css_set after its
+ * creator had been looked at, and be left behind.
+ *
+ * Call holding threadgroup_fork_lock of @leader for writing, then
+ * cgroup_mutex, and a reference to @leader. May take task_lock of each
+ * thread during call.
+ */
+int cgroup_attach_proc(struct cgroup *cgrp, struct task_struct *leader)
+{
+	int retval = 0;
+	struct cgroup_subsys *ss, *failed_ss = NULL;
+	struct cgroup *oldcgrp;
+	struct task_struct **group, *tsk;
+	struct css_set *cg, *newcg;
+	struct cgroupfs_root *root = cgrp->root;
+	int max, count, nr_moved, i;
+	LIST_HEAD(cg_list);
+
+	/* threadgroup_fork_lock keeps the group from growing */
+	max = get_nr_threads(leader);
+	group = kmalloc(max * sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return -ENOMEM;
+
+	count = 0;
+	rcu_read_lock();
+	if (!pid_alive(leader)) {
+		rcu_read_unlock();
+		retval = -ESRCH;
+		goto out_put_group;
+	}
+	tsk = leader;
+	do {
+		if (count == max)
+			break;
+		get_task_struct(tsk);
+		group[count++] = tsk;
+	} while_each_thread(leader, tsk);
+	rcu_read_unlock();
+
+	oldcgrp = task_cgroup_from_root(leader, root);
+	if (cgrp == oldcgrp || leader->flags & PF_EXITING) {
+		/*
+		 * The subsystems only move a thread group together with
+		 * its leader, so move whatever threads are left one by one.
+		 */
+		for (i = 0; i < count; i++) {
+			retval = cgroup_attach_task(cgrp, group[i]);
+			if (retval == -ESRCH)
+				retval = 0;
+			if (retval)
+				break;
+		}
+		goto out_put_group;
+	}
+
+	for_each_subsys(root, ss) {
+		if (ss->can_attach) {
+			retval = ss->can_attach(ss, cgrp, leader, true);
+			if (retval) {
+				/*
+				 * Remember on which subsystem the can_attach()
+				 * failed, so that we only call cancel_attach()
+				 * against the subsystems whose can_attach()
+				 * succeeded. (See below)
+				 */
+				failed_ss = ss;
+				goto out;
+			}
+		} else if (!capable(CAP_SYS_ADMIN)) {
+			const struct cred *cred = current_cred(), *tcred;
+
+			/* No can_attach() - check perms generically */
+			tcred = __task_cred(leader);
+			if (cred->euid != tcred->uid &&
+			    cred->euid != tcred->suid) {
+				retval = -EACCES;
+				failed_ss = ss;
+				goto out;
+			}
+		}
+	}
+
+	/*
+	 * Locate or allocate the new css_sets before moving anything, so
+	 * that running out of memory cannot leave the group split.  The
+	 * threads of a group usually share one css_set, so this is
+	 * normally a single find_css_set().
+	 */
+	for (i = 0; i < count; i++) {
+		task_lock(group[i]);
+		cg = group[i]->cgroups;
+		get_css_set(cg);
+		task_unlock(group[i]);
+		retval = css_set_prefetch(cgrp, cg, &cg_list);
+		put_css_set(cg);
+		if (retval)
+			goto out;
+	}
+
+	/* moved threads are gathered at the front of group[] */
+	nr_moved = 0;
+	for (i = 0; i < count; i++) {
+		tsk = group[i];
+		task_lock(tsk);
+		if (tsk->flags & PF_EXITING) {
+			task_unlock(tsk);
+			continue;
+		}
+		/*
+		 * With cgroup_mutex held only exit can change tsk->cgroups,
+		 * so the css_set seen above has been fetched.
+		 */
+		cg = tsk->cgroups;
+		newcg = css_set_check_fetched(&cg_list, cg);
+		BUG_ON(!newcg);
+		get_css_set(newcg);
+		rcu_assign_pointer(tsk->cgroups, newcg);
+		task_unlock(tsk);
+		/* cg_list still holds a reference to cg */
+		put_css_set(cg);
+		group[i] = group[nr_moved];
+		group[nr_moved++] = tsk;
+	}
+
+	/* Update the css_set linked lists if we're using them */
+	css_set_move_tasks(group, nr_moved);
+
+	for_each_subsys(root, ss) {
+		if (ss->attach)
+			ss->attach(ss, cgrp, oldcgrp, leader, true);
+	}
+	set_bit(CGRP_RELEASABLE, &cgrp->flags);
+
+	/*
+	 * wake up rmdir() waiter. the rmdir should fail since the cgroup
+	 * is no longer empty.
+	 */
+	cgroup_wakeup_rmdir_waiter(cgrp);
+out:
+	if (retval) {
+		for_each_subsys(root, ss) {
+			if (ss == failed_ss)
+				break;
+			if (ss->cancel_attach)
+				ss->cancel_attach(ss, cgrp, leader, true);
+		}
+	}
+	css_set_put_fetched(&cg_list);
+out_put_group:
+	for (i = 0; i < count; i++)
+		put_task_struct(group[i]);
+	kfree(group);
+	return retval;
+}
+
 /**
  * cgroup_attach_task_all - attach task 'tsk' to all cgroups of task 'from'
  * @from: attach to all cgroups of a given task
@@ -1849,16 +2123,132 @@ static int attach_task_by_pid(struct cgroup *cgrp, u64 pid)
 	return ret;
 }
 
-static int cgroup_tasks_write(struct cgroup *cgrp, struct cftype *cft, u64 pid)
+/*
+ * Attach the tasks whose pids are listed in 'buffer', separated by
+ * whitespace, to cgroup 'cgrp'.  A pid of 0 means the current task.
+ * Every pid is looked up, and every css_set the tasks move to is
+ * resolved, before any task is moved, so a malformed list, a missing
+ * task or a lack of memory leaves everything where it was.  The
+ * subsystems are then told about each task in turn.  Call with
+ * cgroup_mutex held.
+ */
+static int attach_tasks_by_pids(struct cgroup *cgrp, const char *buffer)
+{
+	struct task_struct **tasks;
+	struct css_set *cg;
+	const char *p;
+	char *end;
+	int count = 0, i, ret;
+	LIST_HEAD(cg_list);
+
+	for (p = skip_spaces(buffer); *p; p = skip_spaces(end)) {
+		simple_strtoull(p, &end, 0);
+		if (end == p || (*end && !isspace(*end)))
+			return -EINVAL;
+		count++;
+	}
+	if (!count)
+		return -EINVAL;
+	if (count == 1)
+		return attach_task_by_pid(cgrp, simple_strtoull(buffer, NULL, 0));
+
+	tasks = kmalloc(count * sizeof(*tasks), GFP_KERNEL);
+	if (!tasks)
+		return -ENOMEM;
+
+	ret = 0;
+	i = 0;
+	rcu_read_lock();
+	for (p = skip_spaces(buffer); *p; p = skip_spaces(end)) {
+		u64 pid = simple_strtoull(p, &end, 0);
+		struct task_struct *tsk = pid ? find_task_by_vpid(pid) : current;
+
+		if (!tsk || tsk->flags & PF_EXITING) {
+			ret = -ESRCH;
+			break;
+		}
+		get_task_struct(tsk);
+		tasks[i++] = tsk;
+	}
+	rcu_read_unlock();
+	count = i;
+
+	/* Threads of one process share a css_set: resolve each only once */
+	for (i = 0; i < count && !ret; i++) {
+		task_lock(tasks[i]);
+		cg = tasks[i]->cgroups;
+		get_css_set(cg);
+		task_unlock(tasks[i]);
+		ret = css_set_prefetch(cgrp, cg, &cg_list);
+		put_css_set(cg);
+	}
+
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		ret = __cgroup_attach_task(cgrp, tasks[i], &cg_list);
+		if (ret)
+			break;
+	}
+	/* ... and take css_set_lock once for the tasks that were attached */
+	css_set_move_tasks(tasks, i);
+out:
+	css_set_put_fetched(&cg_list);
+	for (i = 0; i < count; i++)
+		put_task_struct(tasks[i]);
+	kfree(tasks);
+	return ret;
+}
+
+static int cgroup_tasks_write(struct cgroup *cgrp, struct cftype *cft,
+			      const char *buffer)
 {
 	int ret;
 	if (!cgroup_lock_live_group(cgrp))
 		return -ENODEV;
-	ret = attach_task_by_pid(cgrp, pid);
+	ret = attach_tasks_by_pids(cgrp, buffer);
 	cgroup_unlock();
 	return ret;
 }
 
+/*
+ * Attach every thread in the thread group of the task with pid 'pid'
+ * to cgroup 'cgrp'. Takes the group's threadgroup_fork_lock and then
+ * cgroup_mutex: fork takes cgroup_mutex under the former to clone an
+ * ns cgroup, so they have to nest in this order.
+ */
+static int attach_proc_by_pid(struct cgroup *cgrp, u64 pid)
+{
+	struct task_struct *leader;
+	int ret;
+
+	rcu_read_lock();
+	leader = pid ? find_task_by_vpid(pid) : current;
+	if (!leader || leader->flags & PF_EXITING) {
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	leader = leader->group_leader;
+	get_task_struct(leader);
+	rcu_read_unlock();
+
+	threadgroup_fork_write_lock(leader);
+	if (cgroup_lock_live_group(cgrp)) {
+		ret = cgroup_attach_proc(cgrp, leader);
+		cgroup_unlock();
+	} else
+		ret = -ENODEV;
+	threadgroup_fork_write_unlock(leader);
+	put_task_struct(leader);
+	return ret;
+}
+
+static int cgroup_procs_write(struct cgroup *cgrp, struct cftype *cft, u64 tgid)
+{
+	return attach_proc_by_pid(cgrp, tgid);
+}
+
 /**
  * cgroup_lock_live_group - take cgroup_mutex and check that cgrp is alive.
  * @cgrp: the cgroup to be checked for liveness
@@ -3183,16 +3573,17 @@ static struct cftype files[] = {
 	{
 		.name = "tasks",
 		.open = cgroup_tasks_open,
-		.write_u64 = cgroup_tasks_write,
+		.write_string = cgroup_tasks_write,
+		.max_write_len = PAGE_SIZE,
 		.release = cgroup_pidlist_release,
 		.mode = S_IRUGO | S_IWUSR,
 	},
 	{
 		.name = CGROUP_FILE_GENERIC_PREFIX "procs",
 		.open = cgroup_procs_open,
-		/* .write_u64 = cgroup_procs_write, TODO */
+		.write_u64 = cgroup_procs_write,
 		.release = cgroup_pidlist_release,
-		.mode = S_IRUGO,
+		.mode = S_IRUGO | S_IWUSR,
 	},
 	{
 		.name = "notify_on_release",
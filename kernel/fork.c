@@ -150,6 +150,12 @@ static struct kmem_cache *mm_cachep;
 /* Notifier list called when a task struct is freed */
 static ATOMIC_NOTIFIER_HEAD(task_free_notifier);
 
+/*
+ * Notifier list called when a thread group is created, gets a new leader
+ * or has its oom_adj changed
+ */
+static ATOMIC_NOTIFIER_HEAD(oom_adj_notifier);
+
 static void account_kernel_stack(struct thread_info *ti, int account)
 {
 	struct zone *zone = page_zone(virt_to_page(ti));
@@ -193,6 +199,23 @@ int task_free_unregister(struct notifier_block *n)
 }
 EXPORT_SYMBOL(task_free_unregister);
 
+int oom_adj_register(struct notifier_block *n)
+{
+	return atomic_notifier_chain_register(&oom_adj_notifier, n);
+}
+EXPORT_SYMBOL(oom_adj_register);
+
+int oom_adj_unregister(struct notifier_block *n)
+{
+	return atomic_notifier_chain_unregister(&oom_adj_notifier, n);
+}
+EXPORT_SYMBOL(oom_adj_unregister);
+
+void oom_adj_notify(struct task_struct *tsk)
+{
+	atomic_notifier_call_chain(&oom_adj_notifier, 0, tsk);
+}
+
 void __put_task_struct(struct task_struct *tsk)
 {
 	WARN_ON(!tsk->exit_state);
@@ -923,6 +946,10 @@ static int copy_signal(unsigned long clone_flags, struct task_struct *tsk)
 	sig->oom_adj = current->signal->oom_adj;
 	sig->oom_score_adj = current->signal->oom_score_adj;
 
+#ifdef CONFIG_CGROUPS
+	init_rwsem(&sig->threadgroup_fork_lock);
+#endif
+
 	return 0;
 }
 
@@ -1099,6 +1126,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	monotonic_to_bootbased(&p->real_start_time);
 	p->io_context = NULL;
 	p->audit_context = NULL;
+	if (clone_flags & CLONE_THREAD)
+		threadgroup_fork_read_lock(current);
 	cgroup_fork(p);
 #ifdef CONFIG_NUMA
 	p->mempolicy = mpol_dup(p->mempolicy);
@@ -1306,7 +1335,11 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	write_unlock_irq(&tasklist_lock);
 	proc_fork_connector(p);
 	cgroup_post_fork(p);
+	if (clone_flags & CLONE_THREAD)
+		threadgroup_fork_read_unlock(current);
 	perf_event_fork(p);
+	if (thread_group_leader(p))
+		oom_adj_notify(p);
 	return p;
 
 bad_fork_free_pid:
@@ -1339,6 +1372,8 @@ bad_fork_cleanup_policy:
 	mpol_put(p->mempolicy);
 bad_fork_cleanup_cgroup:
 #endif
+	if (clone_flags & CLONE_THREAD)
+		threadgroup_fork_read_unlock(current);
 	cgroup_exit(p, cgroup_callbacks_done);
 	delayacct_tsk_free(p);
 	module_put(task_thread_info(p)->exec_domain->module);
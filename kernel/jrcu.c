@@ -33,7 +33,11 @@
 
 /*
  * This RCU maintains three callback lists: the current batch (per cpu),
- * the previous batch (also per cpu), and the pending list (global).
+ * the previous batch (also per cpu), and the pending list (built from
+ * every cpu's previous batch at end-of-batch, then invoked).
+ *
+ * The polling period adapts to the number of queued callbacks: it is
+ * shortened while many are queued and lengthened while none are.
  */
 
 #include <linux/bug.h>
@@ -42,6 +46,7 @@
 #include <linux/sched.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/percpu.h>
 #include <linux/stddef.h>
@@ -144,8 +149,16 @@ static struct rcu_stats {
        atomic_t nsyncs;        /* #rcu syncs processed */
        s64 ninvoked;           /* #invoked (ie, finished) callbacks */
        unsigned nforced;       /* #forced eobs (should be zero) */
+       unsigned gp_last_us;    /* length of the last grace period */
+       unsigned gp_max_us;     /* length of the longest grace period */
+       u64 gp_total_us;        /* sum of all grace period lengths */
+       unsigned ninvokes;      /* #batches that invoked callbacks */
+       unsigned cb_last;       /* #callbacks invoked by the last batch */
+       unsigned cb_max;        /* most callbacks invoked by one batch */
 } rcu_stats;
 
+static ktime_t rcu_eob_time;   /* time of the last end-of-batch */
+
 #define RCU_HZ                 (20)
 #define RCU_HZ_PERIOD_US       (USEC_PER_SEC / RCU_HZ)
 #define RCU_HZ_DELTA_US                (USEC_PER_SEC / HZ)
@@ -156,6 +169,22 @@ static int rcu_hz_delta_us = RCU_HZ_DELTA_US;
 
 static int rcu_hz_precise;
 
+/*
+ * Adaptive polling.  With more than rcu_batch_high callbacks queued the
+ * period is halved each pass, down to RCU_PERIOD_MIN_US; with none
+ * queued it is doubled each pass, up to RCU_PERIOD_IDLE_MULT times the
+ * rcu_hz period.  Otherwise the rcu_hz period is used.  call_rcu() drops
+ * an idle period straight back to the rcu_hz period, so only a sleep
+ * already under way is long.
+ */
+#define RCU_BATCH_HIGH         (512)
+#define RCU_PERIOD_MIN_US      (USEC_PER_SEC / 1000)
+#define RCU_PERIOD_IDLE_MULT   (4)
+
+static int rcu_adaptive = 1;
+static int rcu_batch_high = RCU_BATCH_HIGH;
+static int rcu_period_us = RCU_HZ_PERIOD_US;   /* current period */
+
 int rcu_scheduler_active __read_mostly;
 int rcu_nmi_seen __read_mostly;
 
@@ -276,6 +305,14 @@ void call_rcu(struct rcu_head *cb, void (*func)(struct rcu_head *rcu))
        which = ACCESS_ONCE(rcu_which);
        cblist = &rd->cblist[which];
 
+       /* First callback onto an empty list: if the period has stretched
+        * out while idle, pull it back in, so this callback does not sit
+        * through the long idle periods.  We can't wake jrcud from here,
+        * call_rcu() may be called with scheduler locks held. */
+       if (!cblist->head &&
+           ACCESS_ONCE(rcu_period_us) > rcu_hz_period_us)
+               rcu_period_us = rcu_hz_period_us;
+
        /* The following is not NMI-safe, therefore call_rcu()
         * cannot be invoked under NMI. */
        rcu_list_add(cblist, cb);
@@ -317,6 +354,8 @@ static void __rcu_delimit_batches(struct rcu_list *pending)
        struct rcu_data *rd;
        struct rcu_list *plist;
        int cpu, eob, prev;
+       unsigned gp_us;
+       ktime_t now;
 
        if (!rcu_scheduler_active)
                return;
@@ -361,7 +400,7 @@ static void __rcu_delimit_batches(struct rcu_list *pending)
                                        force_cpu_resched(cpu);
                        }
                }
-               rcu_wdog_ctr += rcu_hz_period_us;
+               rcu_wdog_ctr += rcu_period_us;
                return;
        }
 
@@ -403,11 +442,61 @@ static void __rcu_delimit_batches(struct rcu_list *pending)
         */
        xchg(&rcu_which, prev); /* only place where rcu_which is written to */
 
+       now = ktime_get();
+       if (rcu_stats.nbatches) {
+               gp_us = ktime_us_delta(now, rcu_eob_time);
+               rcu_stats.gp_last_us = gp_us;
+               rcu_stats.gp_total_us += gp_us;
+               if (gp_us > rcu_stats.gp_max_us)
+                       rcu_stats.gp_max_us = gp_us;
+       }
+       rcu_eob_time = now;
+
        rcu_stats.nbatches++;
        rcu_stats.nlast = 0;
        rcu_wdog_ctr = 0;
 }
 
+/*
+ * Pick the next polling period from the number of callbacks queued on
+ * the current and previous lists of all cpus.
+ */
+static void rcu_adapt_period(void)
+{
+       int cpu, queued, period;
+
+       if (!rcu_adaptive) {
+               rcu_period_us = rcu_hz_period_us;
+               return;
+       }
+
+       queued = 0;
+       for_each_present_cpu(cpu) {
+               struct rcu_data *rd = &rcu_data[cpu];
+               queued += ACCESS_ONCE(rd->cblist[0].count);
+               queued += ACCESS_ONCE(rd->cblist[1].count);
+       }
+
+       period = rcu_period_us;
+       if (queued >= rcu_batch_high)
+               period = max_t(int, period / 2, RCU_PERIOD_MIN_US);
+       else if (queued == 0)
+               period = min_t(int, period * 2,
+                       rcu_hz_period_us * RCU_PERIOD_IDLE_MULT);
+       else
+               period = rcu_hz_period_us;
+       rcu_period_us = period;
+}
+
+/*
+ * Returns the number of batches ended so far, for rcutorture.
+ */
+long rcu_batches_completed(void)
+{
+       return rcu_stats.nbatches;
+}
+EXPORT_SYMBOL_GPL(rcu_batches_completed);
+
 static void rcu_delimit_batches(void)
 {
        unsigned long flags;
@@ -422,8 +511,15 @@ static void rcu_delimit_batches(void)
        smp_mb();
        raw_local_irq_restore(flags);
 
-       if (pending.head)
+       if (pending.head) {
                rcu_invoke_callbacks(&pending);
+               rcu_stats.ninvokes++;
+               rcu_stats.cb_last = pending.count;
+               if (pending.count > rcu_stats.cb_max)
+                       rcu_stats.cb_max = pending.count;
+       }
+
+       rcu_adapt_period();
 }
 
 /* ------------------ interrupt driver section ------------------ */
@@ -438,7 +534,7 @@ static void rcu_delimit_batches(void)
 #include <linux/hrtimer.h>
 #include <linux/interrupt.h>
 
-#define rcu_hz_period_ns       (rcu_hz_period_us * NSEC_PER_USEC)
+#define rcu_period_ns          (rcu_period_us * NSEC_PER_USEC)
 #define rcu_hz_delta_ns                (rcu_hz_delta_us * NSEC_PER_USEC)
 
 static struct hrtimer rcu_timer;
@@ -454,7 +550,7 @@ static enum hrtimer_restart rcu_timer_func(struct hrtimer *t)
 
        raise_softirq(RCU_SOFTIRQ);
 
-       next = ktime_add_ns(ktime_get(), rcu_hz_period_ns);
+       next = ktime_add_ns(ktime_get(), rcu_period_ns);
        hrtimer_set_expires_range_ns(&rcu_timer, next,
                rcu_hz_precise ? 0 : rcu_hz_delta_ns);
        return HRTIMER_RESTART;
@@ -462,7 +558,7 @@ static enum hrtimer_restart rcu_timer_func(struct hrtimer *t)
 
 static void rcu_timer_start(void)
 {
-       hrtimer_forward_now(&rcu_timer, ns_to_ktime(rcu_hz_period_ns));
+       hrtimer_forward_now(&rcu_timer, ns_to_ktime(rcu_period_ns));
        hrtimer_start_expires(&rcu_timer, HRTIMER_MODE_ABS);
 }
 
@@ -540,12 +636,12 @@ static int jrcud_func(void *arg)
        pr_info("JRCU: callback processing via daemon started.\n");
 
        while (!kthread_should_stop()) {
+               int period = ACCESS_ONCE(rcu_period_us);
+
                if (rcu_hz_precise) {
-                       usleep_range(rcu_hz_period_us,
-                               rcu_hz_period_us);
+                       usleep_range(period, period);
                } else {
-                       usleep_range(rcu_hz_period_us,
-                               rcu_hz_period_us + rcu_hz_delta_us);
+                       usleep_range(period, period + rcu_hz_delta_us);
                }
                rcu_delimit_batches();
        }
@@ -596,6 +692,11 @@ static int rcu_debugfs_show(struct seq_file *m, void *unused)
        seq_printf(m, "%14u: hz, %s\n",
                rcu_hz,
                rcu_hz_precise ? "precise" : "sloppy");
+       seq_printf(m, "%14u: current period (usecs), %s\n",
+               rcu_period_us,
+               rcu_adaptive ? "adaptive" : "fixed");
+       seq_printf(m, "%14u: #callbacks queued to shorten period\n",
+               rcu_batch_high);
 
        seq_printf(m, "%14u: watchdog (secs)\n", rcu_wdog_lim / (int)USEC_PER_SEC);
        seq_printf(m, "%14d: #secs left on watchdog\n",
@@ -631,6 +732,22 @@ static int rcu_debugfs_show(struct seq_file *m, void *unused)
                rcu_stats.ninvoked);
        seq_printf(m, "%14d: #callbacks left to invoke\n",
                (int)(nqueued - rcu_stats.ninvoked));
+       seq_printf(m, "%14u: #callbacks invoked by last batch\n",
+               rcu_stats.cb_last);
+       seq_printf(m, "%14u: #callbacks invoked by largest batch\n",
+               rcu_stats.cb_max);
+       seq_printf(m, "%14llu: #callbacks per batch, average\n",
+               rcu_stats.ninvokes ?
+               div_u64((u64)rcu_stats.ninvoked, rcu_stats.ninvokes) : 0);
+
+       seq_printf(m, "\n");
+       seq_printf(m, "%14u: last grace period (usecs)\n",
+               rcu_stats.gp_last_us);
+       seq_printf(m, "%14u: longest grace period (usecs)\n",
+               rcu_stats.gp_max_us);
+       seq_printf(m, "%14llu: average grace period (usecs)\n",
+               rcu_stats.nbatches > 1 ?
+               div_u64(rcu_stats.gp_total_us, rcu_stats.nbatches - 1) : 0);
        seq_printf(m, "\n");
 
        for_each_online_cpu(cpu)
@@ -707,6 +824,15 @@ next:
                        return -EINVAL;
                rcu_hz = rcu_hz_wanted;
                rcu_hz_period_us = USEC_PER_SEC / rcu_hz;
+               rcu_period_us = rcu_hz_period_us;
+       } else if (!strncmp(token, "adaptive=", 9)) {
+               sscanf(&token[9], "%d", &rcu_adaptive);
+       } else if (!strncmp(token, "batch=", 6)) {
+               int batch = -1;
+               sscanf(&token[6], "%d", &batch);
+               if (batch < 1)
+                       return -EINVAL;
+               rcu_batch_high = batch;
        } else if (!strncmp(token, "precise=", 8)) {
                sscanf(&token[8], "%d", &rcu_hz_precise);
        } else if (!strncmp(token, "wdog=", 5)) {
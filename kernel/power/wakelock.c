@@ -20,7 +20,9 @@
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
+#include <linux/u64_stats_sync.h>
 #endif
 #include "power.h"
 
@@ -42,7 +44,10 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
+/* Active locks without a timeout, in no particular order */
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+/* Active locks with a timeout, sorted by expiry time, earliest first */
+static struct list_head timed_wake_locks[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
@@ -54,6 +59,80 @@ static struct wake_lock deleted_wake_locks;
 static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/* A lock's counters, one set per cpu, so that taking and dropping a lock
+ * does not update them under list_lock.
+ */
+struct wake_lock_cpu_stat {
+	struct wake_lock_stat stat;
+	struct u64_stats_sync syncp;
+};
+
+static void wake_lock_stat_fold(struct wake_lock_stat *to,
+				const struct wake_lock_stat *from)
+{
+	to->count += from->count;
+	to->expire_count += from->expire_count;
+	to->wakeup_count += from->wakeup_count;
+	to->total_time = ktime_add(to->total_time, from->total_time);
+	to->prevent_suspend_time = ktime_add(to->prevent_suspend_time,
+					     from->prevent_suspend_time);
+	if (ktime_to_ns(from->max_time) > ktime_to_ns(to->max_time))
+		to->max_time = from->max_time;
+}
+
+/* Interrupts must be off, and list_lock held if the lock has no cpu_stat */
+static void __wake_lock_stat_add(struct wake_lock *lock,
+				 const struct wake_lock_stat *delta)
+{
+	struct wake_lock_cpu_stat *cs;
+
+	if (!lock->cpu_stat) {
+		wake_lock_stat_fold(&lock->stat, delta);
+		return;
+	}
+	cs = this_cpu_ptr(lock->cpu_stat);
+	u64_stats_update_begin(&cs->syncp);
+	wake_lock_stat_fold(&cs->stat, delta);
+	u64_stats_update_end(&cs->syncp);
+}
+
+/* Interrupts must be off, and list_lock not held */
+static void wake_lock_stat_add(struct wake_lock *lock,
+			       const struct wake_lock_stat *delta)
+{
+	if (!delta->count && !delta->wakeup_count)
+		return;
+	if (lock->cpu_stat) {
+		__wake_lock_stat_add(lock, delta);
+		return;
+	}
+	spin_lock(&list_lock);
+	__wake_lock_stat_add(lock, delta);
+	spin_unlock(&list_lock);
+}
+
+/* Caller must acquire the list_lock spinlock */
+static void wake_lock_stat_sum(struct wake_lock *lock,
+			       struct wake_lock_stat *sum)
+{
+	int cpu;
+
+	*sum = lock->stat;
+	if (!lock->cpu_stat)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct wake_lock_cpu_stat *cs = per_cpu_ptr(lock->cpu_stat, cpu);
+		struct wake_lock_stat stat;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin(&cs->syncp);
+			stat = cs->stat;
+		} while (u64_stats_fetch_retry(&cs->syncp, start));
+		wake_lock_stat_fold(sum, &stat);
+	}
+}
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -83,19 +162,23 @@ int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 
 static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 {
-	int lock_count = lock->stat.count;
-	int expire_count = lock->stat.expire_count;
+	struct wake_lock_stat stat;
+	int lock_count, expire_count;
 	ktime_t active_time = ktime_set(0, 0);
-	ktime_t total_time = lock->stat.total_time;
-	ktime_t max_time = lock->stat.max_time;
-
-	ktime_t prevent_suspend_time = lock->stat.prevent_suspend_time;
+	ktime_t total_time, max_time, prevent_suspend_time;
+
+	wake_lock_stat_sum(lock, &stat);
+	lock_count = stat.count;
+	expire_count = stat.expire_count;
+	total_time = stat.total_time;
+	max_time = stat.max_time;
+	prevent_suspend_time = stat.prevent_suspend_time;
 	if (lock->flags & WAKE_LOCK_ACTIVE) {
 		ktime_t now, add_time;
 		int expired = get_expired_time(lock, &now);
 		if (!expired)
 			now = ktime_get();
-		add_time = ktime_sub(now, lock->stat.last_time);
+		add_time = ktime_sub(now, lock->last_time);
 		lock_count++;
 		if (!expired)
 			active_time = add_time;
@@ -112,10 +195,10 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 	return seq_printf(m,
 		     "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\n",
 		     lock->name, lock_count, expire_count,
-		     lock->stat.wakeup_count, ktime_to_ns(active_time),
+		     stat.wakeup_count, ktime_to_ns(active_time),
 		     ktime_to_ns(total_time),
 		     ktime_to_ns(prevent_suspend_time), ktime_to_ns(max_time),
-		     ktime_to_ns(lock->stat.last_time));
+		     ktime_to_ns(lock->last_time));
 }
 
 static int wakelock_stats_show(struct seq_file *m, void *unused)
@@ -134,12 +217,16 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
 		list_for_each_entry(lock, &active_wake_locks[type], link)
 			ret = print_lock_stat(m, lock);
+		list_for_each_entry(lock, &timed_wake_locks[type], link)
+			ret = print_lock_stat(m, lock);
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
 	return 0;
 }
 
-static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
+/* The counters go into 'delta', for the caller to add to the lock */
+static void wake_unlock_stat_locked(struct wake_lock *lock, int expired,
+				    struct wake_lock_stat *delta)
 {
 	ktime_t duration;
 	ktime_t now;
@@ -149,45 +236,58 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 		expired = 1;
 	else
 		now = ktime_get();
-	lock->stat.count++;
+	delta->count++;
 	if (expired)
-		lock->stat.expire_count++;
-	duration = ktime_sub(now, lock->stat.last_time);
-	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
-	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
-		lock->stat.max_time = duration;
-	lock->stat.last_time = ktime_get();
+		delta->expire_count++;
+	duration = ktime_sub(now, lock->last_time);
+	delta->total_time = ktime_add(delta->total_time, duration);
+	if (ktime_to_ns(duration) > ktime_to_ns(delta->max_time))
+		delta->max_time = duration;
+	lock->last_time = ktime_get();
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
 		duration = ktime_sub(now, last_sleep_time_update);
-		lock->stat.prevent_suspend_time = ktime_add(
-			lock->stat.prevent_suspend_time, duration);
+		delta->prevent_suspend_time = ktime_add(
+			delta->prevent_suspend_time, duration);
 		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 	}
 }
 
-static void update_sleep_wait_stats_locked(int done)
+static void update_sleep_wait_list_locked(struct list_head *head,
+					  ktime_t elapsed, int done)
 {
 	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
+	ktime_t etime, add;
 	int expired;
 
-	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
+	list_for_each_entry(lock, head, link) {
 		expired = get_expired_time(lock, &etime);
 		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
+			struct wake_lock_stat delta = { 0 };
+
 			if (expired)
 				add = ktime_sub(etime, last_sleep_time_update);
 			else
 				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
+			delta.prevent_suspend_time = add;
+			__wake_lock_stat_add(lock, &delta);
 		}
 		if (done || expired)
 			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 		else
 			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
 	}
+}
+
+static void update_sleep_wait_stats_locked(int done)
+{
+	ktime_t now, elapsed;
+
+	now = ktime_get();
+	elapsed = ktime_sub(now, last_sleep_time_update);
+	update_sleep_wait_list_locked(&active_wake_locks[WAKE_LOCK_SUSPEND],
+				      elapsed, done);
+	update_sleep_wait_list_locked(&timed_wake_locks[WAKE_LOCK_SUSPEND],
+				      elapsed, done);
 	last_sleep_time_update = now;
 }
 #endif
@@ -196,7 +296,10 @@ static void update_sleep_wait_stats_locked(int done)
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 1);
+	struct wake_lock_stat delta = { 0 };
+
+	wake_unlock_stat_locked(lock, 1, &delta);
+	__wake_lock_stat_add(lock, &delta);
 #endif
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
@@ -213,38 +316,54 @@ static void print_active_locks(int type)
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
 	list_for_each_entry(lock, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout > 0)
-				pr_info("active wake lock %s, time left %ld\n",
-					lock->name, timeout);
-			else if (print_expired)
-				pr_info("wake lock %s, expired\n", lock->name);
-		} else {
-			pr_info("active wake lock %s\n", lock->name);
-			if (!(debug_mask & DEBUG_EXPIRE))
-				print_expired = false;
-		}
+		pr_info("active wake lock %s\n", lock->name);
+		if (!(debug_mask & DEBUG_EXPIRE))
+			print_expired = false;
 	}
+	list_for_each_entry(lock, &timed_wake_locks[type], link) {
+		long timeout = lock->expires - jiffies;
+		if (timeout > 0)
+			pr_info("active wake lock %s, time left %ld\n",
+				lock->name, timeout);
+		else if (print_expired)
+			pr_info("wake lock %s, expired\n", lock->name);
+	}
+}
+
+/* Caller must acquire the list_lock spinlock. Timeouts are usually of
+ * similar length, so the insertion point is searched from the tail.
+ */
+static void add_timed_lock_locked(struct wake_lock *lock, int type)
+{
+	struct list_head *pos;
+
+	list_for_each_prev(pos, &timed_wake_locks[type]) {
+		struct wake_lock *l = list_entry(pos, struct wake_lock, link);
+		if ((long)(lock->expires - l->expires) >= 0)
+			break;
+	}
+	list_add(&lock->link, pos);
 }
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct list_head *timed = &timed_wake_locks[type];
+	struct wake_lock *lock;
+	unsigned long now = jiffies;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (!list_empty(&active_wake_locks[type]))
+		return -1;
+	while (!list_empty(timed)) {
+		lock = list_first_entry(timed, struct wake_lock, link);
+		if ((long)(lock->expires - now) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	if (list_empty(timed))
+		return 0;
+	lock = list_entry(timed->prev, struct wake_lock, link);
+	return lock->expires - now;
 }
 
 long has_wake_lock(int type)
@@ -351,7 +470,11 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.total_time = ktime_set(0, 0);
 	lock->stat.prevent_suspend_time = ktime_set(0, 0);
 	lock->stat.max_time = ktime_set(0, 0);
-	lock->stat.last_time = ktime_set(0, 0);
+	lock->last_time = ktime_set(0, 0);
+	lock->cpu_stat = alloc_percpu(struct wake_lock_cpu_stat);
+	if (!lock->cpu_stat)
+		pr_warning("wake_lock_init: no per-cpu stats for %s\n",
+			   lock->name);
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
@@ -365,27 +488,35 @@ EXPORT_SYMBOL(wake_lock_init);
 void wake_lock_destroy(struct wake_lock *lock)
 {
 	unsigned long irqflags;
+#ifdef CONFIG_WAKELOCK_STAT
+	struct wake_lock_stat stat;
+#endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
 	lock->flags &= ~WAKE_LOCK_INITIALIZED;
 #ifdef CONFIG_WAKELOCK_STAT
-	if (lock->stat.count) {
-		deleted_wake_locks.stat.count += lock->stat.count;
-		deleted_wake_locks.stat.expire_count += lock->stat.expire_count;
+	wake_lock_stat_sum(lock, &stat);
+	if (stat.count) {
+		deleted_wake_locks.stat.count += stat.count;
+		deleted_wake_locks.stat.expire_count += stat.expire_count;
 		deleted_wake_locks.stat.total_time =
 			ktime_add(deleted_wake_locks.stat.total_time,
-				  lock->stat.total_time);
+				  stat.total_time);
 		deleted_wake_locks.stat.prevent_suspend_time =
 			ktime_add(deleted_wake_locks.stat.prevent_suspend_time,
-				  lock->stat.prevent_suspend_time);
+				  stat.prevent_suspend_time);
 		deleted_wake_locks.stat.max_time =
 			ktime_add(deleted_wake_locks.stat.max_time,
-				  lock->stat.max_time);
+				  stat.max_time);
 	}
 #endif
 	list_del(&lock->link);
 	spin_unlock_irqrestore(&list_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	free_percpu(lock->cpu_stat);
+	lock->cpu_stat = NULL;
+#endif
 }
 EXPORT_SYMBOL(wake_lock_destroy);
 
@@ -395,6 +526,9 @@ static void wake_lock_internal(
 	int type;
 	unsigned long irqflags;
 	long expire_in;
+#ifdef CONFIG_WAKELOCK_STAT
+	struct wake_lock_stat delta = { 0 };
+#endif
 
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
@@ -405,18 +539,18 @@ static void wake_lock_internal(
 		if (debug_mask & DEBUG_WAKEUP)
 			pr_info("wakeup wake lock: %s\n", lock->name);
 		wait_for_wakeup = 0;
-		lock->stat.wakeup_count++;
+		delta.wakeup_count++;
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
 	    (long)(lock->expires - jiffies) <= 0) {
-		wake_unlock_stat_locked(lock, 0);
-		lock->stat.last_time = ktime_get();
+		wake_unlock_stat_locked(lock, 0, &delta);
+		lock->last_time = ktime_get();
 	}
 #endif
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
-		lock->stat.last_time = ktime_get();
+		lock->last_time = ktime_get();
 #endif
 	}
 	list_del(&lock->link);
@@ -427,7 +561,7 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		add_timed_lock_locked(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
@@ -461,7 +595,11 @@ static void wake_lock_internal(
 				queue_work(suspend_work_queue, &suspend_work);
 		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock(&list_lock);
+#ifdef CONFIG_WAKELOCK_STAT
+	wake_lock_stat_add(lock, &delta);
+#endif
+	local_irq_restore(irqflags);
 }
 
 void wake_lock(struct wake_lock *lock)
@@ -480,10 +618,13 @@ void wake_unlock(struct wake_lock *lock)
 {
 	int type;
 	unsigned long irqflags;
+#ifdef CONFIG_WAKELOCK_STAT
+	struct wake_lock_stat delta = { 0 };
+#endif
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 0);
+	wake_unlock_stat_locked(lock, 0, &delta);
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
@@ -513,7 +654,11 @@ void wake_unlock(struct wake_lock *lock)
 #endif
 		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock(&list_lock);
+#ifdef CONFIG_WAKELOCK_STAT
+	wake_lock_stat_add(lock, &delta);
+#endif
+	local_irq_restore(irqflags);
 }
 EXPORT_SYMBOL(wake_unlock);
 
@@ -541,8 +686,10 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		INIT_LIST_HEAD(&timed_wake_locks[i]);
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
@@ -0,0 +1,124 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  A fast, greedy compressor producing the LZ4 block format.  It
+ *  trades compression ratio for speed: one hash probe per position,
+ *  no lazy matching, and an accelerating skip over incompressible
+ *  data.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/lz4.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned((const u32 *)p) * 2654435761U)
+			>> (32 - LZ4_HASHLOG);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* Emit a token and literal run; *token is left for the match length */
+static unsigned char *lz4_put_literals(unsigned char *op,
+		unsigned char **token, const unsigned char *anchor, size_t len)
+{
+	*token = op++;
+
+	if (len >= RUN_MASK) {
+		**token = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, len - RUN_MASK);
+	} else
+		**token = len << ML_BITS;
+
+	memcpy(op, anchor, len);
+	return op + len;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	const unsigned char *ip = src, *anchor = src, *ref;
+	u32 *table = wrkmem;
+	unsigned char *op = dst, *token;
+	unsigned int misses = 0;
+	size_t len;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+
+	while (ip <= mflimit) {
+		u32 h = lz4_hash(ip);
+
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > MAX_DISTANCE ||
+		    get_unaligned((const u32 *)ref) !=
+		    get_unaligned((const u32 *)ip)) {
+			ip += 1 + (misses++ >> SKIPSTRENGTH);
+			continue;
+		}
+		misses = 0;
+
+		/* Extend the match backwards over pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		op = lz4_put_literals(op, &token, anchor, ip - anchor);
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		ip += MINMATCH;
+		ref += MINMATCH;
+		anchor = ip;
+		while (ip + 4 <= matchlimit &&
+		       get_unaligned((const u32 *)ip) ==
+		       get_unaligned((const u32 *)ref)) {
+			ip += 4;
+			ref += 4;
+		}
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		len = ip - anchor;
+		if (len >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else
+			*token |= len;
+
+		anchor = ip;
+	}
+
+last_literals:
+	op = lz4_put_literals(op, &token, anchor, iend - anchor);
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
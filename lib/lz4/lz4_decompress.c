@@ -0,0 +1,97 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Safe decoder for the LZ4 block format: every length and offset
+ *  read from the input is checked against the input and output
+ *  bounds, so corrupted data cannot overrun either buffer.
+ */
+
+#ifndef STATIC
+#include <linux/module.h>
+#include <linux/kernel.h>
+#endif
+
+#include <linux/lz4.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline int lz4_get_length(const unsigned char **ip,
+		const unsigned char *iend, size_t *len)
+{
+	unsigned int s;
+
+	do {
+		if (unlikely(*ip >= iend))
+			return -1;
+		s = *(*ip)++;
+		*len += s;
+	} while (s == 255);
+
+	return 0;
+}
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char * const iend = src + src_len;
+	unsigned char * const oend = dst + *dst_len;
+	const unsigned char *ip = src;
+	unsigned char *op = dst;
+	const unsigned char *ref;
+	unsigned int token;
+	size_t len, offset;
+
+	*dst_len = 0;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* literals */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK && lz4_get_length(&ip, iend, &len))
+			return -1;
+		if (unlikely(len > iend - ip || len > oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last sequence has no match part */
+		if (ip == iend)
+			break;
+
+		if (unlikely(iend - ip < 2))
+			return -1;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > op - dst))
+			return -1;
+		ref = op - offset;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK && lz4_get_length(&ip, iend, &len))
+			return -1;
+		len += MINMATCH;
+		if (unlikely(len > oend - op))
+			return -1;
+
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* overlapping copy replicates the last offset bytes */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dst_len = op - dst;
+	return 0;
+}
+#ifndef STATIC
+EXPORT_SYMBOL_GPL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
+#endif
@@ -0,0 +1,29 @@
+/*
+ *  lz4defs.h -- constants of the LZ4 block format
+ *
+ *  A block is a series of sequences.  Each sequence starts with a
+ *  token byte: the high nibble is the literal run length and the low
+ *  nibble is the match length minus MINMATCH.  A nibble value of 15
+ *  means the length continues in following bytes, each adding up to
+ *  255.  The literals follow, then a 16-bit little endian offset back
+ *  into the output.  The last sequence carries literals only.
+ */
+
+#define MINMATCH	4
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+#define MAX_DISTANCE	((1 << 16) - 1)
+
+/* The last match must start at least MFLIMIT bytes before the end */
+#define MFLIMIT		12
+/* ... and the last LASTLITERALS bytes are always literals */
+#define LASTLITERALS	5
+
+#define LZ4_HASHLOG	12
+#define LZ4_HASH_SIZE	(1 << LZ4_HASHLOG)
+
+/* After this many misses in a row, start skipping input faster */
+#define SKIPSTRENGTH	6
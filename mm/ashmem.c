@@ -27,6 +27,7 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -37,7 +38,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +47,13 @@ struct ashmem_area {
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex mutex;		/* protects all of the above */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's mutex; 'lru' by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,18 +64,24 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and count
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Pin and unpin only take it for the list operation itself, under their
+ * area's mutex. The shrinker takes area mutexes with mutex_trylock()
+ * while holding it and passes over busy areas, so reclaim never waits
+ * for pin/unpin callers and vice versa.
+ *
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *                asma->mutex -> i_mutex -> i_alloc_sem
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -104,16 +112,26 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/* Caller must hold ashmem_lru_lock */
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
@@ -123,7 +141,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -159,7 +177,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold the range's asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +187,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -187,6 +208,7 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,10 +221,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +239,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +260,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -247,7 +269,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,7 +290,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -285,7 +307,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,7 +350,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -346,10 +368,14 @@ out:
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
  * pages freed.
+ *
+ * Ranges whose area is busy pinning, unpinning or being released are passed
+ * over rather than waited for. Holding the area's mutex keeps the range and
+ * the area alive once ashmem_lru_lock is dropped for the truncate.
  */
 static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
@@ -357,21 +383,35 @@ static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	if (!nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	spin_lock(&ashmem_lru_lock);
+restart:
+	list_for_each_entry(range, &ashmem_lru_list, lru) {
+		struct ashmem_area *asma = range->asma;
+		struct inode *inode;
+		loff_t start, end;
+
+		if (!mutex_trylock(&asma->mutex))
+			continue;
+
+		__lru_del(range);
+		spin_unlock(&ashmem_lru_lock);
+
+		inode = asma->file->f_dentry->d_inode;
+		start = range->pgstart * PAGE_SIZE;
+		end = (range->pgend + 1) * PAGE_SIZE - 1;
 
 		vmtruncate_range(inode, start, end);
 		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
-
 		nr_to_scan -= range_size(range);
+		mutex_unlock(&asma->mutex);
+
 		if (nr_to_scan <= 0)
-			break;
+			return lru_count;
+
+		spin_lock(&ashmem_lru_lock);
+		goto restart;
 	}
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
 
 	return lru_count;
 }
@@ -385,7 +425,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -400,7 +440,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -408,7 +448,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -422,7 +462,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -431,7 +471,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -448,7 +488,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -457,7 +497,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -523,7 +563,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -558,7 +598,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -607,7 +647,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -621,7 +661,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }